@@ -0,0 +1,156 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Duda I/O
+ *  --------
+ *  Copyright (C) 2012-2016, Eduardo Silva P. <eduardo@monkey.io>.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+
+/*
+ * Microbenchmark of the dthread context switch: a dthread yields back to
+ * the caller which resumes it again, each round trip is two switches. The
+ * same loop done with swapcontext(3) is measured as reference, it's the
+ * switch used on platforms without the assembly routine.
+ *
+ * usage: duda-bench-dthread [round_trips]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <pthread.h>
+#include <ucontext.h>
+
+#include <monkey/mk_api.h>
+#include <duda/objects/duda_dthread.h>
+
+#define BENCH_ROUNDS      2000000
+#define BENCH_STACK_SIZE  (64 * 1024)
+
+static long rounds;
+static struct plugin_api api;
+
+static ucontext_t uc_main;
+static ucontext_t uc_coro;
+
+static double now_ns()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (ts.tv_sec * 1e9) + ts.tv_nsec;
+}
+
+static void dthread_pinger(void *data)
+{
+    long *count = data;
+
+    while (1) {
+        (*count)++;
+        duda_dthread_yield();
+    }
+}
+
+static void ucontext_pinger()
+{
+    while (1) {
+        rounds++;
+        swapcontext(&uc_coro, &uc_main);
+    }
+}
+
+static double bench_dthread(long n)
+{
+    int id;
+    long i;
+    long count = 0;
+    double start;
+
+    id = duda_dthread_create(dthread_pinger, &count);
+    start = now_ns();
+    for (i = 0; i < n; i++) {
+        duda_dthread_resume(id);
+    }
+
+    if (count != n) {
+        fprintf(stderr, "dthread: %ld resumes, %ld yields\n", n, count);
+        exit(EXIT_FAILURE);
+    }
+    return now_ns() - start;
+}
+
+static double bench_ucontext(long n)
+{
+    long i;
+    double start;
+    char *stack;
+
+    stack = malloc(BENCH_STACK_SIZE);
+    if (!stack) {
+        exit(EXIT_FAILURE);
+    }
+
+    getcontext(&uc_coro);
+    uc_coro.uc_stack.ss_sp   = stack;
+    uc_coro.uc_stack.ss_size = BENCH_STACK_SIZE;
+    uc_coro.uc_link = &uc_main;
+    makecontext(&uc_coro, ucontext_pinger, 0);
+
+    start = now_ns();
+    for (i = 0; i < n; i++) {
+        swapcontext(&uc_main, &uc_coro);
+    }
+
+    if (rounds != n) {
+        fprintf(stderr, "ucontext: %ld swaps, %ld rounds\n", n, rounds);
+        exit(EXIT_FAILURE);
+    }
+    return now_ns() - start;
+}
+
+int main(int argc, char **argv)
+{
+    long n = BENCH_ROUNDS;
+    double t;
+
+    if (argc > 1) {
+        n = atol(argv[1]);
+        if (n <= 0) {
+            fprintf(stderr, "usage: %s [round_trips]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    /* The dthreads only need the memory interface of the server */
+    api.mem_alloc   = mk_mem_alloc;
+    api.mem_alloc_z = mk_mem_alloc_z;
+    api.mem_realloc = mk_mem_realloc;
+    api.mem_free    = mk_mem_free;
+    mk_api = &api;
+    pthread_key_create(&duda_dthread_scheduler, NULL);
+
+    /* warm up: stacks and scheduler */
+    bench_dthread(1000);
+
+    t = bench_dthread(n);
+    printf("dthread yield/resume : %6.1f ns per switch (%ld round trips)\n",
+           t / n / 2, n);
+
+    t = bench_ucontext(n);
+    printf("swapcontext(3)       : %6.1f ns per switch (%ld round trips)\n",
+           t / n / 2, n);
+
+    return 0;
+}
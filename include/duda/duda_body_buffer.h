@@ -20,21 +20,44 @@
 #ifndef DUDA_BODY_BUFFER_H
 #define DUDA_BODY_BUFFER_H
 
+#include <sys/uio.h>
+#include <monkey/mk_core.h>
+
+#include "duda_queue_map.h"
+
 /*
- * The response body holds an IOV array struct of BODY_BUFFER_SIZE,
- * when the limit is reached, the pointer is reallocated adding a new chunk
+ * The response body holds an IOV array struct of BODY_BUFFER_SIZE, when
+ * the limit is reached the consumed entries are compacted or the array
+ * doubles its size. Writes go in windows of at most IOV_MAX entries.
  */
-#define BODY_BUFFER_SIZE  8
+#define BODY_BUFFER_SIZE      8
+
+/* Min bytes of a single write to use MSG_ZEROCOPY */
+#define BODY_BUFFER_ZEROCOPY  (4 << 20)
 
+/*
+ * Requests of a connection that can start while its zero copy sends are in
+ * flight, and milliseconds to wait for them once that limit is reached.
+ */
+#define BODY_BUFFER_ZEROCOPY_DEFER   4
+#define BODY_BUFFER_ZEROCOPY_WAIT    100
 
 struct duda_body_buffer {
     struct mk_iov *buf;
-    unsigned short int size;
+    unsigned int size;
+    unsigned int head;            /* first entry with pending data */
     unsigned long int sent;
 };
 
 struct duda_body_buffer *duda_body_buffer_new();
 int duda_body_buffer_expand(struct duda_body_buffer *bb);
+int duda_body_buffer_add(struct duda_body_buffer *bb, void *data, size_t len);
+size_t duda_body_buffer_consume(struct duda_body_buffer *bb, size_t bytes);
+ssize_t duda_body_buffer_writev(int sock, struct iovec *iov, int n, size_t size,
+                                struct duda_zerocopy *zc);
+int duda_body_buffer_zerocopy_pending(int sock, struct duda_zerocopy *zc);
+int duda_body_buffer_zerocopy_wait(int sock, struct duda_zerocopy *zc, int ms);
+void duda_body_buffer_zerocopy_abort(int sock);
 int duda_body_buffer_flush(int sock, struct duda_body_buffer *bb);
 
 #endif
@@ -0,0 +1,84 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Duda I/O
+ *  --------
+ *  Copyright (C) 2012-2016, Eduardo Silva P. <eduardo@monkey.io>.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef DUDA_COMPRESS_H
+#define DUDA_COMPRESS_H
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <monkey/mk_core.h>
+
+#ifdef DUDA_HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#ifdef DUDA_HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+/* Content encodings */
+#define DUDA_COMPRESS_NONE       0
+#define DUDA_COMPRESS_GZIP       1
+#define DUDA_COMPRESS_ZSTD       2
+
+/* Operations for duda_compress_run() */
+#define DUDA_COMPRESS_CONTINUE   0   /* consume input                     */
+#define DUDA_COMPRESS_FLUSH      1   /* emit everything consumed so far   */
+#define DUDA_COMPRESS_END        2   /* finish the stream                 */
+
+#define DUDA_COMPRESS_MIN_SIZE   512         /* smaller bodies go as is      */
+#define DUDA_COMPRESS_FILE_MAX   (16 << 20)  /* bigger files are not cached  */
+#define DUDA_COMPRESS_FREE       8           /* contexts kept by each worker */
+#define DUDA_COMPRESS_GZIP_LEVEL 6
+#define DUDA_COMPRESS_ZSTD_LEVEL 3
+#define DUDA_COMPRESS_CACHE_TMP  "duda-compress.XXXXXX"
+
+/*
+ * A compressor context. Contexts are expensive to create, each worker
+ * keeps the released ones and reset them for the next response.
+ */
+struct duda_compress {
+    int encoding;
+#ifdef DUDA_HAVE_ZLIB
+    z_stream z;
+#endif
+#ifdef DUDA_HAVE_ZSTD
+    ZSTD_CCtx *zstd;
+#endif
+    struct duda_compress *next;
+};
+
+struct duda_sendfile;
+
+int duda_compress_negotiate(mk_ptr_t *accept_encoding);
+int duda_compress_type(mk_ptr_t *content_type);
+int duda_compress_header(int encoding, char **row);
+char *duda_compress_ext(int encoding);
+
+struct duda_compress *duda_compress_acquire(int encoding);
+void duda_compress_release(struct duda_compress *c);
+int duda_compress_run(struct duda_compress *c, int op,
+                      const char **in, size_t *in_len,
+                      char **out, size_t *out_avail);
+
+int duda_compress_set_dir(const char *dir);
+int duda_compress_file_size(off_t size);
+int duda_compress_file(struct duda_sendfile *sf, int encoding);
+
+#endif
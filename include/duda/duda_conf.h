@@ -45,6 +45,7 @@ struct vhost_services {
     struct host *host;                 /* virtual host reference with Monkey */
     struct web_service *root_service;  /* optional root service              */
     struct mk_list services;           /* list of web services under this VH */
+    struct duda_dispatch *services_index; /* service name -> web service     */
     struct mk_list _head;              /* head for services_loaded HEAD      */
 };
 
@@ -0,0 +1,47 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Duda I/O
+ *  --------
+ *  Copyright (C) 2012-2016, Eduardo Silva P. <eduardo@monkey.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include <monkey/mk_api.h>
+
+#ifndef DUDA_COOKIE_MAP_H
+#define DUDA_COOKIE_MAP_H
+
+/*
+ * The Cookie header is tokenized the first time a cookie is requested,
+ * entries and the name index are allocated on the request arena. We never
+ * take more than COOKIE_ENTRIES_MAX cookies.
+ */
+#define COOKIE_ENTRIES_MAX  256
+
+struct duda_cookie_entry {
+    mk_ptr_t name;
+    mk_ptr_t value;
+};
+
+struct duda_cookie_map {
+    int parsed;        /* MK_TRUE once the Cookie header was tokenized   */
+    int count;         /* number of cookies sent by the client           */
+    struct duda_cookie_entry *entries;
+
+    /* Open addressing index: name hash -> entry position + 1 */
+    int index_size;
+    int *index;
+};
+
+#endif
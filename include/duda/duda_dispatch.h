@@ -0,0 +1,51 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Duda I/O
+ *  --------
+ *  Copyright (C) 2012-2016, Eduardo Silva P. <eduardo@monkey.io>.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef DUDA_DISPATCH_H
+#define DUDA_DISPATCH_H
+
+/*
+ * The dispatch index is a small open addressing hash table built at
+ * start up, it maps a key (a Host reference, a service name or the first
+ * segment of an URI) to the context that owns it. It's populated once
+ * before the workers start and it's read-only after that, so it can be
+ * shared by every worker without locking.
+ */
+#define DUDA_DISPATCH_MIN_SIZE   16
+
+struct duda_dispatch_entry {
+    unsigned int hash;
+    int key_len;
+    char *key;              /* NULL if the slot is empty */
+    void *data;
+};
+
+struct duda_dispatch {
+    int size;               /* number of slots, always a power of two */
+    int count;              /* number of used slots */
+    struct duda_dispatch_entry *entries;
+};
+
+struct duda_dispatch *duda_dispatch_create(int count);
+int duda_dispatch_add(struct duda_dispatch *d, const void *key, int len,
+                      void *data);
+void *duda_dispatch_get(struct duda_dispatch *d, const void *key, int len);
+void duda_dispatch_destroy(struct duda_dispatch *d);
+
+#endif
@@ -23,6 +23,8 @@
 #include <monkey/mk_api.h>
 #include <monkey/mk_core.h>
 #include "duda.h"
+#include "duda_timer.h"
+#include "duda_mailbox.h"
 
 #define DUDA_EVENT_READ             MK_EVENT_READ
 #define DUDA_EVENT_WRITE            MK_EVENT_WRITE
@@ -38,9 +40,6 @@
 #define DUDA_EVENT_CLOSE            MK_PLUGIN_RET_EVENT_CLOSE
 #define DUDA_EVENT_CONTINUE         MK_PLUGIN_RET_EVENT_CONTINUE
 
-/* Thread key to map the event lists per worker */
-extern __thread struct mk_list *duda_events_list;
-
 struct duda_event_signal_channel {
     int fd_r;
     int fd_w;
@@ -49,10 +48,19 @@ struct duda_event_signal_channel {
 
 struct mk_list duda_event_signals_list;
 
+/*
+ * An event handler. Its mk_event goes first so the worker event loop hands
+ * the handler itself to the dispatcher. The handler of a file descriptor
+ * is kept in its slot of the worker table once it's deleted, sockfd is -1
+ * while the slot is unused.
+ */
 struct duda_event_handler {
+    struct mk_event event;
+
     int sockfd;
-    int mode;
+    int mode;                  /* last active mode, restored on wakeup   */
     int behavior;
+    int registered;            /* MK_TRUE if it lives on the event loop   */
 
     int (*cb_on_read) (int, void *);
     int (*cb_on_write) (int, void *);
@@ -61,9 +69,19 @@ struct duda_event_handler {
     int (*cb_on_timeout) (int, void *);
 
     void *cb_data;
-    struct mk_list _head;
 };
 
+/* Worker table of event handlers indexed by file descriptor */
+#define DUDA_EVENT_TABLE_FDS   1024   /* initial size */
+
+struct duda_event_table {
+    int size;
+    struct mk_event_loop *loop;
+    struct duda_event_handler **fds;
+};
+
+extern __thread struct duda_event_table *duda_events;
+
 struct duda_api_event {
     int (*add) (int,
                 int, int,
@@ -79,6 +97,18 @@ struct duda_api_event {
     int (*signal) (uint64_t);
     int (*create_signal_fd) ();
 
+    /* Timers on the worker timer wheel */
+    struct duda_timer *(*timer_add) (int,
+                                     void (*cb) (struct duda_timer *, void *),
+                                     void *);
+    int (*timer_cancel) (struct duda_timer *);
+    int (*timer_reschedule) (struct duda_timer *, int);
+
+    /* Cross thread mailboxes of the workers */
+    int (*mailbox_post) (int, void (*cb) (void *), void *);
+    int (*mailbox_self) ();
+    int (*mailbox_workers) ();
+
     /* Loop based calls */
     struct mk_event_loop *(*loop_create) (int);
     int (*loop_add) (struct mk_event_loop *, int, int, uint32_t, void *);
@@ -108,9 +138,13 @@ struct duda_event_handler *duda_event_lookup(int sockfd);
 /* Change the file descriptor mode and behavior */
 int duda_event_mode(int sockfd, int mode, int behavior);
 
-/* Delete an event_handler from the thread list */
+/* Delete an event_handler from the worker table */
 int duda_event_delete(int sockfd);
 
+/* Worker table setup and release */
+int duda_event_worker_init();
+void duda_event_worker_exit();
+
 /* Emit a signal to all workers */
 int duda_event_signal(uint64_t val);
 int duda_event_create_signal_fd();
@@ -0,0 +1,71 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Duda I/O
+ *  --------
+ *  Copyright (C) 2012-2016, Eduardo Silva P. <eduardo@monkey.io>.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef DUDA_FCACHE_H
+#define DUDA_FCACHE_H
+
+#include <sys/types.h>
+#include <time.h>
+#include <monkey/mk_core.h>
+
+/*
+ * Each worker keeps the files served through sendfile() open together with
+ * their metadata, so serving the same file again costs no open() or stat().
+ * An entry is checked against the file system again once it's older than
+ * DUDA_FCACHE_TTL seconds, if the file changed the entry is dropped.
+ */
+#define DUDA_FCACHE_BUCKETS   256    /* hash buckets, power of two          */
+#define DUDA_FCACHE_MAX       512    /* max open files kept by a worker     */
+#define DUDA_FCACHE_TTL       2      /* seconds before checking again       */
+
+struct duda_fcache_entry {
+    int fd;
+    int refs;                        /* the cache plus each request using it */
+    unsigned int hash;
+    int path_len;
+    char *path;
+
+    /* file metadata */
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    time_t mtime;
+    time_t checked;                  /* last time the metadata was verified  */
+
+    /* strong validator: "mtime-size" */
+    int etag_len;
+    char etag[40];
+
+    struct mk_list _head;            /* bucket list                          */
+    struct mk_list _head_lru;        /* least recently used first            */
+};
+
+struct duda_fcache {
+    int count;
+    struct mk_list lru;
+    struct mk_list buckets[DUDA_FCACHE_BUCKETS];
+};
+
+int duda_fcache_etag(char *buf, int size, time_t mtime, off_t fsize);
+struct duda_fcache_entry *duda_fcache_find(const char *path);
+struct duda_fcache_entry *duda_fcache_get(const char *path);
+struct duda_fcache_entry *duda_fcache_get_flags(const char *path, int flags);
+void duda_fcache_put(struct duda_fcache_entry *fe);
+
+#endif
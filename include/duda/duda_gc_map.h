@@ -1,14 +1,36 @@
 #ifndef DUDA_GC_MAP_H
 #define DUDA_GC_MAP_H
 
+#include <stddef.h>
+
 #define DUDA_GC_ENTRIES     64
 #define DUDA_GC_CHUNK       16
 
+/*
+ * Request arena: memory requested through gc->alloc() is taken from chunks
+ * of DUDA_GC_ARENA_SIZE bytes, all of them are released in one step once
+ * the request ends. Chunks are recycled through a per-worker free list.
+ */
+#define DUDA_GC_ARENA_SIZE   4096
+#define DUDA_GC_ARENA_ALIGN  16
+#define DUDA_GC_ARENA_BIG    (DUDA_GC_ARENA_SIZE / 4)  /* own chunk above */
+#define DUDA_GC_ARENA_FREE   64      /* chunks kept on the worker free list */
+
+struct duda_gc_chunk {
+  size_t size;                  /* usable bytes on data */
+  size_t used;                  /* bytes taken          */
+  struct duda_gc_chunk *next;
+  char data[];
+};
+
 struct duda_gc_map {
   int used;                     /* number of used cells */
   int size;                     /* number of cells      */
 
   struct duda_gc_entry *cells;
+
+  /* current arena chunk, linked to the previous ones */
+  struct duda_gc_chunk *arena;
 };
 
 struct duda_gc_entry {
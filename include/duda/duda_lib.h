@@ -30,6 +30,15 @@ struct duda {
 
     /* List head for active web services */
     struct mk_list services;
+
+    /*
+     * Dispatch index built on duda_start(): it maps the first segment of
+     * an URI to a NULL terminated array of the services that can serve
+     * it. Services with routes that catch any first segment are listed
+     * on dispatch_any.
+     */
+    struct duda_dispatch *dispatch;
+    struct duda_service **dispatch_any;
 };
 
 #define DUDA_DEFAULT_PORT   "8080"
@@ -0,0 +1,65 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Duda I/O
+ *  --------
+ *  Copyright (C) 2012-2016, Eduardo Silva P. <eduardo@monkey.io>.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef DUDA_MAILBOX_H
+#define DUDA_MAILBOX_H
+
+#include <stdint.h>
+#include <monkey/mk_core.h>
+
+/*
+ * Each worker owns a mailbox where any thread can post work to be run on
+ * the worker event loop. The mailbox is a bounded lock-free multiple
+ * producers / single consumer ring of DUDA_MAILBOX_SIZE messages, every
+ * slot carries a sequence number so producers only compete for the tail.
+ *
+ * Wakeups go through an eventfd registered on the worker loop. A producer
+ * only writes to it if the worker was not notified yet, so a burst of
+ * messages costs a single write() and a single loop wakeup.
+ */
+#define DUDA_MAILBOX_SIZE       4096   /* messages, power of two           */
+#define DUDA_MAILBOX_WORKERS    256    /* max number of mailboxes          */
+#define DUDA_MAILBOX_CACHELINE  64
+
+struct duda_mailbox_msg {
+    unsigned long seq;
+    void (*cb) (void *);
+    void *data;
+};
+
+struct duda_mailbox {
+    int id;                          /* worker index                  */
+    int efd;                         /* eventfd on the worker loop    */
+    struct duda_mailbox_msg *msgs;
+
+    /* producers side */
+    unsigned long tail __attribute__ ((aligned(DUDA_MAILBOX_CACHELINE)));
+    int notified;
+
+    /* consumer side, only touched by the worker */
+    unsigned long head __attribute__ ((aligned(DUDA_MAILBOX_CACHELINE)));
+};
+
+int duda_mailbox_post(int worker, void (*cb) (void *), void *data);
+int duda_mailbox_self();
+int duda_mailbox_workers();
+int duda_mailbox_worker_init();
+void duda_mailbox_worker_exit();
+
+#endif
@@ -40,8 +40,9 @@ extern struct mk_plugin mk_plugin_duda;
 /* self identifier for the plugin context inside Monkey internals */
 struct mk_plugin *duda_plugin;
 
-pthread_key_t duda_global_events_write;
-pthread_key_t duda_global_dr_list;
+/* Dispatch index: Monkey virtual host reference -> vhost_services */
+struct duda_dispatch *duda_vhost_index;
+
 pthread_mutex_t duda_mutex_thctx;
 
 mk_ptr_t dd_iov_none;
@@ -50,7 +51,7 @@ void *duda_load_library(const char *path);
 void *duda_load_symbol(void *handle, const char *symbol);
 int duda_service_end(duda_request_t *dr);
 
-duda_request_t *duda_dr_list_get(struct mk_http_request *sr);
 void duda_worker_init();
+void duda_server_worker_init();
 
 #endif
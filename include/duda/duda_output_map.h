@@ -0,0 +1,82 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Duda I/O
+ *  --------
+ *  Copyright (C) 2012-2016, Eduardo Silva P. <eduardo@monkey.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef DUDA_OUTPUT_MAP_H
+#define DUDA_OUTPUT_MAP_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/*
+ * The response body composed through print() and printf() is gathered in
+ * a list of segments that lives in the request arena. Small pieces are
+ * copied together in DUDA_OUTPUT_CHUNK buffers, bigger pieces are just
+ * referenced.
+ *
+ * In buffered mode (default) the segments are handed to the server at once
+ * when the response ends, so the Content-Length is known. In streaming mode
+ * the body goes out with chunked encoding on every flush() or when more
+ * than DUDA_OUTPUT_FLUSH bytes are pending. A buffered response that reach
+ * that size without a fixed Content-Length switch to streaming mode.
+ *
+ * Once files are enqueued in the output queue the segments are moved after
+ * them, so the body keeps its order. With a fixed Content-Length they are
+ * written with the queue when DUDA_OUTPUT_FLUSH bytes are pending, without
+ * it no more than that can be buffered.
+ */
+#define DUDA_OUTPUT_CHUNK      4096
+#define DUDA_OUTPUT_COPY_MAX   1024
+#define DUDA_OUTPUT_FLUSH      65536
+#define DUDA_OUTPUT_SEGS       16
+
+/* Response body modes */
+#define DUDA_OUTPUT_BUFFERED   0
+#define DUDA_OUTPUT_STREAM     1
+
+struct duda_compress;
+
+struct duda_output_seg {
+    char *data;
+    size_t len;
+};
+
+struct duda_output_map {
+    int mode;                     /* DUDA_OUTPUT_BUFFERED or _STREAM      */
+    size_t bytes;                 /* pending bytes                        */
+    size_t flushed;               /* bytes already handed to the server   */
+
+    int n_segs;                   /* used segments                        */
+    int size_segs;                /* allocated segments                   */
+    struct duda_output_seg *segs;
+
+    /* copy buffer of the last segment, NULL if it's a reference */
+    char *tail;
+    size_t tail_size;
+
+    /* content encoding, -1 until it's negotiated */
+    int encoding;
+    struct duda_compress *compress;
+
+    /* ETag of a file sent as the whole body, it depends on the encoding */
+    char *etag;
+    int etag_len;
+    off_t etag_size;              /* size of that file                    */
+};
+
+#endif
@@ -23,20 +23,29 @@
 #define DUDA_QS_MAP_H
 
 /*
- * We initially define that we will get no more than QS_ENTRIES_SIZE variables
- * in the query string. This is a fixed value to reduce the risk of a memory
+ * The query string is parsed the first time a qs method is used. Entries
+ * and the key index are allocated on the request arena, we never take
+ * more than QS_ENTRIES_MAX variables to reduce the risk of a memory
  * consumption attack.
  */
-#define QS_ENTRIES_SIZE 32
+#define QS_ENTRIES_MAX  1024
 
 struct duda_qs_entry {
     mk_ptr_t key;
     mk_ptr_t value;
+
+    int decoded;       /* MK_TRUE if value was percent-decoded already  */
+    int next;          /* next entry with the same key, -1 if none      */
 };
 
 struct duda_qs_map {
-    int count;         /* number of key/values in the query string */
-    struct duda_qs_entry entries[QS_ENTRIES_SIZE];
+    int parsed;        /* MK_TRUE once the query string was parsed      */
+    int count;         /* number of key/values in the query string      */
+    struct duda_qs_entry *entries;
+
+    /* Open addressing index: key hash -> first entry position + 1 */
+    int index_size;
+    int *index;
 };
 
 
@@ -26,26 +26,34 @@
 #define DUDA_QTYPE_BODY_BUFFER   1
 #define DUDA_QTYPE_SENDFILE      2
 
-/* Queue item status */
-#define DUDA_QSTATUS_ACTIVE      1
-#define DUDA_QSTATUS_INACTIVE    0
+/* Max number of buffers gathered on a single writev() */
+#define DUDA_QUEUE_IOV          64
 
 struct duda_queue_item {
     short int type;        /* item type */
-    short int status;      /* item status */
     void *data;            /* the data it self */
 
     struct mk_list _head;  /* link to the queue list */
 };
 
+static inline void duda_queue_init(struct duda_queue *queue)
+{
+    queue->bytes = 0;
+    mk_list_init(&queue->items);
+}
+
+/* Number of bytes pending to be sent */
+static inline unsigned long duda_queue_length(struct duda_queue *queue)
+{
+    return queue->bytes;
+}
+
 struct duda_queue_item *duda_queue_item_new(short int type);
-int duda_queue_add(struct duda_queue_item *item, struct mk_list *queue);
-struct duda_queue_item *duda_queue_last(struct mk_list *queue);
-unsigned long duda_queue_length(struct mk_list *queue);
+int duda_queue_add(struct duda_queue_item *item, struct duda_queue *queue);
+struct duda_queue_item *duda_queue_last(struct duda_queue *queue);
 int duda_queue_flush(duda_request_t *dr);
-int duda_queue_free(struct mk_list *queue);
+int duda_queue_free(struct duda_queue *queue);
 
-int duda_queue_event_write_callback(int sockfd);
 int duda_queue_event_is_registered_write(duda_request_t *dr);
 int duda_queue_event_register_write(duda_request_t *dr);
 int duda_queue_event_unregister_write(duda_request_t *dr);
@@ -0,0 +1,49 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Duda I/O
+ *  --------
+ *  Copyright (C) 2012-2016, Eduardo Silva P. <eduardo@monkey.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef DUDA_QUEUE_MAP_H
+#define DUDA_QUEUE_MAP_H
+
+#include <monkey/mk_core.h>
+
+/*
+ * Output queue of a request: body buffers and files pending to be written
+ * to the socket. The first item is always the next one to send, items are
+ * released as soon as they are written and the pending bytes of all the
+ * items are accounted on every change, so the queue length is known
+ * without walking the list.
+ */
+struct duda_queue {
+    unsigned long bytes;          /* pending bytes           */
+    struct mk_list items;         /* pending items, in order */
+};
+
+/*
+ * MSG_ZEROCOPY state of a connection. The kernel numbers the zero copy
+ * sends of a socket and report them back on the socket error queue once
+ * it's done with the memory, the body must be kept until then.
+ */
+struct duda_zerocopy {
+    int enabled;                  /* 0: not set, 1: enabled, -1: failed */
+    unsigned int sent;            /* zero copy sends issued             */
+    unsigned int done;            /* sends reported as completed        */
+    int deferred;                 /* arena resets put off               */
+};
+
+#endif
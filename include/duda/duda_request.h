@@ -0,0 +1,144 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Duda I/O
+ *  --------
+ *  Copyright (C) 2012-2016, Eduardo Silva P. <eduardo@monkey.io>.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef DUDA_REQUEST_H
+#define DUDA_REQUEST_H
+
+#include <sys/types.h>
+#include <monkey/mk_core.h>
+#include <monkey/mk_lib.h>
+
+#include "duda_gc_map.h"
+#include "duda_qs_map.h"
+#include "duda_cookie_map.h"
+#include "duda_output_map.h"
+#include "duda_queue_map.h"
+#include "duda_router_uri.h"
+
+struct duda_timer;
+struct duda_service;
+struct duda_router_path;
+
+/* Duda request context, one per HTTP request served by a service */
+typedef struct duda_request {
+    /* Socket file descriptor of the client connection and its inode */
+    int socket;
+    ino_t socket_ino;
+
+    /* Web service name, used to compose cookie paths */
+    mk_ptr_t appname;
+
+    /* Owner service and Monkey contexts: session and request */
+    struct duda_service *service;
+    struct mk_http_session *session;
+    struct mk_http_request *request;
+
+    /* Callback invoked once the response ends */
+    void (*end_callback) (struct duda_request *);
+
+    /* Internal statuses */
+    long _st_http_content_length;
+    int _st_http_headers_sent;
+    int _st_http_headers_off;
+    int _st_body_writes;
+    int _st_service_end;
+    int _st_active;              /* request in progress on the socket */
+    int _st_response_end;        /* end() was invoked            */
+    int _st_write_pending;       /* waiting for write events */
+
+    /* Duplicate of the socket watched for write events */
+    int write_fd;
+
+    /* Query string */
+    struct duda_qs_map qs;
+
+    /* Cookies sent by the client */
+    struct duda_cookie_map cookies;
+
+    /* Garbage collector */
+    struct duda_gc_map gc;
+
+    /* Router: URI segments and the matched path */
+    struct duda_router_uri router_uri;
+    struct duda_router_path *router_path;
+
+    /* Response body gathered by print() and printf() */
+    struct duda_output_map out;
+
+    /* Output queue */
+    struct duda_queue queue_out;
+
+    /* MSG_ZEROCOPY sends on the connection */
+    struct duda_zerocopy zerocopy;
+
+    /* Link to the worker pool list of free contexts */
+    struct mk_list _head_pool;
+} duda_request_t;
+
+/*
+ * Each worker keeps a pool of request contexts. Active contexts are indexed
+ * by socket so a keep-alive connection reuse the same context for every
+ * request, once the connection ends the context returns to the free list
+ * for the next connection.
+ */
+#define DUDA_REQUEST_POOL_FDS    1024   /* initial size of the socket table */
+#define DUDA_REQUEST_POOL_MAX    256    /* max number of free contexts kept */
+#define DUDA_REQUEST_SWEEP       1000   /* ms between closed sockets checks */
+
+struct duda_request_pool {
+    /* Active contexts indexed by socket */
+    int fd_size;
+    int n_active;
+    duda_request_t **fds;
+
+    /* Library mode: timer that releases the contexts of closed sockets */
+    struct duda_timer *sweep;
+
+    /* Recycled contexts */
+    int n_free;
+    struct mk_list free;
+};
+
+extern __thread struct duda_request_pool *duda_request_pool;
+
+int duda_request_pool_init();
+void duda_request_pool_exit();
+
+/* Returns the active context of a socket, NULL if there is none */
+static inline duda_request_t *duda_request_lookup(int socket)
+{
+    struct duda_request_pool *pool = duda_request_pool;
+
+    if (!pool || socket < 0 || socket >= pool->fd_size) {
+        return NULL;
+    }
+
+    return pool->fds[socket];
+}
+
+duda_request_t *duda_request_acquire(int socket);
+void duda_request_release(duda_request_t *dr);
+void duda_request_close(int socket);
+int duda_request_gc_reset(duda_request_t *dr);
+duda_request_t *duda_request_create(mk_request_t *request,
+                                    struct duda_service *ds,
+                                    struct duda_router_path *path,
+                                    struct duda_router_uri *ruri);
+
+#endif
@@ -20,12 +20,33 @@
 #ifndef MK_DUDA_ROUTER_URI_H
 #define MK_DUDA_ROUTER_URI_H
 
+#include <stdint.h>
+
 #define DUDA_ROUTER_URI_MAX   32
 
+/*
+ * Types of a ':var' capture, set on the pattern as ':name<type>'. A capture
+ * without type accepts any segment.
+ */
+#define DUDA_ROUTER_TANY       0
+#define DUDA_ROUTER_TU64       1
+#define DUDA_ROUTER_TI64       2
+#define DUDA_ROUTER_TDOUBLE    3
+#define DUDA_ROUTER_TSLUG      4
+
 struct duda_router_uri_field {
+    /* Capture type the segment was validated against */
     int type;
+
     int name_len;
     char *name;
+
+    /* Value converted while matching, set for numeric types only */
+    union {
+        int64_t  i64;
+        uint64_t u64;
+        double   d;
+    } val;
 };
 
 /*
@@ -20,16 +20,22 @@
 #ifndef DUDA_SENDFILE_H
 #define DUDA_SENDFILE_H
 
+#include "duda_fcache.h"
+
 struct duda_sendfile {
     int fd;
     off_t offset;
     unsigned long pending_bytes;
 
-    struct file_info info;
+    /* open file shared through the worker file cache */
+    struct duda_fcache_entry *fc;
 };
 
 struct duda_sendfile *duda_sendfile_new(char *path, off_t offset,
                                         size_t count);
+struct duda_sendfile *duda_sendfile_entry(struct duda_fcache_entry *fe,
+                                          off_t offset, size_t count);
 int duda_sendfile_flush(int socket, struct duda_sendfile *sf);
+void duda_sendfile_free(struct duda_sendfile *sf);
 
 #endif
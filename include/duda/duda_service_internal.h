@@ -35,6 +35,8 @@ struct duda_service {
 
     /* Specific requirements by API Objects used in duda_main() context */
     struct mk_list router_list; /* list head for routing paths        */
+    struct duda_router_node *router_tree; /* compiled routing paths   */
+    mk_ptr_t static_headers;    /* header rows added to every response */
 };
 
 #endif
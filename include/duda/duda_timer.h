@@ -0,0 +1,74 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Duda I/O
+ *  --------
+ *  Copyright (C) 2012-2016, Eduardo Silva P. <eduardo@monkey.io>.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef DUDA_TIMER_H
+#define DUDA_TIMER_H
+
+#include <stdint.h>
+#include <monkey/mk_core.h>
+
+/*
+ * Each worker keeps a hierarchical timer wheel: DUDA_TIMER_LEVELS wheels of
+ * DUDA_TIMER_SLOTS slots, every level covers DUDA_TIMER_SLOTS times the
+ * range of the previous one. Adding or cancelling a timer is a list
+ * operation, timers on upper levels move down as the wheel turns.
+ *
+ * The wheel is driven by a single timerfd registered on the worker event
+ * loop, it's only armed while there are active timers.
+ */
+#define DUDA_TIMER_TICK      10     /* milliseconds per tick             */
+#define DUDA_TIMER_BITS      6
+#define DUDA_TIMER_SLOTS     (1 << DUDA_TIMER_BITS)
+#define DUDA_TIMER_MASK      (DUDA_TIMER_SLOTS - 1)
+#define DUDA_TIMER_LEVELS    4      /* range: 2^24 ticks, ~46 hours      */
+#define DUDA_TIMER_FREE      256    /* released timers kept by a worker  */
+
+/* Timer states */
+#define DUDA_TIMER_IDLE      0
+#define DUDA_TIMER_ACTIVE    1
+#define DUDA_TIMER_FIRING    2
+
+struct duda_timer {
+    int state;
+    uint64_t expire;                 /* tick to fire */
+    void (*cb) (struct duda_timer *, void *);
+    void *data;
+    struct mk_list _head;
+};
+
+struct duda_timer_wheel {
+    int fd;                          /* timerfd on the worker loop */
+    int armed;
+    int count;                       /* active timers              */
+    uint64_t now;                    /* current tick               */
+
+    int n_free;
+    struct mk_list free;
+
+    struct mk_list slots[DUDA_TIMER_LEVELS][DUDA_TIMER_SLOTS];
+};
+
+struct duda_timer *duda_timer_add(int ms,
+                                  void (*cb) (struct duda_timer *, void *),
+                                  void *data);
+int duda_timer_cancel(struct duda_timer *t);
+int duda_timer_reschedule(struct duda_timer *t, int ms);
+void duda_timer_worker_exit();
+
+#endif
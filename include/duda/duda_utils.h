@@ -20,6 +20,11 @@
 #ifndef DUDA_UTILS_H
 #define DUDA_UTILS_H
 
+#include <stdint.h>
+
 int duda_utils_strtol(const char *nptr, int len, long *result);
+int duda_utils_strtoll(const char *nptr, int len, int64_t *result);
+int duda_utils_strtoull(const char *nptr, int len, uint64_t *result);
+int duda_utils_strtod(const char *nptr, int len, double *result);
 
 #endif
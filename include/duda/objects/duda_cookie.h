@@ -22,35 +22,56 @@
 
 #include <duda/duda.h>
 
+#include <time.h>
+
 #define COOKIE_CRLF          "\r\n"
-#define COOKIE_EQUAL         "="
 #define COOKIE_SET           "Set-Cookie: "
-#define COOKIE_HEADER        "Cookie:"
-#define COOKIE_EXPIRE        "; expires="
-#define COOKIE_PATH          "; path=/"
-#define COOKIE_SEMICOLON     "; "
 #define COOKIE_DELETED       "deleted"
 #define COOKIE_EXPIRE_TIME   337606980
 #define COOKIE_MAX_DATE_LEN  32
 
-mk_ptr_t dd_cookie_crlf;
-mk_ptr_t dd_cookie_equal;
-mk_ptr_t dd_cookie_set  ;
-mk_ptr_t dd_cookie_expire;
-mk_ptr_t dd_cookie_expire_value;
-mk_ptr_t dd_cookie_path;
-mk_ptr_t dd_cookie_semicolon;
+/* SameSite attribute values */
+#define COOKIE_SAMESITE_UNSET   0
+#define COOKIE_SAMESITE_LAX     1
+#define COOKIE_SAMESITE_STRICT  2
+#define COOKIE_SAMESITE_NONE    3
+
+/* Optional attributes of a Set-Cookie header */
+struct duda_cookie_opts {
+    time_t expires;      /* unix time, 0 for a session cookie          */
+    long max_age;        /* seconds, -1 to not set it                  */
+    char *path;          /* NULL to use the service path               */
+    char *domain;        /* NULL to not set it                         */
+    int http_only;       /* MK_TRUE or MK_FALSE                        */
+    int secure;          /* MK_TRUE or MK_FALSE                        */
+    int same_site;       /* COOKIE_SAMESITE_*                          */
+};
 
 struct duda_api_cookie {
     int (*set) (duda_request_t *, char *, int, char *, int, int);
+    int (*set_opts) (duda_request_t *, char *, int, char *, int,
+                     struct duda_cookie_opts *);
     int (*get) (duda_request_t *, char *, char **, int *);
     int (*cmp) (duda_request_t *, char *, char *);
     int (*destroy) (duda_request_t *, char *, int);
 };
 
+/* Reset the cookies context, the Cookie header is parsed on demand */
+static inline void duda_cookie_reset(duda_request_t *dr)
+{
+    dr->cookies.parsed  = MK_FALSE;
+    dr->cookies.count   = 0;
+    dr->cookies.entries = NULL;
+    dr->cookies.index   = NULL;
+    dr->cookies.index_size = 0;
+}
+
 struct duda_api_cookie *duda_cookie_object();
 int duda_cookie_set(duda_request_t *dr, char *key, int key_len,
                     char *val, int val_len, int expires);
+int duda_cookie_set_opts(duda_request_t *dr, char *key, int key_len,
+                         char *val, int val_len,
+                         struct duda_cookie_opts *opts);
 int duda_cookie_get(duda_request_t *dr, char *key, char **val, int *val_len);
 int duda_cookie_cmp(duda_request_t *dr, char *key, char *cmp);
 int duda_cookie_destroy(duda_request_t *dr, char *key, int key_len);
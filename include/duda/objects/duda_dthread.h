@@ -27,6 +27,12 @@
 #define DTHREAD_RUNNING    2
 #define DTHREAD_SUSPEND    3
 
+/* Default stack size and max free stacks kept by each worker */
+#ifndef DTHREAD_STACK_SIZE
+#define DTHREAD_STACK_SIZE (64 * 1024)
+#endif
+#define DTHREAD_STACK_FREE 64
+
 pthread_key_t duda_dthread_scheduler;
 
 typedef struct duda_dthread_scheduler_t duda_dthread_scheduler_t;
@@ -49,7 +55,11 @@ struct duda_api_dthread {
     void (*chan_end)(duda_dthread_channel_t *chan);
     int (*chan_send)(duda_dthread_channel_t *chan, void *data);
     void *(*chan_recv)(duda_dthread_channel_t *chan);
+    int (*chan_select)(duda_dthread_channel_t **chans, int n, int timeout_ms);
     int (*running)();
+    void (*stack_setup)(size_t size, int release_idle);
+    int (*wait_fd)(int fd, int mode);
+    int (*sleep)(int ms);
 };
 
 duda_dthread_scheduler_t *duda_dthread_open();
@@ -60,6 +70,9 @@ int duda_dthread_status(int id);
 void duda_dthread_yield();
 void duda_dthread_resume(int id);
 int duda_dthread_running();
+void duda_dthread_stack_setup(size_t size, int release_idle);
+int duda_dthread_wait_fd(int fd, int mode);
+int duda_dthread_sleep(int ms);
 
 void duda_dthread_add_channel(int id, struct duda_dthread_channel_t *chan);
 
@@ -22,22 +22,33 @@
 
 #include <monkey/mk_core.h>
 
-#define DTHREAD_CHANNEL_OK      0
-#define DTHREAD_CHANNEL_BROKEN  -EPIPE
-
-typedef struct duda_dthread_channel_elem_t duda_dthread_channel_elem_t;
+#define DTHREAD_CHANNEL_OK       0
+#define DTHREAD_CHANNEL_BROKEN   -EPIPE
+#define DTHREAD_CHANNEL_FULL     -EAGAIN
+#define DTHREAD_CHANNEL_TIMEOUT  -ETIMEDOUT
 
+/*
+ * A channel is a fixed ring of pointers allocated together with the
+ * channel, sending or receiving never allocates. A dthread that finds the
+ * channel empty (receiver) or full (sender) is parked until the other side
+ * moves.
+ */
 typedef struct duda_dthread_channel_t {
     int size;
     int used;
-    struct mk_list bufs;
+    int head;                   /* next element to receive           */
     int sender;
     int receiver;
     int ended;
     int done;
+    int recv_waiter;            /* dthread parked waiting for data   */
+    int send_waiter;            /* dthread parked waiting for space  */
+    void **ring;
     struct mk_list _head;
 } duda_dthread_channel_t;
 
+void duda_dthread_wakeup(int id);
+
 /*
  * @METHOD_NAME: chan_get_sender
  * @METHOD_DESC: get sender of the given channel.
@@ -117,11 +128,16 @@ static inline int duda_dthread_channel_done(duda_dthread_channel_t *chan)
 static inline void duda_dthread_channel_end(duda_dthread_channel_t *chan)
 {
     chan->ended = 1;
+    if (chan->recv_waiter != -1) {
+        duda_dthread_wakeup(chan->recv_waiter);
+    }
 }
 
 duda_dthread_channel_t *duda_dthread_channel_create(int size);
 void duda_dthread_channel_free(duda_dthread_channel_t *chan);
 int duda_dthread_channel_send(duda_dthread_channel_t *chan, void *data);
 void *duda_dthread_channel_recv(duda_dthread_channel_t *chan);
+int duda_dthread_channel_select(duda_dthread_channel_t **chans, int n,
+                                int timeout_ms);
 
 #endif
@@ -24,13 +24,15 @@
 
 /* Garbage Collector object: gc->x() */
 struct duda_api_gc {
-    int (*add) (duda_request_t *dr, void *p);
+    int   (*add)   (duda_request_t *dr, void *p);
+    void *(*alloc) (duda_request_t *dr, const size_t size);
 };
 
 /* Exported functions */
 int duda_gc_init(duda_request_t *dr);
 int duda_gc_add(duda_request_t *dr, void *p);
 void *duda_gc_alloc(duda_request_t *dr, const size_t size);
+char *duda_gc_strndup(duda_request_t *dr, const char *s, size_t len);
 int duda_gc_free_content(duda_request_t *dr);
 int duda_gc_free(duda_request_t *dr);
 struct duda_api_gc *duda_gc_object();
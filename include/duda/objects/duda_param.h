@@ -20,16 +20,25 @@
 #ifndef DUDA_PARAM_H
 #define DUDA_PARAM_H
 
+#include <stdint.h>
 #include "duda.h"
 
 struct duda_api_param {
     char *(*get)       (duda_request_t *, const char *);
     int   (*get_number)(duda_request_t *, const char *, long *);
+    int   (*get_ptr)   (duda_request_t *, const char *, mk_ptr_t *);
+    int   (*get_int64) (duda_request_t *, const char *, int64_t *);
+    int   (*get_uint64)(duda_request_t *, const char *, uint64_t *);
+    int   (*get_double)(duda_request_t *, const char *, double *);
 };
 
 struct duda_api_param *duda_param_object();
 char *duda_param_get(duda_request_t *dr, const char *key);
 int duda_param_get_number(duda_request_t *dr, const char *key, long *res);
+int duda_param_get_ptr(duda_request_t *dr, const char *key, mk_ptr_t *value);
+int duda_param_get_int64(duda_request_t *dr, const char *key, int64_t *res);
+int duda_param_get_uint64(duda_request_t *dr, const char *key, uint64_t *res);
+int duda_param_get_double(duda_request_t *dr, const char *key, double *res);
 
 short int duda_param_count(duda_request_t *dr);
 short int duda_param_len(duda_request_t *dr, short int idx);
@@ -24,14 +24,27 @@ struct duda_api_qs {
     int (*count)    (duda_request_t *);
     char *(*get)    (duda_request_t *, const char *);
     char *(*get_id) (duda_request_t *, int);
+    int (*get_ptr)  (duda_request_t *, const char *, mk_ptr_t *);
+    int (*next)     (duda_request_t *, const char *, int *, mk_ptr_t *);
     int (*cmp) (duda_request_t *, const char *, const char *);
 };
 
+/* Reset the query string context, it's parsed on demand */
+static inline void duda_qs_reset(duda_request_t *dr)
+{
+    dr->qs.parsed  = MK_FALSE;
+    dr->qs.count   = 0;
+    dr->qs.entries = NULL;
+    dr->qs.index   = NULL;
+    dr->qs.index_size = 0;
+}
 
 int duda_qs_parse(duda_request_t *dr);
 int duda_qs_count(duda_request_t *dr);
 char *duda_qs_get(duda_request_t *dr, const char *key);
 char *duda_qs_get_id(duda_request_t *dr, int idx);
+int duda_qs_get_ptr(duda_request_t *dr, const char *key, mk_ptr_t *value);
+int duda_qs_next(duda_request_t *dr, const char *key, int *id, mk_ptr_t *value);
 int duda_qs_cmp(duda_request_t *dr, const char *key, const char *value);
 
 struct duda_api_qs *duda_qs_object();
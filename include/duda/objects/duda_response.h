@@ -20,6 +20,19 @@
 #ifndef DUDA_API_RESPONSE_H
 #define DUDA_API_RESPONSE_H
 
+#include <stdint.h>
+#include <duda/duda_compress.h>
+
+/* Cache-Control values for response->http_cache_control() */
+#define DUDA_CACHE_NO_CACHE      0
+#define DUDA_CACHE_NO_STORE      1
+#define DUDA_CACHE_PRIVATE       2
+#define DUDA_CACHE_PUBLIC_HOUR   3
+#define DUDA_CACHE_PUBLIC_DAY    4
+#define DUDA_CACHE_IMMUTABLE     5
+
+struct duda_service;
+
 /* RESPONSE object: response->x() */
 struct duda_api_response {
 
@@ -30,8 +43,15 @@ struct duda_api_response {
     int (*http_header_n) (duda_request_t *, char *, int);
     int (*http_content_length) (duda_request_t *, long);
     int (*http_content_type) (duda_request_t *, char *);
+    int (*http_cache_control) (duda_request_t *, int);
+    int (*stream) (duda_request_t *);
+    int (*static_header) (struct duda_service *, char *);
     int (*print)  (duda_request_t *, char *, int);
     int (*printf) (duda_request_t *, const char *, ...);
+    int (*append_str_n) (duda_request_t *, const char *, int);
+    int (*append_int)   (duda_request_t *, int64_t);
+    int (*append_u64)   (duda_request_t *, uint64_t);
+    int (*append_escaped_json) (duda_request_t *, const char *, int);
     int (*sendfile)       (duda_request_t *, char *);
     int (*sendfile_range) (duda_request_t *, char *, off_t offset, size_t count);
 
@@ -46,17 +66,47 @@ struct duda_api_response {
 
 };
 
+/* Reset the response body buffer, its memory belongs to the request arena */
+static inline void duda_response_reset(duda_request_t *dr)
+{
+    dr->out.mode      = DUDA_OUTPUT_BUFFERED;
+    dr->out.bytes     = 0;
+    dr->out.flushed   = 0;
+    dr->out.n_segs    = 0;
+    dr->out.size_segs = 0;
+    dr->out.segs      = NULL;
+    dr->out.tail      = NULL;
+    dr->out.tail_size = 0;
+    dr->out.encoding  = -1;
+    dr->out.etag      = NULL;
+
+    if (dr->out.compress) {
+        duda_compress_release(dr->out.compress);
+        dr->out.compress = NULL;
+    }
+}
+
 int duda_response_send_headers(duda_request_t *dr);
 int duda_response_http_status(duda_request_t *dr, int status);
 int duda_response_http_header(duda_request_t *dr, char *row);
 int duda_response_http_header_n(duda_request_t *dr, char *row, int len);
 int duda_response_http_content_length(duda_request_t *dr, long length);
+int duda_response_http_content_type(duda_request_t *dr, char *extension);
+int duda_response_http_cache_control(duda_request_t *dr, int type);
+int duda_response_stream(duda_request_t *dr);
+int duda_response_static_header(struct duda_service *ds, char *row);
+int duda_response_header_row(duda_request_t *dr, char *row, int len);
 int duda_response_print(duda_request_t *dr, char *raw, int len);
 int duda_response_printf(duda_request_t *dr, const char *format, ...);
+int duda_response_append_str_n(duda_request_t *dr, const char *str, int len);
+int duda_response_append_int(duda_request_t *dr, int64_t val);
+int duda_response_append_u64(duda_request_t *dr, uint64_t val);
+int duda_response_append_escaped_json(duda_request_t *dr, const char *str, int len);
 int duda_response_sendfile(duda_request_t *dr, char *path);
 int duda_response_continue(duda_request_t *dr);
 int duda_response_wait(duda_request_t *dr);
 int duda_response_end(duda_request_t *dr, void (*end_cb) (duda_request_t *));
+int duda_response_complete(duda_request_t *dr);
 int duda_response_flush(duda_request_t *dr);
 
 struct duda_api_response *duda_response_object();
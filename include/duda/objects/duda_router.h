@@ -21,6 +21,7 @@
 #define MK_DUDA_ROUTER_H
 
 #include <duda/duda_api.h>
+#include <duda/duda_router_uri.h>
 #include <duda/duda_service_internal.h>
 
 #define DUDA_ROUTER_STATIC     0
@@ -38,14 +39,33 @@ struct duda_router_field {
     /* Field type: DUDA_ROUTER_FKEY or DUDA_ROUTER_FVAR */
     int type;
 
-    /* The key or variable name */
+    /* The key or variable name, a variable type suffix is not included */
     int name_len;
     char *name;
 
+    /* Capture type of a variable: DUDA_ROUTER_TANY, DUDA_ROUTER_TU64... */
+    int var_type;
+
     /* Link to the list head on duda_router_path->fields */
     struct mk_list _head;
 };
 
+/*
+ * A ':var' field of a dynamic path, resolved when the path is mapped to the
+ * position of the URI segment that holds its value.
+ */
+struct duda_router_param {
+    /* Variable name without the ':' prefix */
+    int name_len;
+    char *name;
+
+    /* Capture type, the value was validated against it while matching */
+    int type;
+
+    /* Position of the value in duda_request_t->router_uri */
+    int slot;
+};
+
 /* A static or dynamic path set by router->map() */
 struct duda_router_path {
     /* The type defines if is it a static or dynamic router rule */
@@ -68,6 +88,10 @@ struct duda_router_path {
     /* List of fields found on pattern, only used on DYNAMIC routes */
     struct mk_list fields;
 
+    /* Variables of the pattern and their URI positions (DYNAMIC routes) */
+    int n_params;
+    struct duda_router_param *params;
+
     /* The target callback function and it's name */
     char *callback_name;
     void (*callback) (duda_request_t *);
@@ -79,6 +103,36 @@ struct duda_router_path {
     struct mk_list _head;
 };
 
+/*
+ * Router paths registered through router->map() are compiled into a tree
+ * of URI segments, one tree per service. A lookup walks the tree one
+ * segment at a time, so the cost depends on the URI depth and not on the
+ * number of routes registered.
+ */
+struct duda_router_node {
+    /* Static segment represented by this node (NULL for root and vars) */
+    char *key;
+    int key_len;
+
+    /* Capture type if this node represents a ':var' segment */
+    int var_type;
+
+    /* Path that ends on this node, NULL if no route ends here */
+    struct duda_router_path *path;
+
+    /* Static children, sorted by key length and content */
+    int n_children;
+    struct duda_router_node **children;
+
+    /*
+     * Child nodes for ':var' segments, one per capture type. They are
+     * sorted from the most restrictive type to DUDA_ROUTER_TANY, so a
+     * segment that fails a type check falls through to the next one.
+     */
+    int n_vars;
+    struct duda_router_node **vars;
+};
+
 /* Object API */
 struct duda_api_router {
 
@@ -98,12 +152,43 @@ struct duda_api_router {
 
 struct duda_api_router *duda_router_object();
 
+/* Returns the length of the next URI segment, skipping repeated slashes */
+static inline int duda_router_next_segment(char *uri, int len, int *offset,
+                                           char **segment)
+{
+    int i = *offset;
+    int start;
+
+    while (i < len && uri[i] == '/') {
+        i++;
+    }
+
+    if (i >= len) {
+        *offset = len;
+        return 0;
+    }
+
+    start = i;
+    while (i < len && uri[i] != '/') {
+        i++;
+    }
+
+    *segment = uri + start;
+    *offset  = i;
+
+    return i - start;
+}
+
 int duda_router_redirect(duda_request_t *dr);
 int duda_router_is_request_root(struct web_service *ws, duda_request_t *dr);
 int duda_router_uri_parse(duda_request_t *dr);
 int duda_router_path_lookup(struct duda_service *ds,
                             mk_request_t *sr,
-                            struct duda_router_path **path);
+                            struct duda_router_path **path,
+                            struct duda_router_uri *ruri);
+struct duda_router_node *duda_router_node_child(struct duda_router_node *node,
+                                                char *key, int len, int *pos);
+void duda_router_tree_free(struct duda_router_node *node);
 int duda_router_map(struct duda_service *ds,
                     char *pattern,
                     void (*callback)(duda_request_t *));
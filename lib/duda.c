@@ -18,11 +18,144 @@
  */
 
 #include <duda.h>
+#include <duda/duda_dispatch.h>
 
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
+/* Services which root route or variable catch any first URI segment */
+static inline int service_is_any(struct duda_service *ds)
+{
+    if (!ds->router_tree) {
+        return MK_FALSE;
+    }
+
+    if (ds->router_tree->path || ds->router_tree->n_vars > 0) {
+        return MK_TRUE;
+    }
+
+    return MK_FALSE;
+}
+
+/* Returns a NULL terminated array of the services that can serve 'key' */
+static struct duda_service **dispatch_candidates(struct duda *duda_ctx,
+                                                 char *key, int len)
+{
+    int n = 0;
+    struct mk_list *head;
+    struct duda_service *ds;
+    struct duda_service **list;
+    struct duda_router_node *root;
+
+    list = mk_mem_alloc_z(sizeof(struct duda_service *) *
+                          (mk_list_size(&duda_ctx->services) + 1));
+    if (!list) {
+        return NULL;
+    }
+
+    /* Keep the registration order of the services */
+    mk_list_foreach(head, &duda_ctx->services) {
+        ds = mk_list_entry(head, struct duda_service, _head);
+        root = ds->router_tree;
+        if (!root) {
+            continue;
+        }
+
+        if (service_is_any(ds) == MK_TRUE) {
+            list[n++] = ds;
+        }
+        else if (key && duda_router_node_child(root, key, len, NULL)) {
+            list[n++] = ds;
+        }
+    }
+
+    return list;
+}
+
+/*
+ * Build the dispatch index: for every first segment mapped by any service
+ * we store the list of candidate services, so a request only runs the
+ * router lookup of the services that may own it.
+ */
+static int duda_dispatch_build(struct duda *duda_ctx)
+{
+    int i;
+    int ret;
+    int count = 0;
+    struct mk_list *head;
+    struct duda_service *ds;
+    struct duda_service **list;
+    struct duda_router_node *root;
+    struct duda_router_node *child;
+
+    mk_list_foreach(head, &duda_ctx->services) {
+        ds = mk_list_entry(head, struct duda_service, _head);
+        if (ds->router_tree) {
+            count += ds->router_tree->n_children;
+        }
+    }
+
+    duda_ctx->dispatch = duda_dispatch_create(count);
+    if (!duda_ctx->dispatch) {
+        return -1;
+    }
+
+    duda_ctx->dispatch_any = dispatch_candidates(duda_ctx, NULL, 0);
+    if (!duda_ctx->dispatch_any) {
+        return -1;
+    }
+
+    mk_list_foreach(head, &duda_ctx->services) {
+        ds = mk_list_entry(head, struct duda_service, _head);
+        root = ds->router_tree;
+        if (!root) {
+            continue;
+        }
+
+        for (i = 0; i < root->n_children; i++) {
+            child = root->children[i];
+
+            /* Already registered by a previous service */
+            if (duda_dispatch_get(duda_ctx->dispatch,
+                                  child->key, child->key_len)) {
+                continue;
+            }
+
+            list = dispatch_candidates(duda_ctx, child->key, child->key_len);
+            if (!list) {
+                return -1;
+            }
+
+            ret = duda_dispatch_add(duda_ctx->dispatch,
+                                    child->key, child->key_len, list);
+            if (ret != 0) {
+                mk_mem_free(list);
+                return -1;
+            }
+        }
+    }
+
+    return 0;
+}
+
+static void duda_dispatch_destroy_index(struct duda *duda_ctx)
+{
+    int i;
+    struct duda_dispatch *d = duda_ctx->dispatch;
+
+    if (d) {
+        for (i = 0; i < d->size; i++) {
+            mk_mem_free(d->entries[i].data);
+        }
+        duda_dispatch_destroy(d);
+        duda_ctx->dispatch = NULL;
+    }
+
+    mk_mem_free(duda_ctx->dispatch_any);
+    duda_ctx->dispatch_any = NULL;
+}
+
 struct duda *duda_create()
 {
     struct duda *d;
@@ -49,6 +182,7 @@ int duda_destroy(struct duda *duda_ctx)
         /* FIXME: Add mk_destroy() API function */
     }
 
+    duda_dispatch_destroy_index(duda_ctx);
     mk_mem_free(duda_ctx->tcp_port);
     mk_mem_free(duda_ctx);
 
@@ -57,30 +191,53 @@ int duda_destroy(struct duda *duda_ctx)
 
 static void duda_switcher(mk_request_t *request, void *data)
 {
+    int i;
     int ret;
-    struct mk_list *head;
-    struct mk_list *r_head;
+    int len;
+    int offset = 0;
+    char *segment = NULL;
     struct duda *duda_ctx;
     struct duda_service *service;
+    struct duda_service **candidates;
     struct duda_router_path *path;
+    struct duda_router_uri ruri;
     struct duda_request *dr;
 
     duda_ctx = data;
 
-    /* Iterate registered services and find a route */
-    mk_list_foreach(head, &duda_ctx->services) {
-        service = mk_list_entry(head, struct duda_service, _head);
-
-        /* Check service route paths */
-        ret = duda_router_path_lookup(service, request, &path);
-        if (ret == DUDA_ROUTER_MATCH) {
-            dr = duda_request_create(request, service, path);
-            if (!dr) {
-                goto error;
-            }
-            path->callback(dr);
+    /* One lookup on the dispatch index using the first URI segment */
+    candidates = duda_ctx->dispatch_any;
+    len = duda_router_next_segment(request->uri_processed.data,
+                                   request->uri_processed.len,
+                                   &offset, &segment);
+    if (len > 0) {
+        service = duda_dispatch_get(duda_ctx->dispatch, segment, len);
+        if (service) {
+            candidates = (struct duda_service **) service;
+        }
+    }
+
+    /* Check route paths of the candidate services */
+    for (i = 0; candidates && candidates[i]; i++) {
+        service = candidates[i];
+
+        ret = duda_router_path_lookup(service, request, &path, &ruri);
+        if (ret == DUDA_ROUTER_NOTFOUND) {
+            continue;
+        }
+
+        dr = duda_request_create(request, service, path, &ruri);
+        if (!dr) {
+            goto error;
+        }
+
+        if (ret == DUDA_ROUTER_REDIRECT) {
+            duda_router_redirect(dr);
             return;
         }
+
+        path->callback(dr);
+        return;
     }
 
  error:
@@ -115,6 +272,12 @@ int duda_start(struct duda *duda_ctx)
                   "Listen", duda_ctx->tcp_port,
                   NULL);
 
+    /* Index the services routes for request dispatching */
+    if (duda_dispatch_build(duda_ctx) != 0) {
+        fprintf(stderr, "Could not build the services dispatch index\n");
+        return -1;
+    }
+
     /* Setup Virtual Host */
     vh = mk_vhost_create(duda_ctx->monkey, NULL);
     mk_vhost_set(vh,
@@ -19,6 +19,14 @@
 
 #define  _GNU_SOURCE
 #include <limits.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/socket.h>
+
+#ifdef DUDA_HAVE_ZEROCOPY
+#include <linux/errqueue.h>
+#endif
 
 #include <monkey/mk_api.h>
 
@@ -30,18 +38,41 @@ struct duda_body_buffer *duda_body_buffer_new()
     struct duda_body_buffer *bb;
 
     bb = mk_api->mem_alloc_z(sizeof(struct duda_body_buffer));
+    if (!bb) {
+        return NULL;
+    }
+
     bb->buf = mk_api->iov_create(BODY_BUFFER_SIZE, 0);
+    if (!bb->buf) {
+        mk_api->mem_free(bb);
+        return NULL;
+    }
     bb->size = BODY_BUFFER_SIZE;
+    bb->head = 0;
     bb->sent = 0;
 
     return bb;
 }
 
+/*
+ * Make room for more entries: the entries already sent are dropped from the
+ * head of the array, if that is not enough the array doubles its size.
+ */
 int duda_body_buffer_expand(struct duda_body_buffer *bb)
 {
-    int size = bb->buf->size + BODY_BUFFER_SIZE;
+    unsigned int size;
+    struct mk_iov *buf = bb->buf;
+
+    if (bb->head > 0) {
+        memmove(buf->io, buf->io + bb->head,
+                sizeof(struct iovec) * (buf->iov_idx - bb->head));
+        buf->iov_idx -= bb->head;
+        bb->head = 0;
+        return 0;
+    }
 
-    if (!mk_api->iov_realloc(bb->buf, size)) {
+    size = bb->size * 2;
+    if (!mk_api->iov_realloc(buf, size)) {
         return -1;
     }
 
@@ -49,71 +80,232 @@ int duda_body_buffer_expand(struct duda_body_buffer *bb)
     return 0;
 }
 
-int duda_body_buffer_flush(int sock, struct duda_body_buffer *bb)
+/* Append a reference to 'data', it must be valid until it's sent */
+int duda_body_buffer_add(struct duda_body_buffer *bb, void *data, size_t len)
 {
-    int i;
-    int count = 0;
-    unsigned int bytes_sent, bytes_to;
-    int reset_to = -1;
+    if (bb->buf->iov_idx >= (int) bb->size &&
+        duda_body_buffer_expand(bb) != 0) {
+        return -1;
+    }
+
+    return mk_api->iov_add(bb->buf, data, len, MK_FALSE);
+}
+
+/*
+ * Discount 'bytes' already written from the head of the buffer. It returns
+ * the number of bytes taken from this buffer, which can be less than
+ * 'bytes' if the write covered the next buffers too.
+ */
+size_t duda_body_buffer_consume(struct duda_body_buffer *bb, size_t bytes)
+{
+    size_t n;
+    size_t used = 0;
     struct mk_iov *buf = bb->buf;
+    struct iovec *io;
+
+    while (bb->head < (unsigned int) buf->iov_idx) {
+        io = &buf->io[bb->head];
+        n = io->iov_len;
+        if (n > bytes - used) {
+            n = bytes - used;
+        }
+        io->iov_base = (char *) io->iov_base + n;
+        io->iov_len -= n;
+        used += n;
 
-    /* FIXME: Temporal Check */
-    if (mk_unlikely(buf->iov_idx > IOV_MAX)) {
-        mk_err("Boddy buffer flush: enqueued data is larger than IOV_MAX (%i)\n",
-                IOV_MAX);
-        exit(EXIT_FAILURE);
+        if (io->iov_len > 0) {
+            break;
+        }
+        bb->head++;
     }
 
-    //bytes_sent = mk_api->socket_sendv(sock, buf);
-    bytes_sent = writev(sock, buf->io, buf->iov_idx);
-    PLUGIN_TRACE("body_flush: %i/%i", bytes_sent, buf->total_len);
-    /*
-     * If the call sent less data than total, we must modify the mk_iov struct
-     * to mark the buffers already processed and set them with with length = zero,
-     * so on the next calls to this function Monkey will skip buffers with bytes
-     * length = 0.
-     */
-    if (bytes_sent < buf->total_len) {
-        /* Go around each buffer entry and check where the offset took place */
-        for (i = 0; i < buf->iov_idx; i++) {
-            if (count + buf->io[i].iov_len == bytes_sent) {
-                reset_to = i;
-                break;
-            }
-            else if (bytes_sent < (count + buf->io[i].iov_len)) {
-                reset_to = i - 1;
-                bytes_to = (bytes_sent - count);
-                buf->io[i].iov_base += bytes_to;
-                buf->io[i].iov_len   = buf->io[i].iov_len - bytes_to;
-                break;
+    buf->total_len -= used;
+    bb->sent += used;
+
+    /* Everything was sent, start over */
+    if (bb->head == (unsigned int) buf->iov_idx) {
+        bb->head = 0;
+        buf->iov_idx = 0;
+    }
+
+    return used;
+}
+
+/*
+ * Write an array of buffers. When zero copy is available and the write is
+ * big enough it goes with MSG_ZEROCOPY: the memory is not copied to the
+ * socket buffer, so it must be kept until the kernel report the send as
+ * completed, see duda_body_buffer_zerocopy_pending().
+ */
+ssize_t duda_body_buffer_writev(int sock, struct iovec *iov, int n, size_t size,
+                                struct duda_zerocopy *zc)
+{
+#ifdef DUDA_HAVE_ZEROCOPY
+    int on = 1;
+    ssize_t bytes;
+    struct msghdr msg;
+
+    if (zc && zc->enabled >= 0 && size >= BODY_BUFFER_ZEROCOPY) {
+        if (zc->enabled == 0) {
+            if (setsockopt(sock, SOL_SOCKET, SO_ZEROCOPY, &on, sizeof(on)) != 0) {
+                zc->enabled = -1;
+                return writev(sock, iov, n);
             }
-            count += buf->io[i].iov_len;
+            zc->enabled = 1;
         }
 
-        /* Reset entries */
-        for (i = 0; i <= reset_to; i++) {
-            buf->io[i].iov_len = 0;
+        memset(&msg, '\0', sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = n;
+
+        bytes = sendmsg(sock, &msg, MSG_ZEROCOPY);
+        if (bytes > 0) {
+            zc->sent++;
         }
+        return bytes;
+    }
+#else
+    (void) size;
+    (void) zc;
+#endif
+
+    return writev(sock, iov, n);
+}
 
-        buf->total_len -= bytes_sent;
+/*
+ * Reap the zero copy completions queued on the socket error queue. It
+ * returns the number of zero copy sends still in flight.
+ */
+int duda_body_buffer_zerocopy_pending(int sock, struct duda_zerocopy *zc)
+{
+#ifdef DUDA_HAVE_ZEROCOPY
+    char control[128];
+    struct msghdr msg;
+    struct cmsghdr *cm;
+    struct sock_extended_err *serr;
 
-#ifdef TRACE
-        PLUGIN_TRACE("new total len: %i (iov_idx=%i)",
-                     buf->total_len,
-                     buf->iov_idx);
-        int j;
+    while (zc->done != zc->sent) {
+        memset(&msg, '\0', sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
 
-        for (j = 0; j < buf->iov_idx; j++) {
-            PLUGIN_TRACE("io[%i] = %i", j, buf->io[j].iov_len);
+        if (recvmsg(sock, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) == -1) {
+            break;
         }
+
+        for (cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+            serr = (struct sock_extended_err *) CMSG_DATA(cm);
+            if (serr->ee_errno != 0 ||
+                serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+                continue;
+            }
+
+            /* ee_info to ee_data is the range of completed sends */
+            zc->done += serr->ee_data - serr->ee_info + 1;
+        }
+    }
+#else
+    (void) sock;
 #endif
+
+    return zc->sent - zc->done;
+}
+
+/*
+ * Wait up to 'ms' milliseconds for the zero copy sends in flight, the
+ * kernel flags the socket with POLLERR when completions are queued. It
+ * returns the number of sends still in flight.
+ */
+int duda_body_buffer_zerocopy_wait(int sock, struct duda_zerocopy *zc, int ms)
+{
+#ifdef DUDA_HAVE_ZEROCOPY
+    long left;
+    struct pollfd pfd;
+    struct timespec now;
+    struct timespec end;
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    end.tv_sec  += ms / 1000;
+    end.tv_nsec += (ms % 1000) * 1000000L;
+
+    while (duda_body_buffer_zerocopy_pending(sock, zc) > 0) {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        left = (end.tv_sec - now.tv_sec) * 1000 +
+            (end.tv_nsec - now.tv_nsec) / 1000000L;
+        if (left <= 0) {
+            break;
+        }
+
+        pfd.fd = sock;
+        pfd.events = 0;
+        pfd.revents = 0;
+        if (poll(&pfd, 1, left) <= 0) {
+            break;
+        }
     }
+#else
+    (void) sock;
+    (void) ms;
+#endif
 
-    /* Successfully end ? */
-    if (bytes_sent == buf->total_len) {
-        buf->total_len = 0;
-        return 0;
+    return zc->sent - zc->done;
+}
+
+/*
+ * The kernel did not release the memory of the zero copy sends in time:
+ * the connection is shut down and its close discards the unsent data, so
+ * nothing is read from that memory once it's reused.
+ */
+void duda_body_buffer_zerocopy_abort(int sock)
+{
+    struct linger lg;
+
+    lg.l_onoff  = 1;
+    lg.l_linger = 0;
+    setsockopt(sock, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+    shutdown(sock, SHUT_RDWR);
+}
+
+/*
+ * Write the pending data of a body buffer, at most IOV_MAX entries on each
+ * writev(). It returns the number of bytes still pending or -1 if the
+ * socket failed.
+ */
+int duda_body_buffer_flush(int sock, struct duda_body_buffer *bb)
+{
+    int i;
+    int n;
+    size_t size;
+    ssize_t bytes;
+    struct iovec *io;
+    struct mk_iov *buf = bb->buf;
+
+    while (buf->total_len > 0) {
+        io = buf->io + bb->head;
+        n  = buf->iov_idx - bb->head;
+        if (n > IOV_MAX) {
+            n = IOV_MAX;
+        }
+
+        size = 0;
+        for (i = 0; i < n; i++) {
+            size += io[i].iov_len;
+        }
+
+        bytes = writev(sock, io, n);
+        PLUGIN_TRACE("body_flush: %zd/%zu", bytes, size);
+        if (bytes == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            return -1;
+        }
+
+        duda_body_buffer_consume(bb, bytes);
+        if ((size_t) bytes < size) {
+            break;
+        }
     }
 
-    return bytes_sent;
+    return buf->total_len;
 }
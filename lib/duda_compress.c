@@ -0,0 +1,703 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Duda I/O
+ *  --------
+ *  Copyright (C) 2012-2016, Eduardo Silva P. <eduardo@monkey.io>.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include <monkey/mk_api.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+
+#include <duda/duda_compress.h>
+#include <duda/duda_sendfile.h>
+
+/*
+ * Response compression: the response object negotiate the encoding with
+ * the client and pass the body through a compressor context. Files sent
+ * through sendfile() are compressed once and the result is kept on disk,
+ * so next requests for the same file only cost a sendfile.
+ */
+
+#define HEADER_ROW(str)  {str, sizeof(str) - 1}
+
+static struct {
+    char *name;
+    int name_len;
+    char *ext;
+    struct {
+        char *data;
+        int len;
+    } row;
+} encodings[] = {
+    [DUDA_COMPRESS_NONE] = {NULL, 0, NULL, {NULL, 0}},
+    [DUDA_COMPRESS_GZIP] = {"gzip", 4, "gz",
+                            HEADER_ROW("Content-Encoding: gzip\r\n"
+                                       "Vary: Accept-Encoding\r\n")},
+    [DUDA_COMPRESS_ZSTD] = {"zstd", 4, "zst",
+                            HEADER_ROW("Content-Encoding: zstd\r\n"
+                                       "Vary: Accept-Encoding\r\n")},
+};
+
+/* Per worker list of released contexts, one per encoding */
+static __thread struct duda_compress *compress_free[3];
+static __thread int compress_free_n[3];
+
+static inline int encoding_available(int encoding)
+{
+#ifdef DUDA_HAVE_ZLIB
+    if (encoding == DUDA_COMPRESS_GZIP) {
+        return MK_TRUE;
+    }
+#endif
+#ifdef DUDA_HAVE_ZSTD
+    if (encoding == DUDA_COMPRESS_ZSTD) {
+        return MK_TRUE;
+    }
+#endif
+    (void) encoding;
+    return MK_FALSE;
+}
+
+/* Parse the quality value of an Accept-Encoding element, 0 to 1000 */
+static int accept_quality(const char *p, const char *end)
+{
+    int q;
+    int digits;
+
+    while (p < end && *p != ';') {
+        p++;
+    }
+    if (p == end) {
+        return 1000;
+    }
+
+    p++;
+    while (p < end && *p == ' ') {
+        p++;
+    }
+    if (end - p < 2 || (p[0] != 'q' && p[0] != 'Q') || p[1] != '=') {
+        return 1000;
+    }
+    p += 2;
+
+    if (p < end && *p == '1') {
+        return 1000;
+    }
+
+    /* 0, 0.5, 0.25, 0.125 */
+    q = 0;
+    if (p < end && *p == '0') {
+        p++;
+    }
+    if (p < end && *p == '.') {
+        p++;
+        for (digits = 0; digits < 3; digits++) {
+            q *= 10;
+            if (p < end && *p >= '0' && *p <= '9') {
+                q += *p - '0';
+                p++;
+            }
+        }
+    }
+
+    return q;
+}
+
+/*
+ * Choose the encoding for a response given the client Accept-Encoding
+ * header value. The preferred quality wins, on ties zstd is used over
+ * gzip. It returns DUDA_COMPRESS_NONE if nothing is acceptable.
+ */
+int duda_compress_negotiate(mk_ptr_t *accept_encoding)
+{
+    int i;
+    int len;
+    int q;
+    int any = -1;
+    int best = DUDA_COMPRESS_NONE;
+    int best_q = 0;
+    int quality[3] = {-1, -1, -1};
+    char *p;
+    char *end;
+    char *next;
+
+    if (!accept_encoding || !accept_encoding->data) {
+        return DUDA_COMPRESS_NONE;
+    }
+
+    p = accept_encoding->data;
+    end = p + accept_encoding->len;
+
+    while (p < end) {
+        while (p < end && (*p == ' ' || *p == ',')) {
+            p++;
+        }
+
+        next = p;
+        while (next < end && *next != ',') {
+            next++;
+        }
+
+        len = 0;
+        while (p + len < next && p[len] != ';' && p[len] != ' ') {
+            len++;
+        }
+
+        q = accept_quality(p + len, next);
+        if (len == 1 && p[0] == '*') {
+            any = q;
+        }
+        else {
+            for (i = DUDA_COMPRESS_GZIP; i <= DUDA_COMPRESS_ZSTD; i++) {
+                if (len == encodings[i].name_len &&
+                    strncasecmp(p, encodings[i].name, len) == 0) {
+                    quality[i] = q;
+                }
+            }
+        }
+        p = next;
+    }
+
+    for (i = DUDA_COMPRESS_GZIP; i <= DUDA_COMPRESS_ZSTD; i++) {
+        q = (quality[i] >= 0) ? quality[i] : any;
+        if (q > 0 && q >= best_q && encoding_available(i) == MK_TRUE) {
+            best = i;
+            best_q = q;
+        }
+    }
+
+    return best;
+}
+
+static int type_has(mk_ptr_t *type, const char *str, int len)
+{
+    int i;
+
+    for (i = 0; i + len <= (int) type->len; i++) {
+        if (strncasecmp(type->data + i, str, len) == 0) {
+            return MK_TRUE;
+        }
+    }
+
+    return MK_FALSE;
+}
+
+/*
+ * Returns MK_TRUE if the Content-Type is worth to compress: text, JSON,
+ * Javascript, XML and SVG. Images, video and archives are already
+ * compressed.
+ */
+int duda_compress_type(mk_ptr_t *content_type)
+{
+    if (!content_type->data || content_type->len == 0) {
+        return MK_FALSE;
+    }
+
+    if (type_has(content_type, "text/", 5)       ||
+        type_has(content_type, "json", 4)        ||
+        type_has(content_type, "javascript", 10) ||
+        type_has(content_type, "xml", 3)) {
+        return MK_TRUE;
+    }
+
+    return MK_FALSE;
+}
+
+/* Set the pre-rendered header rows of an encoding, returns their length */
+int duda_compress_header(int encoding, char **row)
+{
+    *row = encodings[encoding].row.data;
+    return encodings[encoding].row.len;
+}
+
+/* Short name of an encoding, e.g: 'gz', NULL for the identity */
+char *duda_compress_ext(int encoding)
+{
+    if (encoding <= DUDA_COMPRESS_NONE || encoding > DUDA_COMPRESS_ZSTD) {
+        return NULL;
+    }
+    return encodings[encoding].ext;
+}
+
+static struct duda_compress *compress_create(int encoding)
+{
+    struct duda_compress *c;
+
+    c = mk_api->mem_alloc_z(sizeof(struct duda_compress));
+    if (!c) {
+        return NULL;
+    }
+    c->encoding = encoding;
+
+#ifdef DUDA_HAVE_ZLIB
+    if (encoding == DUDA_COMPRESS_GZIP) {
+        /* 15 + 16: biggest window with a gzip wrapper */
+        if (deflateInit2(&c->z, DUDA_COMPRESS_GZIP_LEVEL, Z_DEFLATED,
+                         15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+            mk_api->mem_free(c);
+            return NULL;
+        }
+        return c;
+    }
+#endif
+
+#ifdef DUDA_HAVE_ZSTD
+    if (encoding == DUDA_COMPRESS_ZSTD) {
+        c->zstd = ZSTD_createCCtx();
+        if (!c->zstd) {
+            mk_api->mem_free(c);
+            return NULL;
+        }
+        ZSTD_CCtx_setParameter(c->zstd, ZSTD_c_compressionLevel,
+                               DUDA_COMPRESS_ZSTD_LEVEL);
+        return c;
+    }
+#endif
+
+    mk_api->mem_free(c);
+    return NULL;
+}
+
+static void compress_destroy(struct duda_compress *c)
+{
+#ifdef DUDA_HAVE_ZLIB
+    if (c->encoding == DUDA_COMPRESS_GZIP) {
+        deflateEnd(&c->z);
+    }
+#endif
+#ifdef DUDA_HAVE_ZSTD
+    if (c->encoding == DUDA_COMPRESS_ZSTD) {
+        ZSTD_freeCCtx(c->zstd);
+    }
+#endif
+    mk_api->mem_free(c);
+}
+
+/* Get a compressor context ready to start a new stream */
+struct duda_compress *duda_compress_acquire(int encoding)
+{
+    struct duda_compress *c;
+
+    if (encoding_available(encoding) == MK_FALSE) {
+        return NULL;
+    }
+
+    c = compress_free[encoding];
+    if (c) {
+        compress_free[encoding] = c->next;
+        compress_free_n[encoding]--;
+        c->next = NULL;
+        return c;
+    }
+
+    return compress_create(encoding);
+}
+
+/* Reset the context and keep it for the next stream */
+void duda_compress_release(struct duda_compress *c)
+{
+    int encoding = c->encoding;
+
+    if (compress_free_n[encoding] >= DUDA_COMPRESS_FREE) {
+        compress_destroy(c);
+        return;
+    }
+
+#ifdef DUDA_HAVE_ZLIB
+    if (encoding == DUDA_COMPRESS_GZIP) {
+        deflateReset(&c->z);
+    }
+#endif
+#ifdef DUDA_HAVE_ZSTD
+    if (encoding == DUDA_COMPRESS_ZSTD) {
+        ZSTD_CCtx_reset(c->zstd, ZSTD_reset_session_only);
+    }
+#endif
+
+    c->next = compress_free[encoding];
+    compress_free[encoding] = c;
+    compress_free_n[encoding]++;
+}
+
+#ifdef DUDA_HAVE_ZLIB
+static int compress_gzip(struct duda_compress *c, int op,
+                         const char **in, size_t *in_len,
+                         char **out, size_t *out_avail)
+{
+    int ret;
+    int flush;
+    z_stream *z = &c->z;
+
+    if (op == DUDA_COMPRESS_CONTINUE) {
+        flush = Z_NO_FLUSH;
+    }
+    else if (op == DUDA_COMPRESS_FLUSH) {
+        flush = Z_SYNC_FLUSH;
+    }
+    else {
+        flush = Z_FINISH;
+    }
+
+    z->next_in   = (Bytef *) *in;
+    z->avail_in  = *in_len;
+    z->next_out  = (Bytef *) *out;
+    z->avail_out = *out_avail;
+
+    ret = deflate(z, flush);
+    if (ret == Z_STREAM_ERROR) {
+        return -1;
+    }
+
+    *in  = (const char *) z->next_in;
+    *in_len = z->avail_in;
+    *out = (char *) z->next_out;
+    *out_avail = z->avail_out;
+
+    if (op == DUDA_COMPRESS_END) {
+        return (ret == Z_STREAM_END) ? 0 : 1;
+    }
+    else if (op == DUDA_COMPRESS_FLUSH) {
+        /* a sync flush is complete once it leaves output space */
+        return (*in_len == 0 && *out_avail > 0) ? 0 : 1;
+    }
+    return (*in_len == 0) ? 0 : 1;
+}
+#endif
+
+#ifdef DUDA_HAVE_ZSTD
+static int compress_zstd(struct duda_compress *c, int op,
+                         const char **in, size_t *in_len,
+                         char **out, size_t *out_avail)
+{
+    size_t r;
+    ZSTD_EndDirective mode;
+    ZSTD_inBuffer ib;
+    ZSTD_outBuffer ob;
+
+    if (op == DUDA_COMPRESS_CONTINUE) {
+        mode = ZSTD_e_continue;
+    }
+    else if (op == DUDA_COMPRESS_FLUSH) {
+        mode = ZSTD_e_flush;
+    }
+    else {
+        mode = ZSTD_e_end;
+    }
+
+    ib.src  = *in;
+    ib.size = *in_len;
+    ib.pos  = 0;
+    ob.dst  = *out;
+    ob.size = *out_avail;
+    ob.pos  = 0;
+
+    r = ZSTD_compressStream2(c->zstd, &ob, &ib, mode);
+    if (ZSTD_isError(r)) {
+        return -1;
+    }
+
+    *in += ib.pos;
+    *in_len -= ib.pos;
+    *out += ob.pos;
+    *out_avail -= ob.pos;
+
+    if (op == DUDA_COMPRESS_CONTINUE) {
+        return (*in_len == 0) ? 0 : 1;
+    }
+
+    /* zero means everything was flushed */
+    return (r == 0) ? 0 : 1;
+}
+#endif
+
+/*
+ * Run the compressor over the input buffer writing into the output buffer,
+ * both are advanced. It returns 0 when the operation is complete, 1 if it
+ * needs more output space and -1 on error.
+ */
+int duda_compress_run(struct duda_compress *c, int op,
+                      const char **in, size_t *in_len,
+                      char **out, size_t *out_avail)
+{
+#ifdef DUDA_HAVE_ZLIB
+    if (c->encoding == DUDA_COMPRESS_GZIP) {
+        return compress_gzip(c, op, in, in_len, out, out_avail);
+    }
+#endif
+#ifdef DUDA_HAVE_ZSTD
+    if (c->encoding == DUDA_COMPRESS_ZSTD) {
+        return compress_zstd(c, op, in, in_len, out, out_avail);
+    }
+#endif
+
+    (void) c;
+    (void) op;
+    (void) in;
+    (void) in_len;
+    (void) out;
+    (void) out_avail;
+    return -1;
+}
+
+/*
+ * Directory of the compressed files: the CacheDir of the configuration or
+ * a private directory created on first use. Other users must not be able
+ * to place files there, it's only used if it's a real directory owned by
+ * the server user with mode 0700.
+ */
+static char cache_dir[PATH_MAX];
+static int cache_dir_status;             /* 0: unchecked, 1: ready, -1: unusable */
+static pthread_mutex_t cache_dir_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+int duda_compress_set_dir(const char *dir)
+{
+    int len = snprintf(cache_dir, sizeof(cache_dir), "%s", dir);
+
+    if (len <= 0 || len >= (int) sizeof(cache_dir)) {
+        cache_dir[0] = '\0';
+        return -1;
+    }
+    return 0;
+}
+
+static int cache_dir_check(const char *dir)
+{
+    struct stat st;
+
+    if (lstat(dir, &st) != 0) {
+        return -1;
+    }
+
+    if (!S_ISDIR(st.st_mode) || st.st_uid != geteuid() ||
+        (st.st_mode & 0777) != 0700) {
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Returns MK_TRUE if the cache directory can be used */
+static int cache_dir_ready()
+{
+    int status;
+    const char *base;
+
+    status = __atomic_load_n(&cache_dir_status, __ATOMIC_ACQUIRE);
+    if (status != 0) {
+        return (status == 1) ? MK_TRUE : MK_FALSE;
+    }
+
+    pthread_mutex_lock(&cache_dir_mutex);
+    if (cache_dir_status == 0) {
+        status = -1;
+        if (cache_dir[0]) {
+            if (mkdir(cache_dir, 0700) == 0 || errno == EEXIST) {
+                status = (cache_dir_check(cache_dir) == 0) ? 1 : -1;
+            }
+        }
+        else {
+            base = getenv("TMPDIR");
+            if (!base || !*base) {
+                base = "/tmp";
+            }
+            snprintf(cache_dir, sizeof(cache_dir), "%s/%s",
+                     base, DUDA_COMPRESS_CACHE_TMP);
+            if (mkdtemp(cache_dir)) {
+                status = (cache_dir_check(cache_dir) == 0) ? 1 : -1;
+            }
+        }
+
+        if (status == -1) {
+            mk_warn("Duda: compress cache directory '%s' is not usable, "
+                    "files are sent as is", cache_dir);
+        }
+        __atomic_store_n(&cache_dir_status, status, __ATOMIC_RELEASE);
+    }
+    status = cache_dir_status;
+    pthread_mutex_unlock(&cache_dir_mutex);
+
+    return (status == 1) ? MK_TRUE : MK_FALSE;
+}
+
+/* Compress the content of 'src' into a new file 'path' */
+static int compress_file_create(int src, off_t size, int encoding,
+                                char *path)
+{
+    int ret;
+    int fd;
+    int op;
+    off_t offset = 0;
+    ssize_t bytes;
+    size_t in_len;
+    size_t out_avail;
+    const char *in;
+    char *out;
+    char *buf_in;
+    char *buf_out;
+    char tmp[PATH_MAX];
+    struct duda_compress *c;
+
+    /* Workers may be creating the same file, the last rename wins */
+    snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path);
+    fd = mkstemp(tmp);
+    if (fd < 0) {
+        return -1;
+    }
+
+    c = duda_compress_acquire(encoding);
+    buf_in  = mk_api->mem_alloc(65536);
+    buf_out = mk_api->mem_alloc(65536);
+    if (!c || !buf_in || !buf_out) {
+        goto error;
+    }
+
+    while (1) {
+        bytes = 0;
+        if (offset < size) {
+            bytes = pread(src, buf_in, 65536, offset);
+            if (bytes <= 0) {
+                goto error;
+            }
+            offset += bytes;
+        }
+
+        in = buf_in;
+        in_len = bytes;
+        op = (offset < size) ? DUDA_COMPRESS_CONTINUE : DUDA_COMPRESS_END;
+
+        do {
+            out = buf_out;
+            out_avail = 65536;
+            ret = duda_compress_run(c, op, &in, &in_len, &out, &out_avail);
+            if (ret == -1) {
+                goto error;
+            }
+
+            if (out > buf_out && write(fd, buf_out, out - buf_out) != out - buf_out) {
+                goto error;
+            }
+        } while (ret == 1);
+
+        if (op == DUDA_COMPRESS_END) {
+            break;
+        }
+    }
+
+    duda_compress_release(c);
+    mk_api->mem_free(buf_in);
+    mk_api->mem_free(buf_out);
+    close(fd);
+
+    if (rename(tmp, path) != 0) {
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+
+ error:
+    if (c) {
+        compress_destroy(c);
+    }
+    mk_api->mem_free(buf_in);
+    mk_api->mem_free(buf_out);
+    close(fd);
+    unlink(tmp);
+    return -1;
+}
+
+/*
+ * Returns MK_TRUE if a file of 'size' bytes sent as the whole body goes
+ * compressed to the clients that accept it.
+ */
+int duda_compress_file_size(off_t size)
+{
+    if (size < DUDA_COMPRESS_MIN_SIZE || size > DUDA_COMPRESS_FILE_MAX) {
+        return MK_FALSE;
+    }
+
+    if (encoding_available(DUDA_COMPRESS_GZIP) == MK_FALSE &&
+        encoding_available(DUDA_COMPRESS_ZSTD) == MK_FALSE) {
+        return MK_FALSE;
+    }
+
+    return MK_TRUE;
+}
+
+/*
+ * Replace the file of a sendfile entry with its compressed version. The
+ * compressed files are created on the first request and kept in the cache
+ * directory, the name is composed by the inode and the modification time
+ * of the original file so a new version of the file gets a new entry. The
+ * compressed file is opened through the worker file cache too.
+ *
+ * Only whole files are compressed. It returns 0 if the entry was
+ * replaced, otherwise -1 and the entry is not modified.
+ */
+int duda_compress_file(struct duda_sendfile *sf, int encoding)
+{
+    char path[PATH_MAX];
+    struct duda_fcache_entry *fe = sf->fc;
+    struct duda_fcache_entry *cfe;
+
+    if (encoding_available(encoding) == MK_FALSE) {
+        return -1;
+    }
+
+    if (sf->offset != 0 || (off_t) sf->pending_bytes != fe->size ||
+        fe->size < DUDA_COMPRESS_MIN_SIZE ||
+        fe->size > DUDA_COMPRESS_FILE_MAX) {
+        return -1;
+    }
+
+    if (cache_dir_ready() == MK_FALSE) {
+        return -1;
+    }
+
+    snprintf(path, sizeof(path), "%s/%lx-%lx-%lx-%lx.%s",
+             cache_dir,
+             (unsigned long) fe->dev, (unsigned long) fe->ino,
+             (unsigned long) fe->mtime, (unsigned long) fe->size,
+             encodings[encoding].ext);
+
+    cfe = duda_fcache_get_flags(path, O_NOFOLLOW);
+    if (!cfe) {
+        if (compress_file_create(fe->fd, fe->size, encoding, path) != 0) {
+            return -1;
+        }
+        cfe = duda_fcache_get_flags(path, O_NOFOLLOW);
+        if (!cfe) {
+            return -1;
+        }
+    }
+
+    /* Incompressible content, the file is kept to not try again */
+    if (cfe->size >= fe->size) {
+        duda_fcache_put(cfe);
+        return -1;
+    }
+
+    duda_fcache_put(fe);
+    sf->fc = cfe;
+    sf->fd = cfe->fd;
+    sf->offset = 0;
+    sf->pending_bytes = cfe->size;
+
+    return 0;
+}
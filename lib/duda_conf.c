@@ -23,6 +23,7 @@
 #include <monkey/mk_api.h>
 
 #include <duda/duda_conf.h>
+#include <duda/duda_compress.h>
 
 int duda_conf_set_confdir(struct web_service *ws, const char *dir)
 {
@@ -187,6 +188,17 @@ int duda_conf_main_init(const char *confdir)
             exit(EXIT_FAILURE);
         }
 
+        /* Cache directory, it keeps the compressed version of static files */
+        tmp = mk_api->config_section_get_key(section, "CacheDir",
+                                             MK_RCONF_STR);
+        if (tmp) {
+            if (duda_compress_set_dir(tmp) != 0) {
+                mk_err("Duda: Invalid cache directory path");
+                exit(EXIT_FAILURE);
+            }
+            mk_api->mem_free(tmp);
+        }
+
         PLUGIN_TRACE("Services Root '%s'", services_root);
         PLUGIN_TRACE("Packages Root '%s'", packages_root);
     }
@@ -235,6 +247,7 @@ int duda_conf_vhost_init()
         vs = mk_api->mem_alloc(sizeof(struct vhost_services));
         vs->host         = entry_host;      /* link virtual host entry     */
         vs->root_service = NULL;            /* root web service (optional) */
+        vs->services_index = NULL;          /* built by duda_dispatch_init()  */
         mk_list_init(&vs->services);        /* init services list          */
 
         /*
@@ -0,0 +1,166 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Duda I/O
+ *  --------
+ *  Copyright (C) 2012-2016, Eduardo Silva P. <eduardo@monkey.io>.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include <monkey/mk_core.h>
+#include <duda/duda_dispatch.h>
+
+/* FNV-1a, keys are short: host references, service names or URI segments */
+static inline unsigned int dispatch_hash(const char *key, int len)
+{
+    int i;
+    unsigned int hash = 2166136261u;
+
+    for (i = 0; i < len; i++) {
+        hash ^= (unsigned char) key[i];
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+static struct duda_dispatch_entry *dispatch_slot(struct duda_dispatch *d,
+                                                 unsigned int hash,
+                                                 const void *key, int len)
+{
+    unsigned int mask = d->size - 1;
+    unsigned int i = hash & mask;
+    struct duda_dispatch_entry *entry;
+
+    /* Linear probing, the table is never more than half full */
+    while (1) {
+        entry = &d->entries[i];
+        if (!entry->key) {
+            return entry;
+        }
+
+        if (entry->hash == hash && entry->key_len == len &&
+            memcmp(entry->key, key, len) == 0) {
+            return entry;
+        }
+        i = (i + 1) & mask;
+    }
+}
+
+static int dispatch_resize(struct duda_dispatch *d, int size)
+{
+    int i;
+    int old_size = d->size;
+    struct duda_dispatch_entry *old = d->entries;
+    struct duda_dispatch_entry *entry;
+
+    d->entries = mk_mem_alloc_z(sizeof(struct duda_dispatch_entry) * size);
+    if (!d->entries) {
+        d->entries = old;
+        return -1;
+    }
+    d->size = size;
+
+    for (i = 0; i < old_size; i++) {
+        if (!old[i].key) {
+            continue;
+        }
+        entry = dispatch_slot(d, old[i].hash, old[i].key, old[i].key_len);
+        *entry = old[i];
+    }
+
+    mk_mem_free(old);
+    return 0;
+}
+
+/* Creates an index able to hold 'count' keys without resizing */
+struct duda_dispatch *duda_dispatch_create(int count)
+{
+    int size = DUDA_DISPATCH_MIN_SIZE;
+    struct duda_dispatch *d;
+
+    while (size < count * 2) {
+        size <<= 1;
+    }
+
+    d = mk_mem_alloc_z(sizeof(struct duda_dispatch));
+    if (!d) {
+        return NULL;
+    }
+
+    d->entries = mk_mem_alloc_z(sizeof(struct duda_dispatch_entry) * size);
+    if (!d->entries) {
+        mk_mem_free(d);
+        return NULL;
+    }
+    d->size = size;
+
+    return d;
+}
+
+/* Register a key, if the key already exists its data is replaced */
+int duda_dispatch_add(struct duda_dispatch *d, const void *key, int len,
+                      void *data)
+{
+    unsigned int hash;
+    struct duda_dispatch_entry *entry;
+
+    if ((d->count + 1) * 2 > d->size) {
+        if (dispatch_resize(d, d->size * 2) != 0) {
+            return -1;
+        }
+    }
+
+    hash = dispatch_hash(key, len);
+    entry = dispatch_slot(d, hash, key, len);
+    if (!entry->key) {
+        entry->key = mk_mem_alloc(len);
+        if (!entry->key) {
+            return -1;
+        }
+        memcpy(entry->key, key, len);
+        entry->key_len = len;
+        entry->hash = hash;
+        d->count++;
+    }
+    entry->data = data;
+
+    return 0;
+}
+
+void *duda_dispatch_get(struct duda_dispatch *d, const void *key, int len)
+{
+    struct duda_dispatch_entry *entry;
+
+    if (!d || d->count == 0) {
+        return NULL;
+    }
+
+    entry = dispatch_slot(d, dispatch_hash(key, len), key, len);
+    return entry->data;
+}
+
+void duda_dispatch_destroy(struct duda_dispatch *d)
+{
+    int i;
+
+    if (!d) {
+        return;
+    }
+
+    for (i = 0; i < d->size; i++) {
+        mk_mem_free(d->entries[i].key);
+    }
+    mk_mem_free(d->entries);
+    mk_mem_free(d);
+}
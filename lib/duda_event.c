@@ -19,7 +19,7 @@
 
 #include <duda/duda_event.h>
 
-__thread struct mk_list *duda_events_list;
+__thread struct duda_event_table *duda_events;
 
 /*
  * @OBJ_NAME: event
@@ -52,9 +52,149 @@ __thread struct mk_list *duda_events_list;
  * using the method event->signal(). The signaling system only allow to distribute unsigned
  * 64 bits values (uint64_t).
  *
+ * To hand work to one specific worker, every worker also owns a mailbox: any thread can
+ * post a callback and a data reference with event->mailbox_post() and it will run on that
+ * worker event loop. Posting is lock-free and a burst of messages wakes up the worker once.
+ *
  */
 
 
+/* Create the worker table of event handlers */
+int duda_event_worker_init()
+{
+    struct duda_event_table *table;
+
+    if (duda_events) {
+        return 0;
+    }
+
+    table = mk_api->mem_alloc_z(sizeof(struct duda_event_table));
+    if (!table) {
+        return -1;
+    }
+
+    table->fds = mk_api->mem_alloc_z(sizeof(struct duda_event_handler *) *
+                                     DUDA_EVENT_TABLE_FDS);
+    if (!table->fds) {
+        mk_api->mem_free(table);
+        return -1;
+    }
+    table->size = DUDA_EVENT_TABLE_FDS;
+
+    /* Only the server workers own an event loop */
+    table->loop = mk_api->sched_loop();
+    if (!table->loop) {
+        mk_api->mem_free(table->fds);
+        mk_api->mem_free(table);
+        return -1;
+    }
+
+    duda_events = table;
+    return 0;
+}
+
+void duda_event_worker_exit()
+{
+    int i;
+    struct duda_event_table *table = duda_events;
+
+    if (!table) {
+        return;
+    }
+
+    for (i = 0; i < table->size; i++) {
+        if (table->fds[i]) {
+            mk_api->mem_free(table->fds[i]);
+        }
+    }
+
+    mk_api->mem_free(table->fds);
+    mk_api->mem_free(table);
+    duda_events = NULL;
+}
+
+/* Grow the table so it can index 'fd' */
+static int event_table_grow(struct duda_event_table *table, int fd)
+{
+    int size = table->size;
+    struct duda_event_handler **tmp;
+
+    while (size <= fd) {
+        size <<= 1;
+    }
+
+    tmp = mk_api->mem_realloc(table->fds,
+                              sizeof(struct duda_event_handler *) * size);
+    if (!tmp) {
+        return -1;
+    }
+    memset(tmp + table->size, '\0',
+           sizeof(struct duda_event_handler *) * (size - table->size));
+
+    table->fds  = tmp;
+    table->size = size;
+    return 0;
+}
+
+/*
+ * Event loop entry point for the registered handlers: the loop gives back
+ * the handler, so there is no lookup. If a callback returns DUDA_EVENT_CLOSE
+ * or the peer hung up, the close callback is invoked and the handler is
+ * deleted and the file descriptor closed.
+ */
+static int event_dispatch(void *data)
+{
+    int fd;
+    int ret = DUDA_EVENT_OWNED;
+    uint32_t mask;
+    struct duda_event_handler *eh = data;
+
+    /* Deleted while the loop had events pending for it */
+    fd = eh->sockfd;
+    if (fd == -1) {
+        return 0;
+    }
+
+    mask = eh->event.mask;
+    if ((mask & DUDA_EVENT_READ) && eh->cb_on_read) {
+        ret = eh->cb_on_read(fd, eh->cb_data);
+    }
+
+    if (ret != DUDA_EVENT_CLOSE && eh->sockfd == fd &&
+        (mask & DUDA_EVENT_WRITE) && eh->cb_on_write) {
+        ret = eh->cb_on_write(fd, eh->cb_data);
+    }
+
+    /* A callback deleted the handler */
+    if (eh->sockfd != fd) {
+        return 0;
+    }
+
+    if (ret != DUDA_EVENT_CLOSE && !(mask & DUDA_EVENT_READ) &&
+        (mask & MK_EVENT_CLOSE)) {
+        if (eh->cb_on_error) {
+            eh->cb_on_error(fd, eh->cb_data);
+            if (eh->sockfd != fd) {
+                return 0;
+            }
+        }
+        ret = DUDA_EVENT_CLOSE;
+    }
+
+    if (ret == DUDA_EVENT_CLOSE) {
+        if (eh->cb_on_close) {
+            eh->cb_on_close(fd, eh->cb_data);
+        }
+        if (eh->sockfd == fd) {
+            duda_event_delete(fd);
+            close(fd);
+        }
+    }
+
+    return 0;
+}
+
+
 /*
  * @METHOD_NAME: add
  * @METHOD_DESC: Register a new socket or file descriptor into the worker event loop and
@@ -83,54 +223,76 @@ int duda_event_add(int sockfd,
                    int (*cb_on_timeout) (int, void *),
                    void *data)
 {
-    int rc = -1;
+    int rc;
+    duda_request_t *dr;
+    struct duda_event_table *table;
     struct duda_event_handler *eh;
-    static duda_request_t *dr;
 
-    eh = mk_api->mem_alloc_z(sizeof(struct duda_event_handler));
+    if (sockfd < 0 || init_mode < DUDA_EVENT_READ) {
+        mk_err("Duda: Invalid usage of duda_event_add()");
+        return -1;
+    }
+
+    if (!duda_events && duda_event_worker_init() != 0) {
+        return -1;
+    }
+    table = duda_events;
+
+    if (sockfd >= table->size && event_table_grow(table, sockfd) != 0) {
+        return -1;
+    }
+
+    /* The slot keeps the handler of a previous use of this descriptor */
+    eh = table->fds[sockfd];
     if (!eh) {
+        eh = mk_api->mem_alloc_z(sizeof(struct duda_event_handler));
+        if (!eh) {
+            return -1;
+        }
+        table->fds[sockfd] = eh;
+    }
+    else if (eh->sockfd != -1) {
+        /* Already registered */
         return -1;
     }
 
-    /* set node */
-    eh->sockfd = sockfd;
-    eh->mode = init_mode;
-    eh->behavior = behavior;
+    eh->sockfd        = sockfd;
+    eh->mode          = init_mode;
+    eh->behavior      = behavior;
     eh->cb_on_read    = cb_on_read;
     eh->cb_on_write   = cb_on_write;
     eh->cb_on_error   = cb_on_error;
     eh->cb_on_close   = cb_on_close;
     eh->cb_on_timeout = cb_on_timeout;
-    eh->cb_data = data;
-
-    /* Link to thread list */
-    mk_list_add(&eh->_head, duda_events_list);
-
-    if (init_mode < DUDA_EVENT_READ) {
-        mk_err("Duda: Invalid usage of duda_event_add()");
-        exit(EXIT_FAILURE);
-    }
+    eh->cb_data       = data;
 
     /*
-       FIXME!!
-
-       Check if the event socket belongs to an active duda_request_t
-    dr = duda_dr_list_get(sockfd);
-    if (dr) {
-        if (sockfd != dr->socket) {
-            rc = mk_api->event_add(sockfd, init_mode, duda_plugin, behavior);
-        }
-        else {
-            rc = mk_api->event_socket_change_mode(sockfd, init_mode, behavior);
-        }
+     * The socket of a request in progress is already on the loop as a
+     * server connection and the server gets its events: only its mode is
+     * changed, the handler is kept so it can be found with lookup(). Any
+     * other descriptor, including a socket number left in the table by a
+     * finished request, is registered on the worker loop.
+     */
+    dr = duda_request_lookup(sockfd);
+    if (dr && dr->_st_active == MK_TRUE) {
+        eh->registered = MK_FALSE;
+        rc = mk_api->event_socket_change_mode(sockfd, init_mode, behavior);
     }
     else {
-        rc = mk_api->event_add(sockfd, init_mode, behavior,
-                               duda_plugin,
-                               NULL, NULL, NULL, NULL, NULL);
-                               }*/
+        memset(&eh->event, '\0', sizeof(struct mk_event));
+        eh->event.handler = event_dispatch;
+        eh->registered = MK_TRUE;
+        rc = mk_api->ev_add(table->loop, sockfd, MK_EVENT_CUSTOM,
+                            init_mode, eh);
+    }
+
+    if (rc < 0) {
+        eh->sockfd = -1;
+        eh->registered = MK_FALSE;
+        return -1;
+    }
+
     return 0;
-    return rc;
 }
 
 /*
@@ -146,25 +308,19 @@ int duda_event_add(int sockfd,
  */
 struct duda_event_handler *duda_event_lookup(int sockfd)
 {
-    struct mk_list *head;
     struct duda_event_handler *eh;
+    struct duda_event_table *table = duda_events;
 
-    if (!duda_events_list) {
+    if (!table || sockfd < 0 || sockfd >= table->size) {
         return NULL;
     }
 
-    if (mk_list_is_empty(duda_events_list) == 0) {
+    eh = table->fds[sockfd];
+    if (!eh || eh->sockfd == -1) {
         return NULL;
     }
 
-    mk_list_foreach(head, duda_events_list) {
-        eh = mk_list_entry(head, struct duda_event_handler, _head);
-        if (eh->sockfd == sockfd) {
-            return eh;
-        }
-    }
-
-    return NULL;
+    return eh;
 }
 
 /*
@@ -189,7 +345,19 @@ int duda_event_mode(int sockfd, int mode, int behavior)
         return -1;
     }
 
-    return mk_api->event_socket_change_mode(sockfd, mode, behavior);
+    if (eh->registered == MK_FALSE) {
+        return mk_api->event_socket_change_mode(sockfd, mode, behavior);
+    }
+
+    if (mode == DUDA_EVENT_WAKEUP) {
+        mode = eh->mode;
+    }
+    else if (mode != DUDA_EVENT_SLEEP) {
+        eh->mode = mode;
+    }
+    eh->behavior = behavior;
+
+    return mk_api->ev_add(duda_events->loop, sockfd, MK_EVENT_CUSTOM, mode, eh);
 }
 
 /*
@@ -200,33 +368,22 @@ int duda_event_mode(int sockfd, int mode, int behavior)
  */
 int duda_event_delete(int sockfd)
 {
-    struct mk_list *head, *tmp;
     struct duda_event_handler *eh;
-    duda_request_t *dr;
 
-    if (!duda_events_list) {
+    eh = duda_event_lookup(sockfd);
+    if (!eh) {
         return -1;
     }
 
-    mk_list_foreach_safe(head, tmp, duda_events_list) {
-        eh = mk_list_entry(head, struct duda_event_handler, _head);
-        if (eh->sockfd == sockfd) {
-            mk_list_del(&eh->_head);
-            mk_api->mem_free(eh);
-
-            /* Check if the event socket belongs to an active duda_request_t */
-            dr = duda_dr_list_get(sockfd);
-            if (!dr) {
-                mk_api->event_del(sockfd);
-            }
-            else if (sockfd != dr->socket) {
-                mk_api->event_del(sockfd);
-            }
-            return 0;
-        }
+    if (eh->registered == MK_TRUE) {
+        mk_api->ev_del(duda_events->loop, &eh->event);
     }
 
-    return -1;
+    eh->sockfd = -1;
+    eh->registered = MK_FALSE;
+    eh->cb_data = NULL;
+
+    return 0;
 }
 
 /*
@@ -446,6 +603,16 @@ struct duda_api_event *duda_event_object()
     e->signal = duda_event_signal;
     e->create_signal_fd = duda_event_create_signal_fd;
 
+    /* Timers */
+    e->timer_add        = duda_timer_add;
+    e->timer_cancel     = duda_timer_cancel;
+    e->timer_reschedule = duda_timer_reschedule;
+
+    /* Mailboxes */
+    e->mailbox_post     = duda_mailbox_post;
+    e->mailbox_self     = duda_mailbox_self;
+    e->mailbox_workers  = duda_mailbox_workers;
+
     /* Custom loop functions */
     e->loop_create         = mk_api->ev_loop_create;
     e->loop_add            = mk_api->ev_add;
@@ -0,0 +1,250 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Duda I/O
+ *  --------
+ *  Copyright (C) 2012-2016, Eduardo Silva P. <eduardo@monkey.io>.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include <monkey/mk_api.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+
+#include <duda/duda_fcache.h>
+
+/* Per worker cache of open files */
+static __thread struct duda_fcache *fcache;
+
+static inline unsigned int fcache_hash(const char *key, int len)
+{
+    int i;
+    unsigned int hash = 2166136261u;
+
+    for (i = 0; i < len; i++) {
+        hash ^= (unsigned char) key[i];
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+static struct duda_fcache *fcache_init()
+{
+    int i;
+    struct duda_fcache *fc;
+
+    fc = mk_api->mem_alloc_z(sizeof(struct duda_fcache));
+    if (!fc) {
+        return NULL;
+    }
+
+    mk_list_init(&fc->lru);
+    for (i = 0; i < DUDA_FCACHE_BUCKETS; i++) {
+        mk_list_init(&fc->buckets[i]);
+    }
+
+    fcache = fc;
+    return fc;
+}
+
+/* Take the entry out of the cache, it's closed once no request use it */
+static void fcache_remove(struct duda_fcache *fc, struct duda_fcache_entry *fe)
+{
+    mk_list_del(&fe->_head);
+    mk_list_del(&fe->_head_lru);
+    fc->count--;
+
+    duda_fcache_put(fe);
+}
+
+/* Open a file and compose its entry */
+static struct duda_fcache_entry *fcache_open(const char *path, int len,
+                                             unsigned int hash, time_t now,
+                                             int flags)
+{
+    int fd;
+    struct stat st;
+    struct duda_fcache_entry *fe;
+
+    fd = open(path, O_RDONLY | O_NONBLOCK | flags);
+    if (fd < 0) {
+        return NULL;
+    }
+
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        close(fd);
+        return NULL;
+    }
+
+    fe = mk_api->mem_alloc(sizeof(struct duda_fcache_entry) + len + 1);
+    if (!fe) {
+        close(fd);
+        return NULL;
+    }
+
+    fe->fd       = fd;
+    fe->refs     = 1;
+    fe->hash     = hash;
+    fe->path_len = len;
+    fe->path     = (char *) (fe + 1);
+    memcpy(fe->path, path, len + 1);
+
+    fe->dev      = st.st_dev;
+    fe->ino      = st.st_ino;
+    fe->size     = st.st_size;
+    fe->mtime    = st.st_mtime;
+    fe->checked  = now;
+    fe->etag_len = duda_fcache_etag(fe->etag, sizeof(fe->etag),
+                                    st.st_mtime, st.st_size);
+
+    return fe;
+}
+
+/* Returns MK_TRUE if the file on disk is still the one of the entry */
+static int fcache_valid(struct duda_fcache_entry *fe, time_t now)
+{
+    struct stat st;
+
+    if (now - fe->checked < DUDA_FCACHE_TTL) {
+        return MK_TRUE;
+    }
+
+    if (stat(fe->path, &st) != 0 ||
+        st.st_ino != fe->ino || st.st_dev != fe->dev ||
+        st.st_size != fe->size || st.st_mtime != fe->mtime) {
+        return MK_FALSE;
+    }
+
+    fe->checked = now;
+    return MK_TRUE;
+}
+
+/* Compose the ETag of a file, it returns the length */
+int duda_fcache_etag(char *buf, int size, time_t mtime, off_t fsize)
+{
+    return snprintf(buf, size, "\"%lx-%lx\"",
+                    (unsigned long) mtime, (unsigned long) fsize);
+}
+
+static struct duda_fcache_entry *fcache_lookup(struct duda_fcache *fc,
+                                               const char *path, int len,
+                                               unsigned int hash, time_t now)
+{
+    struct mk_list *head;
+    struct mk_list *bucket;
+    struct duda_fcache_entry *fe;
+
+    bucket = &fc->buckets[hash & (DUDA_FCACHE_BUCKETS - 1)];
+    mk_list_foreach(head, bucket) {
+        fe = mk_list_entry(head, struct duda_fcache_entry, _head);
+        if (fe->hash != hash || fe->path_len != len ||
+            memcmp(fe->path, path, len) != 0) {
+            continue;
+        }
+
+        if (fcache_valid(fe, now) == MK_FALSE) {
+            fcache_remove(fc, fe);
+            return NULL;
+        }
+
+        /* Most recently used goes last */
+        mk_list_del(&fe->_head_lru);
+        mk_list_add(&fe->_head_lru, &fc->lru);
+        fe->refs++;
+        return fe;
+    }
+
+    return NULL;
+}
+
+/*
+ * Returns the cache entry of a file only if it's already in the cache, the
+ * file is never opened. The caller owns a reference.
+ */
+struct duda_fcache_entry *duda_fcache_find(const char *path)
+{
+    int len;
+    struct duda_fcache *fc = fcache;
+
+    if (!fc) {
+        return NULL;
+    }
+
+    len = strlen(path);
+    return fcache_lookup(fc, path, len, fcache_hash(path, len), time(NULL));
+}
+
+/*
+ * Returns the cache entry of a regular file opened for reading, the caller
+ * owns a reference that must be released with duda_fcache_put(). It
+ * returns NULL if the file cannot be opened.
+ */
+struct duda_fcache_entry *duda_fcache_get(const char *path)
+{
+    return duda_fcache_get_flags(path, 0);
+}
+
+/* Same as duda_fcache_get(), extra open(2) flags are used if the file is opened */
+struct duda_fcache_entry *duda_fcache_get_flags(const char *path, int flags)
+{
+    int len;
+    time_t now;
+    unsigned int hash;
+    struct duda_fcache *fc = fcache;
+    struct duda_fcache_entry *fe;
+    struct duda_fcache_entry *old;
+
+    if (!fc && !(fc = fcache_init())) {
+        return NULL;
+    }
+
+    len  = strlen(path);
+    hash = fcache_hash(path, len);
+    now  = time(NULL);
+
+    fe = fcache_lookup(fc, path, len, hash, now);
+    if (fe) {
+        return fe;
+    }
+
+    fe = fcache_open(path, len, hash, now, flags);
+    if (!fe) {
+        return NULL;
+    }
+
+    if (fc->count >= DUDA_FCACHE_MAX) {
+        old = mk_list_entry_first(&fc->lru, struct duda_fcache_entry, _head_lru);
+        fcache_remove(fc, old);
+    }
+
+    mk_list_add(&fe->_head, &fc->buckets[hash & (DUDA_FCACHE_BUCKETS - 1)]);
+    mk_list_add(&fe->_head_lru, &fc->lru);
+    fe->refs++;
+    fc->count++;
+
+    return fe;
+}
+
+/* Release a reference to an entry */
+void duda_fcache_put(struct duda_fcache_entry *fe)
+{
+    if (--fe->refs > 0) {
+        return;
+    }
+
+    close(fe->fd);
+    mk_api->mem_free(fe);
+}
@@ -0,0 +1,266 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Duda I/O
+ *  --------
+ *  Copyright (C) 2012-2016, Eduardo Silva P. <eduardo@monkey.io>.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+
+#include <monkey/mk_api.h>
+
+#include <duda/duda_event.h>
+#include <duda/duda_mailbox.h>
+
+#define MAILBOX_MASK  (DUDA_MAILBOX_SIZE - 1)
+
+/* Mailboxes of all workers, indexed by worker id */
+static struct duda_mailbox *mailboxes[DUDA_MAILBOX_WORKERS];
+static int mailboxes_count;
+static pthread_mutex_t mailboxes_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Mailbox of the running worker */
+static __thread struct duda_mailbox *mailbox;
+
+/* Wake up the worker unless it was already notified */
+static inline void mailbox_notify(struct duda_mailbox *mb)
+{
+    uint64_t one = 1;
+
+    if (__atomic_exchange_n(&mb->notified, 1, __ATOMIC_SEQ_CST) == 0) {
+        if (write(mb->efd, &one, sizeof(one)) != sizeof(one)) {
+            mk_err("Duda: mailbox %i wakeup failed", mb->id);
+        }
+    }
+}
+
+/* Read event on the eventfd: run the messages posted so far */
+static int mailbox_read(int fd, void *data)
+{
+    int n;
+    uint64_t val;
+    void *msg_data;
+    void (*cb) (void *);
+    struct duda_mailbox_msg *msg;
+    struct duda_mailbox *mb = data;
+
+    if (read(fd, &val, sizeof(val)) <= 0) {
+        return DUDA_EVENT_OWNED;
+    }
+
+    /*
+     * Clear the flag before draining: a message published after the last
+     * check below finds the flag clear and wakes us up again.
+     */
+    __atomic_store_n(&mb->notified, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    for (n = 0; n < DUDA_MAILBOX_SIZE; n++) {
+        msg = &mb->msgs[mb->head & MAILBOX_MASK];
+        if (__atomic_load_n(&msg->seq, __ATOMIC_ACQUIRE) != mb->head + 1) {
+            break;
+        }
+
+        cb       = msg->cb;
+        msg_data = msg->data;
+
+        /* Give the slot back to the producers before running the callback */
+        __atomic_store_n(&msg->seq, mb->head + DUDA_MAILBOX_SIZE,
+                         __ATOMIC_RELEASE);
+        mb->head++;
+
+        cb(msg_data);
+    }
+
+    /* A full batch, let other events run and continue on the next round */
+    if (n == DUDA_MAILBOX_SIZE) {
+        mailbox_notify(mb);
+    }
+
+    return DUDA_EVENT_OWNED;
+}
+
+/* Create the mailbox of the running worker and publish it */
+int duda_mailbox_worker_init()
+{
+    int i;
+    int id;
+    struct duda_mailbox *mb;
+
+    if (mailbox) {
+        return 0;
+    }
+
+    mb = mk_api->mem_alloc_z(sizeof(struct duda_mailbox));
+    if (!mb) {
+        return -1;
+    }
+
+    mb->msgs = mk_api->mem_alloc(sizeof(struct duda_mailbox_msg) *
+                                 DUDA_MAILBOX_SIZE);
+    if (!mb->msgs) {
+        mk_api->mem_free(mb);
+        return -1;
+    }
+    for (i = 0; i < DUDA_MAILBOX_SIZE; i++) {
+        mb->msgs[i].seq = i;
+    }
+
+    mb->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (mb->efd == -1) {
+        mk_api->mem_free(mb->msgs);
+        mk_api->mem_free(mb);
+        return -1;
+    }
+
+    if (duda_event_add(mb->efd, DUDA_EVENT_READ, DUDA_EVENT_LEVEL_TRIGGERED,
+                       mailbox_read, NULL, NULL, NULL, NULL, mb) != 0) {
+        goto error;
+    }
+
+    /*
+     * Take the worker id only once the mailbox is polled by the loop, the
+     * count is raised after the slot is published so every id below it can
+     * take messages.
+     */
+    pthread_mutex_lock(&mailboxes_mutex);
+    id = mailboxes_count;
+    if (id >= DUDA_MAILBOX_WORKERS) {
+        pthread_mutex_unlock(&mailboxes_mutex);
+        duda_event_delete(mb->efd);
+        goto error;
+    }
+    mb->id = id;
+    __atomic_store_n(&mailboxes[id], mb, __ATOMIC_RELEASE);
+    __atomic_store_n(&mailboxes_count, id + 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&mailboxes_mutex);
+
+    mailbox = mb;
+    return 0;
+
+ error:
+    close(mb->efd);
+    mk_api->mem_free(mb->msgs);
+    mk_api->mem_free(mb);
+    return -1;
+}
+
+/*
+ * Release the mailbox of the running worker, pending messages are dropped.
+ * No other thread must post to this worker from now on.
+ */
+void duda_mailbox_worker_exit()
+{
+    struct duda_mailbox *mb = mailbox;
+
+    if (!mb) {
+        return;
+    }
+
+    __atomic_store_n(&mailboxes[mb->id], NULL, __ATOMIC_RELEASE);
+    duda_event_delete(mb->efd);
+    close(mb->efd);
+    mk_api->mem_free(mb->msgs);
+    mk_api->mem_free(mb);
+    mailbox = NULL;
+}
+
+/*
+ * @METHOD_NAME: mailbox_post
+ * @METHOD_DESC: Post a message to the mailbox of a worker, the callback will run on
+ * that worker event loop with the given data. It can be called from any thread, posting
+ * do not take locks and a burst of messages wakes up the worker only once. Messages from
+ * the same thread are delivered in order.
+ * @METHOD_PROTO: int mailbox_post(int worker, void (*cb) (void *), void *data)
+ * @METHOD_PARAM: worker the target worker id, from 0 to mailbox_workers() - 1.
+ * @METHOD_PARAM: cb callback function to run on the worker.
+ * @METHOD_PARAM: data custom reference passed to the callback.
+ * @METHOD_RETURN: Upon successful completion it returns 0. It returns -1 if the worker
+ * do not exists or if its mailbox is full.
+ */
+int duda_mailbox_post(int worker, void (*cb) (void *), void *data)
+{
+    long diff;
+    unsigned long seq;
+    unsigned long pos;
+    struct duda_mailbox *mb;
+    struct duda_mailbox_msg *msg;
+
+    if (worker < 0 || worker >= DUDA_MAILBOX_WORKERS || !cb) {
+        return -1;
+    }
+
+    mb = __atomic_load_n(&mailboxes[worker], __ATOMIC_ACQUIRE);
+    if (!mb) {
+        return -1;
+    }
+
+    /* Claim a slot: its sequence equals the tail while it's free */
+    pos = __atomic_load_n(&mb->tail, __ATOMIC_RELAXED);
+    while (1) {
+        msg  = &mb->msgs[pos & MAILBOX_MASK];
+        seq  = __atomic_load_n(&msg->seq, __ATOMIC_ACQUIRE);
+        diff = (long) (seq - pos);
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&mb->tail, &pos, pos + 1, 1,
+                                            __ATOMIC_RELAXED,
+                                            __ATOMIC_RELAXED)) {
+                break;
+            }
+        }
+        else if (diff < 0) {
+            /* full */
+            return -1;
+        }
+        else {
+            pos = __atomic_load_n(&mb->tail, __ATOMIC_RELAXED);
+        }
+    }
+
+    msg->cb   = cb;
+    msg->data = data;
+    __atomic_store_n(&msg->seq, pos + 1, __ATOMIC_RELEASE);
+
+    mailbox_notify(mb);
+    return 0;
+}
+
+/*
+ * @METHOD_NAME: mailbox_self
+ * @METHOD_DESC: Get the worker id of the running worker, it's the id other threads use
+ * to post messages to it.
+ * @METHOD_PROTO: int mailbox_self()
+ * @METHOD_RETURN: the worker id, or -1 if it's not called from a worker.
+ */
+int duda_mailbox_self()
+{
+    if (!mailbox) {
+        return -1;
+    }
+    return mailbox->id;
+}
+
+/*
+ * @METHOD_NAME: mailbox_workers
+ * @METHOD_DESC: Get the number of workers with a mailbox.
+ * @METHOD_PROTO: int mailbox_workers()
+ * @METHOD_RETURN: the number of workers, valid ids go from 0 to this value - 1.
+ */
+int duda_mailbox_workers()
+{
+    return __atomic_load_n(&mailboxes_count, __ATOMIC_ACQUIRE);
+}
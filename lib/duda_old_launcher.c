@@ -30,6 +30,7 @@
 #include <duda/duda_event.h>
 #include <duda/duda_queue.h>
 #include <duda/duda_package.h>
+#include <duda/duda_dispatch.h>
 
 #include <duda/duda_request.h>
 #include <duda/objects/duda_gc.h>
@@ -39,74 +40,6 @@
 #include <duda/objects/duda_worker.h>
 #include <duda/objects/duda_dthread.h>
 
-/* Register a new duda_request into the thread context list */
-static void duda_dr_list_add(duda_request_t *dr)
-{
-    struct rb_root *root = pthread_getspecific(duda_global_dr_list);
-
-    /* Red-Black tree insert routine */
-    struct rb_node **new = &(root->rb_node);
-    struct rb_node *parent = NULL;
-
-    /* Figure out where to put new node */
-    while (*new) {
-        duda_request_t *this = container_of(*new, duda_request_t, _rb_head);
-
-        parent = *new;
-        if (dr->socket < this->socket)
-            new = &((*new)->rb_left);
-        else if (dr->socket > this->socket)
-            new = &((*new)->rb_right);
-        else {
-            break;
-        }
-    }
-
-    /* Add new node and rebalance tree. */
-    mk_api->rb_link_node(&dr->_rb_head, parent, new);
-    mk_api->rb_insert_color(&dr->_rb_head, root);
-}
-
-duda_request_t *duda_dr_list_get(struct mk_http_request *sr)
-{
-    struct rb_root *root;
-    duda_request_t *dr;
-
-    root = pthread_getspecific(duda_global_dr_list);
-    if (!root) {
-        return NULL;
-    }
-
-  	struct rb_node *node = root->rb_node;
-  	while (node) {
-  		dr = container_of(node, duda_request_t, _rb_head);
-		if (sr < dr->request)
-  			node = node->rb_left;
-		else if (sr > dr->request)
-  			node = node->rb_right;
-		else {
-  			return dr;
-        }
-	}
-
-	return NULL;
-}
-
-static duda_request_t *duda_dr_list_del(struct mk_http_request *sr)
-{
-    duda_request_t *dr = duda_dr_list_get(sr);
-    struct rb_root *root;
-
-    if (!dr) {
-        return NULL;
-    }
-
-    root = pthread_getspecific(duda_global_dr_list);
-    mk_api->rb_erase(&dr->_rb_head, root);
-
-    return dr;
-}
-
 void *duda_load_library(const char *path)
 {
     void *handle;
@@ -238,132 +171,63 @@ int duda_load_services()
     return 0;
 }
 
-void duda_mem_init()
-{
-    int len;
-    time_t expire = COOKIE_EXPIRE_TIME;
-    struct tm *gmt;
-
-    /* Init mk_ptr_t's */
-    mk_api->pointer_set(&dd_iov_none, "");
-    mk_api->pointer_set(&dd_cookie_crlf,      COOKIE_CRLF);
-    mk_api->pointer_set(&dd_cookie_equal,     COOKIE_EQUAL);
-    mk_api->pointer_set(&dd_cookie_set,       COOKIE_SET);
-    mk_api->pointer_set(&dd_cookie_expire,    COOKIE_EXPIRE);
-    mk_api->pointer_set(&dd_cookie_path,      COOKIE_PATH);
-    mk_api->pointer_set(&dd_cookie_semicolon, COOKIE_SEMICOLON);
-
-    /* Default expire value */
-    dd_cookie_expire_value.data = mk_api->mem_alloc_z(COOKIE_MAX_DATE_LEN);
-
-    gmt = gmtime(&expire);
-    len = strftime(dd_cookie_expire_value.data,
-                   COOKIE_MAX_DATE_LEN,
-                   "%a, %d %b %Y %H:%M:%S GMT\r\n",
-                   gmt);
-    dd_cookie_expire_value.len = len;
-}
-
 /*
- * These are the Monkey hooks for the event handler, each time an event
- * arrives here and depending of the event type, it will perform a lookup
- * over the thread list looking for possible event-handlers.
- *
- * By Monkey definition exists hooks:
- *
- *  _mkp_event_read(int sockfd)    -> socket is ready to read
- *  _mkp_event_write(int sockfd)   -> socket is ready to write
- *  _mkp_event_close(int sockfd)   -> socket has been closed
- *  _mkp_event_error(int sockfd)   -> some error happend at socket level
- *  _mkp_event_timeout(int sockfd) -> the socket have timed out
+ * Build the dispatch indexes used on every request: one for the virtual
+ * hosts keyed by the Monkey host reference, and one per virtual host
+ * keyed by the service name.
  */
-
-int _mkp_event_read(int sockfd)
+static int duda_dispatch_init()
 {
     int ret;
+    struct mk_list *head_vh;
+    struct mk_list *head_ws;
+    struct vhost_services *entry_vs;
+    struct web_service *entry_ws;
 
-    PLUGIN_TRACE("[FD %i] Event READ", sockfd);
-
-    struct duda_event_handler *eh = duda_event_lookup(sockfd);
-    if (eh && eh->cb_on_read) {
-        ret = eh->cb_on_read(eh->sockfd, eh->cb_data);
-
-        /* we dont want a bad API usage.. */
-        if (mk_unlikely(ret != DUDA_EVENT_OWNED && ret != DUDA_EVENT_CLOSE &&
-                        ret != DUDA_EVENT_CONTINUE)) {
-            mk_err("Bad return value on read event callback");
-            exit(EXIT_FAILURE);
-        }
-        return ret;
-    }
-
-    return MK_PLUGIN_RET_EVENT_CONTINUE;
-}
-
-int _mkp_event_write(int sockfd)
-{
-    struct duda_event_handler *eh = duda_event_lookup(sockfd);
-
-    PLUGIN_TRACE("[FD %i] Event WRITE", sockfd);
-
-    if (eh && eh->cb_on_write) {
-        eh->cb_on_write(eh->sockfd, eh->cb_data);
-        return MK_PLUGIN_RET_EVENT_OWNED;
+    duda_vhost_index = duda_dispatch_create(mk_list_size(&services_list));
+    if (!duda_vhost_index) {
+        return -1;
     }
 
-    /*
-     * By default we always check if we have some pending data in our
-     * outgoing queue
-     */
-    return duda_queue_event_write_callback(sockfd);
-}
-
-int mkp_event_close(int sockfd)
-{
-    (void) sockfd;
-    /* FIXME
-    int ret;
-    struct duda_event_handler *eh = duda_event_lookup(sockfd);
-    duda_request_t *dr = NULL;
+    mk_list_foreach(head_vh, &services_list) {
+        entry_vs = mk_list_entry(head_vh, struct vhost_services, _head);
+        ret = duda_dispatch_add(duda_vhost_index,
+                                &entry_vs->host, sizeof(entry_vs->host),
+                                entry_vs);
+        if (ret != 0) {
+            return -1;
+        }
 
-    PLUGIN_TRACE("[FD %i] Event CLOSE", sockfd);
+        entry_vs->services_index = duda_dispatch_create(mk_list_size(&entry_vs->services));
+        if (!entry_vs->services_index) {
+            return -1;
+        }
 
-    ret =  MK_PLUGIN_RET_EVENT_CONTINUE;
+        mk_list_foreach(head_ws, &entry_vs->services) {
+            entry_ws = mk_list_entry(head_ws, struct web_service, _head);
 
-    if (eh && eh->cb_on_close) {
-        eh->cb_on_close(eh->sockfd, eh->cb_data);
-        duda_event_delete(sockfd);
-        ret = MK_PLUGIN_RET_EVENT_OWNED;
-    }
+            /* First registered service wins, as the old list lookup did */
+            if (duda_dispatch_get(entry_vs->services_index,
+                                  entry_ws->name.data, entry_ws->name.len)) {
+                continue;
+            }
 
-    dr = duda_dr_list_del(sockfd);
-    if (dr) {
-        if (dr->_st_service_end == MK_FALSE) {
-            duda_service_end(dr);
+            ret = duda_dispatch_add(entry_vs->services_index,
+                                    entry_ws->name.data, entry_ws->name.len,
+                                    entry_ws);
+            if (ret != 0) {
+                return -1;
+            }
         }
-        duda_gc_free(dr);
-        mk_api->mem_free(dr);
-        ret = MK_PLUGIN_RET_EVENT_OWNED;
     }
 
-    return ret;
-    */
     return 0;
 }
 
-int _mkp_event_close(int sockfd)
-{
-    return mkp_event_close(sockfd);
-}
-
-int _mkp_event_error(int sockfd)
-{
-    return mkp_event_close(sockfd);
-}
-
-int _mkp_event_timeout(int sockfd)
+void duda_mem_init()
 {
-    return mkp_event_close(sockfd);
+    /* Init mk_ptr_t's */
+    mk_api->pointer_set(&dd_iov_none, "");
 }
 
 static void _thread_globals_init(struct mk_list *list)
@@ -409,68 +273,24 @@ static void _thread_worker_pre_loop(struct mk_list *list)
  * Thread context initialization: for each thread worker, this function
  * is invoked, including the workers defined through the worker->spawn() method.
  *
- * When running in a user-defined thread, some things will not be initialized
- * properly such as the event file descriptor. Not an issue.
+ * It only sets up what does not depend on an event loop, the server workers
+ * complete their context in duda_server_worker_init().
  */
 void duda_worker_init()
 {
-    int rc;
-    int fds[2];
     char *logger_fmt_cache;
     struct mk_list *head_vs, *head_ws;
-    struct mk_list *list_events_write;
-    struct rb_root *dr_list;
     struct vhost_services *entry_vs;
     struct web_service *entry_ws;
-    struct duda_event_signal_channel *esc;
 
 #if defined(MALLOC_JEMALLOC) && defined(JEMALLOC_STATS)
     duda_stats_worker_init();
 #endif
 
-    /* Events write list */
-    list_events_write = mk_api->mem_alloc_z(sizeof(struct mk_list));
-    mk_list_init(list_events_write);
-    pthread_setspecific(duda_global_events_write, (void *) list_events_write);
-
-    /* Events */
-    duda_events_list = mk_api->mem_alloc_z(sizeof(struct rb_root));
-    mk_list_init(duda_events_list);
-
-     /* List of all duda_request_t alive */
-    dr_list = mk_api->mem_alloc_z(sizeof(struct rb_root));
-    pthread_setspecific(duda_global_dr_list, (void *) dr_list);
-
     /* Logger FMT cache */
     logger_fmt_cache = mk_api->mem_alloc_z(512);
     pthread_setspecific(duda_logger_fmt_cache, (void *) logger_fmt_cache);
 
-    /* Register a Linux pipe into the Events interface */
-    if (pipe(fds) == -1) {
-        mk_err("Error creating thread signal pipe. Aborting.");
-        exit(EXIT_FAILURE);
-    }
-
-    /* Register the event file descriptor in the events interface */
-    rc = duda_event_add(fds[0], DUDA_EVENT_READ, DUDA_EVENT_LEVEL_TRIGGERED,
-                        duda_event_fd_read, NULL, NULL, NULL, NULL, NULL);
-    if (rc == 0) {
-        mk_api->socket_set_nonblocking(fds[1]);
-        esc = mk_api->mem_alloc(sizeof(struct duda_event_signal_channel));
-        esc->fd_r = fds[0];
-        esc->fd_w = fds[1];
-
-        /* Safe initialization */
-        pthread_mutex_lock(&duda_mutex_thctx);
-        mk_list_add(&esc->_head, &duda_event_signals_list);
-        pthread_mutex_unlock(&duda_mutex_thctx);
-    }
-    else {
-        close(fds[0]);
-        close(fds[1]);
-    }
-
-
     /*
      * Load global data if applies, this is toooo recursive, we need to go through
      * every virtual host and check the services loaded for each one, then lookup
@@ -503,6 +323,63 @@ void duda_worker_init()
     }
 }
 
+/*
+ * Server worker initialization: invoked by Monkey on each of its workers, it
+ * sets up everything bound to the worker event loop and then the common
+ * thread context.
+ */
+void duda_server_worker_init()
+{
+    int rc;
+    int fds[2];
+    struct duda_event_signal_channel *esc;
+
+    /* Events */
+    if (duda_event_worker_init() != 0) {
+        mk_err("Error creating the events table. Aborting.");
+        exit(EXIT_FAILURE);
+    }
+
+    /* Mailbox for messages from other threads */
+    if (duda_mailbox_worker_init() != 0) {
+        mk_err("Error creating the worker mailbox. Aborting.");
+        exit(EXIT_FAILURE);
+    }
+
+    /* Pool of duda_request_t contexts */
+    if (duda_request_pool_init() != 0) {
+        mk_err("Error creating the request pool. Aborting.");
+        exit(EXIT_FAILURE);
+    }
+
+    /* Register a Linux pipe into the Events interface */
+    if (pipe(fds) == -1) {
+        mk_err("Error creating thread signal pipe. Aborting.");
+        exit(EXIT_FAILURE);
+    }
+
+    /* Register the event file descriptor in the events interface */
+    rc = duda_event_add(fds[0], DUDA_EVENT_READ, DUDA_EVENT_LEVEL_TRIGGERED,
+                        duda_event_fd_read, NULL, NULL, NULL, NULL, NULL);
+    if (rc == 0) {
+        mk_api->socket_set_nonblocking(fds[1]);
+        esc = mk_api->mem_alloc(sizeof(struct duda_event_signal_channel));
+        esc->fd_r = fds[0];
+        esc->fd_w = fds[1];
+
+        /* Safe initialization */
+        pthread_mutex_lock(&duda_mutex_thctx);
+        mk_list_add(&esc->_head, &duda_event_signals_list);
+        pthread_mutex_unlock(&duda_mutex_thctx);
+    }
+    else {
+        close(fds[0]);
+        close(fds[1]);
+    }
+
+    duda_worker_init();
+}
+
 int duda_master_init(struct mk_server_config *config)
 {
     struct mk_list *head;
@@ -517,6 +394,12 @@ int duda_master_init(struct mk_server_config *config)
     /* Load web services */
     duda_load_services();
 
+    /* Index virtual hosts and services for request dispatching */
+    if (duda_dispatch_init() != 0) {
+        mk_err("Duda: could not build the services dispatch index");
+        exit(EXIT_FAILURE);
+    }
+
     /* Initialize Logger internals */
     duda_logger_init();
 
@@ -558,8 +441,6 @@ int duda_plugin_init(struct plugin_api **api, char *confdir)
     mk_api = *api;
 
     /* Global data / Thread scope */
-    pthread_key_create(&duda_global_events_write, NULL);
-    pthread_key_create(&duda_global_dr_list, NULL);
     pthread_key_create(&duda_dthread_scheduler, NULL);
     pthread_key_create(&duda_logger_fmt_cache, NULL);
 
@@ -575,20 +456,34 @@ int duda_plugin_init(struct plugin_api **api, char *confdir)
 int duda_service_end(duda_request_t *dr)
 {
     int ret;
+    int socket = dr->socket;
+
+    if (dr->_st_service_end == MK_TRUE) {
+        return 0;
+    }
+    dr->_st_service_end = MK_TRUE;
+    dr->_st_active = MK_FALSE;
 
     /* call service end_callback() */
     if (dr->end_callback) {
         dr->end_callback(dr);
     }
 
-    /* free queue resources... */
+    /*
+     * Free queue resources. The arena is reset by the next request on
+     * the connection or once the connection closes, the server could
+     * still be writing data that lives there.
+     */
+    if (dr->_st_write_pending == MK_TRUE) {
+        duda_queue_event_unregister_write(dr);
+    }
     duda_queue_free(&dr->queue_out);
-    duda_gc_free_content(dr);
 
     /* Finalize HTTP stuff with Monkey core */
     ret = mk_api->http_request_end(dr->session, MK_TRUE);
     if (ret < 0) {
-        dr->_st_service_end = MK_TRUE;
+        /* The connection is closing, the context goes back to the pool */
+        duda_request_close(socket);
     }
     return ret;
 }
@@ -668,26 +563,22 @@ int duda_service_run(struct mk_plugin *plugin,
     struct duda_request *dr;
     struct duda_router_path *path;
 
-    dr = duda_dr_list_get(sr);
-    if (!dr) {
-        dr = mk_api->mem_alloc(sizeof(duda_request_t));
-        if (!dr) {
-            PLUGIN_TRACE("could not allocate enough memory");
-            return -1;
-        }
-
-        /* Initialize garbage collector */
-        duda_gc_init(dr);
-
-        /* service details */
-        //dr->ws_root = web_service;
-        //dr->plugin = plugin;
+    /* A context left by a closed connection that had this socket number */
+    dr = duda_request_lookup(cs->socket);
+    if (dr && dr->session != cs) {
+        duda_request_close(cs->socket);
+    }
 
-        dr->socket  = cs->socket;
-        dr->request = sr;
+    /* Keep-alive connections get the context of the previous request */
+    dr = duda_request_acquire(cs->socket);
+    if (!dr) {
+        PLUGIN_TRACE("could not allocate enough memory");
+        return -1;
+    }
 
-        /* Register */
-        duda_dr_list_add(dr);
+    /* Release what a previous request on this connection left */
+    if (duda_request_gc_reset(dr) != 0) {
+        return -1;
     }
 
     /*
@@ -706,7 +597,8 @@ int duda_service_run(struct mk_plugin *plugin,
     dr->end_callback = NULL;
 
     /* data queues */
-    mk_list_init(&dr->queue_out);
+    duda_queue_init(&dr->queue_out);
+    duda_response_reset(dr);
     //mk_list_init(&dr->channel.streams);
 
     /* statuses */
@@ -715,15 +607,13 @@ int duda_service_run(struct mk_plugin *plugin,
     dr->_st_http_headers_sent = MK_FALSE;
     dr->_st_body_writes = 0;
     dr->_st_service_end = MK_FALSE;
+    dr->_st_active = MK_TRUE;
+    dr->_st_response_end = MK_FALSE;
+    dr->_st_write_pending = MK_FALSE;
 
-    /* Query string */
-    dr->qs.count = 0;
-
-    /* Parse the query string */
-    duda_qs_parse(dr);
-
-    /* Parse the URI based on Duda Router format */
-    duda_router_uri_parse(dr);
+    /* Query string and cookies, parsed on demand */
+    duda_qs_reset(dr);
+    duda_cookie_reset(dr);
 
     /* Check if a root URI is requested (only '/') */
     if (web_service->router_root_cb) {
@@ -739,8 +629,8 @@ int duda_service_run(struct mk_plugin *plugin,
         }
     }
 
-    /* Lookup a Router path */
-    ret = duda_router_path_lookup(web_service, dr, &path);
+    /* Lookup a Router path, it also parse the URI segments */
+    ret = duda_router_path_lookup(web_service, sr, &path, &dr->router_uri);
     if (ret == DUDA_ROUTER_MATCH) {
         PLUGIN_TRACE("Router: %s()", path->callback_name);
         dr->router_path = path;
@@ -748,6 +638,7 @@ int duda_service_run(struct mk_plugin *plugin,
         return 0;
     }
     else if (ret == DUDA_ROUTER_REDIRECT) {
+        duda_router_redirect(dr);
         return 0;
     }
 
@@ -762,27 +653,30 @@ int duda_service_run(struct mk_plugin *plugin,
 /*
  * Get webservice given the processed URI.
  *
- * Check the web services registered under the virtual host and try to do a
- * match with the web services name
+ * The first segment of the URI is the service name, it's resolved through
+ * the services index of the virtual host.
  */
 struct web_service *duda_get_service_from_uri(struct mk_http_request *sr,
                                               struct vhost_services *vs_host)
 {
-    struct mk_list *head;
+    int len;
+    int offset = 0;
+    char *segment = NULL;
     struct web_service *ws_entry;
 
-    /* match services */
-    mk_list_foreach(head, &vs_host->services) {
-        ws_entry = mk_list_entry(head, struct web_service, _head);
-        if (strncmp(ws_entry->name.data,
-                    sr->uri_processed.data + 1,
-                    ws_entry->name.len) == 0) {
-            PLUGIN_TRACE("WebService match: %s", ws_entry->name.data);
-            return ws_entry;
-        }
+    len = duda_router_next_segment(sr->uri_processed.data,
+                                   sr->uri_processed.len,
+                                   &offset, &segment);
+    if (len <= 0) {
+        return NULL;
+    }
+
+    ws_entry = duda_dispatch_get(vs_host->services_index, segment, len);
+    if (ws_entry) {
+        PLUGIN_TRACE("WebService match: %s", ws_entry->name.data);
     }
 
-    return NULL;
+    return ws_entry;
 }
 
 /* Hook for when Monkey core start exiting: SIGTERM */
@@ -825,20 +719,14 @@ int duda_stage30(struct mk_plugin *plugin,
                  int n_params,
                  struct mk_list *params)
 {
-    struct mk_list *head;
-    struct vhost_services *vs_entry, *vs_match=NULL;
+    struct vhost_services *vs_match;
     struct web_service *web_service;
     (void) n_params;
     (void) params;
 
     /* Match virtual host */
-    mk_list_foreach(head, &services_list) {
-        vs_entry = mk_list_entry(head, struct vhost_services, _head);
-        if (sr->host_conf == vs_entry->host) {
-            vs_match = vs_entry;
-            break;
-        }
-    }
+    vs_match = duda_dispatch_get(duda_vhost_index,
+                                 &sr->host_conf, sizeof(sr->host_conf));
 
     if (!vs_match) {
         return MK_PLUGIN_RET_NOT_ME;
@@ -887,13 +775,21 @@ int duda_stage30(struct mk_plugin *plugin,
     return MK_PLUGIN_RET_NOT_ME;
 }
 
+/*
+ * The server is done with a request we owned, either because it ended or
+ * because the connection was closed: the context of the socket is released.
+ */
 int duda_stage30_hangup(struct mk_plugin *plugin,
                         struct mk_http_session *cs,
                         struct mk_http_request *sr)
 {
+    duda_request_t *dr;
     (void) plugin;
-    (void) cs;
-    (void) sr;
+
+    dr = duda_request_lookup(cs->socket);
+    if (dr && dr->request == sr) {
+        duda_request_close(cs->socket);
+    }
 
     return 0;
 }
@@ -917,7 +813,7 @@ struct mk_plugin mk_plugin_duda = {
 
     /* Init Levels */
     .master_init   = duda_master_init,
-    .worker_init   = duda_worker_init,
+    .worker_init   = duda_server_worker_init,
 
     /* Type */
     .stage         = &mk_plugin_stage_duda
@@ -17,6 +17,7 @@
  *  limitations under the License.
  */
 
+#include <sys/socket.h>
 #include <monkey/mk_api.h>
 
 #include <duda/duda.h>
@@ -35,193 +36,331 @@ struct duda_queue_item *duda_queue_item_new(short int type)
         return NULL;
     }
 
-    item->type   = type;
-    item->status = DUDA_QSTATUS_ACTIVE;
+    item->type = type;
+    item->data = NULL;
 
     return item;
 }
 
-int duda_queue_add(struct duda_queue_item *item, struct mk_list *queue)
+/* Pending bytes of an item */
+static unsigned long queue_item_bytes(struct duda_queue_item *item)
 {
-    mk_list_add(&item->_head, queue);
+    struct duda_sendfile *sf;
+    struct duda_body_buffer *bb;
+
+    if (item->type == DUDA_QTYPE_BODY_BUFFER) {
+        bb = (struct duda_body_buffer *) item->data;
+        return bb->buf->total_len;
+    }
+    else if (item->type == DUDA_QTYPE_SENDFILE) {
+        sf = (struct duda_sendfile *) item->data;
+        return sf->pending_bytes;
+    }
+
+    return 0;
+}
+
+static void queue_item_free(struct duda_queue_item *item)
+{
+    struct duda_sendfile *sf;
+    struct duda_body_buffer *bb;
+
+    if (item->type == DUDA_QTYPE_BODY_BUFFER) {
+        bb = (struct duda_body_buffer *) item->data;
+        mk_api->iov_free(bb->buf);
+        mk_api->mem_free(bb);
+    }
+    else if (item->type == DUDA_QTYPE_SENDFILE) {
+        sf = (struct duda_sendfile *) item->data;
+        duda_sendfile_free(sf);
+    }
+
+    mk_api->mem_free(item);
+}
+
+static inline void queue_item_remove(struct duda_queue *queue,
+                                     struct duda_queue_item *item)
+{
+    queue->bytes -= queue_item_bytes(item);
+    mk_list_del(&item->_head);
+    queue_item_free(item);
+}
+
+/*
+ * Enqueue an item, its content must be complete: the queue length
+ * account the item bytes at this point.
+ */
+int duda_queue_add(struct duda_queue_item *item, struct duda_queue *queue)
+{
+    mk_list_add(&item->_head, &queue->items);
+    queue->bytes += queue_item_bytes(item);
     return 0;
 }
 
-struct duda_queue_item *duda_queue_last(struct mk_list *queue)
+struct duda_queue_item *duda_queue_last(struct duda_queue *queue)
 {
-    if (mk_list_is_empty(queue) == 0) {
+    if (mk_list_is_empty(&queue->items) == 0) {
         return NULL;
     }
 
-    return mk_list_entry_last(queue, struct duda_queue_item, _head);
+    return mk_list_entry_last(&queue->items, struct duda_queue_item, _head);
 }
 
-unsigned long duda_queue_length(struct mk_list *queue)
+/*
+ * Write the adjacent body buffers at the head of the queue with a single
+ * writev(). It returns the bytes written and set in 'size' the bytes that
+ * were requested.
+ */
+static ssize_t queue_writev(int socket, struct duda_queue *queue, size_t *size,
+                            struct duda_zerocopy *zc)
 {
-    uint64_t length = 0;
+    int i;
+    int n = 0;
     struct mk_list *head;
-    struct duda_queue_item *entry;
-    struct duda_sendfile *entry_sf;
-    struct duda_body_buffer *entry_bb;
-
-    mk_list_foreach(head, queue) {
-        entry = mk_list_entry(head, struct duda_queue_item, _head);
-        if (entry->type == DUDA_QTYPE_BODY_BUFFER) {
-            entry_bb = (struct duda_body_buffer *) entry->data;
-            length += entry_bb->buf->total_len;
+    struct mk_iov *buf;
+    struct duda_queue_item *item;
+    struct duda_body_buffer *bb;
+    struct iovec iov[DUDA_QUEUE_IOV];
+
+    *size = 0;
+    mk_list_foreach(head, &queue->items) {
+        item = mk_list_entry(head, struct duda_queue_item, _head);
+        if (item->type != DUDA_QTYPE_BODY_BUFFER) {
+            break;
         }
-        else if (entry->type == DUDA_QTYPE_SENDFILE) {
-            entry_sf = (struct duda_sendfile *) entry->data;
-            length += entry_sf->pending_bytes;
+
+        bb = (struct duda_body_buffer *) item->data;
+        buf = bb->buf;
+        for (i = bb->head; i < buf->iov_idx; i++) {
+            if (buf->io[i].iov_len == 0) {
+                continue;
+            }
+            if (n == DUDA_QUEUE_IOV) {
+                goto send;
+            }
+            iov[n++] = buf->io[i];
+            *size += buf->io[i].iov_len;
         }
     }
 
-    return length;
+ send:
+    if (n == 0) {
+        return 0;
+    }
+
+    return duda_body_buffer_writev(socket, iov, n, *size, zc);
+}
+
+/* Discount the bytes written from the body buffers at the head */
+static void queue_consume(struct duda_queue *queue, size_t bytes)
+{
+    size_t used;
+    struct duda_queue_item *item;
+    struct duda_body_buffer *bb;
+
+    while (mk_list_is_empty(&queue->items) != 0) {
+        item = mk_list_entry_first(&queue->items, struct duda_queue_item, _head);
+        if (item->type != DUDA_QTYPE_BODY_BUFFER) {
+            break;
+        }
+
+        bb = (struct duda_body_buffer *) item->data;
+        used = duda_body_buffer_consume(bb, bytes);
+        queue->bytes -= used;
+        bytes -= used;
+
+        if (bb->buf->total_len > 0) {
+            break;
+        }
+        queue_item_remove(queue, item);
+    }
 }
 
+/*
+ * Write as much as the socket accepts: the queue is drained until it's
+ * empty or the socket would block. Adjacent body buffers are written
+ * together. It returns the number of bytes still pending or -1 if the
+ * socket failed.
+ */
 int duda_queue_flush(duda_request_t *dr)
 {
-    int ret = -1;
     int socket = dr->session->socket;
+    size_t size;
+    ssize_t bytes;
+    unsigned long pending;
     short int is_registered;
-    unsigned long queue_len=0;
-    struct mk_list *head;
+    struct duda_queue *queue = &dr->queue_out;
     struct duda_queue_item *item;
+    struct duda_sendfile *sf;
 
-    mk_list_foreach(head, &dr->queue_out) {
-        item = mk_list_entry(head, struct duda_queue_item, _head);
-        if (item->status == DUDA_QSTATUS_INACTIVE) {
-            continue;
-        }
+    while (mk_list_is_empty(&queue->items) != 0) {
+        item = mk_list_entry_first(&queue->items, struct duda_queue_item, _head);
 
-        switch (item->type) {
-        case DUDA_QTYPE_BODY_BUFFER:
-            ret = duda_body_buffer_flush(socket, item->data);
-            break;
-        case DUDA_QTYPE_SENDFILE:
-            ret = duda_sendfile_flush(socket, item->data);
-            break;
+        if (item->type == DUDA_QTYPE_BODY_BUFFER) {
+            bytes = queue_writev(socket, queue, &size, &dr->zerocopy);
+            if (bytes == -1) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    break;
+                }
+                duda_queue_free(queue);
+                return -1;
+            }
+
+            queue_consume(queue, bytes);
+            if ((size_t) bytes < size) {
+                break;
+            }
         }
+        else if (item->type == DUDA_QTYPE_SENDFILE) {
+            sf = (struct duda_sendfile *) item->data;
+            pending = sf->pending_bytes;
 
-        if (ret == 0) {
-            item->status = DUDA_QSTATUS_INACTIVE;
+            if (duda_sendfile_flush(socket, sf) == -1) {
+                duda_queue_free(queue);
+                return -1;
+            }
+            queue->bytes -= pending - sf->pending_bytes;
+            if (sf->pending_bytes > 0) {
+                break;
+            }
+            queue_item_remove(queue, item);
+        }
+        else {
+            queue_item_remove(queue, item);
         }
+    }
 
-        is_registered = duda_queue_event_is_registered_write(dr);
-        queue_len = duda_queue_length(&dr->queue_out);
+    /*
+     * Reap the zero copy sends completed so far. They do not keep the write
+     * interest: the arena that holds their memory is reset once all of them
+     * are done or after a bounded wait, see duda_request_gc_reset().
+     */
+    if (dr->zerocopy.sent != dr->zerocopy.done) {
+        duda_body_buffer_zerocopy_pending(socket, &dr->zerocopy);
+    }
 
-        if (queue_len > 0 && is_registered == MK_FALSE) {
-            duda_queue_event_register_write(dr);
-        }
-        else if (queue_len == 0 && is_registered == MK_TRUE) {
-            duda_queue_event_unregister_write(dr);
+    pending = queue->bytes;
+    is_registered = duda_queue_event_is_registered_write(dr);
+    if (pending > 0 && is_registered == MK_FALSE) {
+        if (duda_queue_event_register_write(dr) != 0) {
+            duda_queue_free(queue);
+            return -1;
         }
-        break;
+    }
+    else if (pending == 0 && is_registered == MK_TRUE) {
+        duda_queue_event_unregister_write(dr);
     }
 
-    return queue_len;
+    return pending;
 }
 
-int duda_queue_free(struct mk_list *queue)
+int duda_queue_free(struct duda_queue *queue)
 {
     struct mk_list *head, *temp;
     struct duda_queue_item *item;
-    struct duda_sendfile *sf;
-    struct duda_body_buffer *bb;
 
-    mk_list_foreach_safe(head, temp, queue) {
+    mk_list_foreach_safe(head, temp, &queue->items) {
         item = mk_list_entry(head, struct duda_queue_item, _head);
-        if (item->type == DUDA_QTYPE_BODY_BUFFER) {
-            bb = (struct duda_body_buffer *) item->data;
-            mk_api->iov_free(bb->buf);
-            mk_api->mem_free(bb);
-        }
-        else if(item->type == DUDA_QTYPE_SENDFILE) {
-            sf = (struct duda_sendfile *) item->data;
-            close(sf->fd);
-            mk_api->mem_free(sf);
-        }
-        item->data = NULL;
         mk_list_del(head);
-        mk_api->mem_free(item);
+        queue_item_free(item);
     }
+    queue->bytes = 0;
 
     return 0;
 }
 
-
-int duda_queue_event_register_write(duda_request_t *dr)
+/*
+ * The request socket failed or the peer is gone while the queue was being
+ * written: the server is told through its own descriptor and the context of
+ * the request is released.
+ */
+static int queue_event_close(int fd, void *data)
 {
-    struct mk_list *list;
+    duda_request_t *dr = data;
+    (void) fd;
 
-    list = pthread_getspecific(duda_global_events_write);
-    if (!list) {
-        return -1;
-    }
+    shutdown(dr->socket, SHUT_RDWR);
+    duda_request_close(dr->socket);
 
-    mk_list_add(&dr->_head_events_write, list);
-    return 0;
+    return DUDA_EVENT_OWNED;
 }
 
-int duda_queue_event_unregister_write(duda_request_t *dr)
+/*
+ * Write event of a request with pending output: the queue is drained and
+ * once it's empty the response is completed if the service already ended
+ * it.
+ */
+static int queue_event_write(int fd, void *data)
 {
-    struct mk_list *list, *head, *temp;
-    duda_request_t *entry;
-
-    list = pthread_getspecific(duda_global_events_write);
-    mk_list_foreach_safe(head, temp, list) {
-        entry = mk_list_entry(head, duda_request_t, _head_events_write);
-        if (entry == dr) {
-            mk_list_del(&entry->_head_events_write);
-            pthread_setspecific(duda_global_events_write, list);
-            return 0;
-        }
+    int ret;
+    duda_request_t *dr = data;
+    (void) fd;
+
+    ret = duda_queue_flush(dr);
+    if (ret == -1) {
+        return DUDA_EVENT_CLOSE;
+    }
+
+    /* Still draining, or the service did not end the response yet */
+    if (ret > 0 || dr->_st_response_end == MK_FALSE) {
+        return DUDA_EVENT_OWNED;
     }
 
-    return -1;
+    if (duda_response_complete(dr) == -1) {
+        return DUDA_EVENT_CLOSE;
+    }
+
+    return DUDA_EVENT_OWNED;
 }
 
-int duda_queue_event_is_registered_write(duda_request_t *dr)
+/*
+ * Write interest: the request socket lives on the worker loop as a server
+ * connection and the server gets its events. While the queue has pending
+ * data a duplicate of the socket is registered on the same loop, so the
+ * write events of the connection reach queue_event_write().
+ */
+int duda_queue_event_register_write(duda_request_t *dr)
 {
-    struct mk_list *list;
-    struct mk_list *head;
-    duda_request_t *entry;
+    int fd;
+    int ret;
 
-    list = pthread_getspecific(duda_global_events_write);
-    mk_list_foreach(head, list) {
-        entry = mk_list_entry(head, duda_request_t, _head_events_write);
-        if (entry == dr) {
-            return MK_TRUE;
-        }
+    if (dr->_st_write_pending == MK_TRUE) {
+        return 0;
     }
 
-    return MK_FALSE;
+    fd = dup(dr->socket);
+    if (fd == -1) {
+        return -1;
+    }
+
+    ret = duda_event_add(fd, DUDA_EVENT_WRITE, DUDA_EVENT_LEVEL_TRIGGERED,
+                         NULL, queue_event_write, NULL, queue_event_close,
+                         NULL, dr);
+    if (ret != 0) {
+        close(fd);
+        return -1;
+    }
+
+    dr->write_fd = fd;
+    dr->_st_write_pending = MK_TRUE;
+    return 0;
 }
 
-int duda_queue_event_write_callback(int sockfd)
+int duda_queue_event_unregister_write(duda_request_t *dr)
 {
-    int ret = MK_PLUGIN_RET_CONTINUE;
-    struct mk_list *list, *temp, *head;
-    duda_request_t *entry;
-
-    list = pthread_getspecific(duda_global_events_write);
-    mk_list_foreach_safe(head, temp, list) {
-        entry = mk_list_entry(head, duda_request_t, _head_events_write);
-        if (entry->session->socket == sockfd) {
-            ret = duda_queue_flush(entry);
-            if (ret > 0) {
-                return MK_PLUGIN_RET_EVENT_OWNED;
-            }
-            if (duda_service_end(entry) == -1) {
-                return MK_PLUGIN_RET_EVENT_CLOSE;
-            }
-            else {
-                return MK_PLUGIN_RET_EVENT_OWNED;
-            }
-
-            break;
-        }
+    if (dr->_st_write_pending == MK_FALSE) {
+        return -1;
     }
 
-    return MK_PLUGIN_RET_EVENT_CONTINUE;
+    duda_event_delete(dr->write_fd);
+    close(dr->write_fd);
+
+    dr->write_fd = -1;
+    dr->_st_write_pending = MK_FALSE;
+    return 0;
+}
+
+int duda_queue_event_is_registered_write(duda_request_t *dr)
+{
+    return dr->_st_write_pending;
 }
@@ -0,0 +1,403 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Duda I/O
+ *  --------
+ *  Copyright (C) 2012-2016, Eduardo Silva P. <eduardo@monkey.io>.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include <sys/stat.h>
+
+#include <duda.h>
+#include <duda/duda_timer.h>
+#include <duda/duda_queue.h>
+#include <duda/duda_request.h>
+#include <duda/duda_body_buffer.h>
+#include <duda/objects/duda_gc.h>
+#include <duda/objects/duda_qs.h>
+#include <duda/objects/duda_cookie.h>
+#include <duda/objects/duda_response.h>
+
+__thread struct duda_request_pool *duda_request_pool;
+
+int duda_request_pool_init()
+{
+    struct duda_request_pool *pool;
+
+    if (duda_request_pool) {
+        return 0;
+    }
+
+    pool = mk_mem_alloc_z(sizeof(struct duda_request_pool));
+    if (!pool) {
+        return -1;
+    }
+
+    pool->fds = mk_mem_alloc_z(sizeof(duda_request_t *) * DUDA_REQUEST_POOL_FDS);
+    if (!pool->fds) {
+        mk_mem_free(pool);
+        return -1;
+    }
+    pool->fd_size = DUDA_REQUEST_POOL_FDS;
+    mk_list_init(&pool->free);
+
+    duda_request_pool = pool;
+    return 0;
+}
+
+static void request_destroy(duda_request_t *dr)
+{
+    duda_gc_free(dr);
+    mk_mem_free(dr);
+}
+
+void duda_request_pool_exit()
+{
+    int i;
+    struct mk_list *head;
+    struct mk_list *tmp;
+    duda_request_t *dr;
+    struct duda_request_pool *pool = duda_request_pool;
+
+    if (!pool) {
+        return;
+    }
+
+    if (pool->sweep) {
+        duda_timer_cancel(pool->sweep);
+    }
+
+    for (i = 0; i < pool->fd_size; i++) {
+        if (pool->fds[i]) {
+            request_destroy(pool->fds[i]);
+        }
+    }
+
+    mk_list_foreach_safe(head, tmp, &pool->free) {
+        dr = mk_list_entry(head, duda_request_t, _head_pool);
+        mk_list_del(&dr->_head_pool);
+        request_destroy(dr);
+    }
+
+    mk_mem_free(pool->fds);
+    mk_mem_free(pool);
+    duda_request_pool = NULL;
+}
+
+/* Grow the socket table so it can index 'socket' */
+static int pool_fds_grow(struct duda_request_pool *pool, int socket)
+{
+    int size = pool->fd_size;
+    duda_request_t **tmp;
+
+    while (size <= socket) {
+        size <<= 1;
+    }
+
+    tmp = mk_mem_realloc(pool->fds, sizeof(duda_request_t *) * size);
+    if (!tmp) {
+        return -1;
+    }
+    memset(tmp + pool->fd_size, '\0',
+           sizeof(duda_request_t *) * (size - pool->fd_size));
+
+    pool->fds = tmp;
+    pool->fd_size = size;
+    return 0;
+}
+
+/*
+ * Returns the context associated to a socket. If the socket have no
+ * context, one is taken from the free list or allocated and then it's
+ * registered in the socket table.
+ */
+duda_request_t *duda_request_acquire(int socket)
+{
+    struct stat st;
+    duda_request_t *dr;
+    struct duda_request_pool *pool;
+
+    if (socket < 0) {
+        return NULL;
+    }
+
+    if (!duda_request_pool && duda_request_pool_init() != 0) {
+        return NULL;
+    }
+    pool = duda_request_pool;
+
+    if (socket >= pool->fd_size && pool_fds_grow(pool, socket) != 0) {
+        return NULL;
+    }
+
+    /* Keep-alive connection */
+    dr = pool->fds[socket];
+    if (dr) {
+        return dr;
+    }
+
+    if (pool->n_free > 0) {
+        dr = mk_list_entry_first(&pool->free, duda_request_t, _head_pool);
+        mk_list_del(&dr->_head_pool);
+        pool->n_free--;
+    }
+    else {
+        dr = mk_mem_alloc_z(sizeof(duda_request_t));
+        if (!dr) {
+            return NULL;
+        }
+
+        /* The GC cells are kept while the context lives in the pool */
+        if (duda_gc_init(dr) != 0) {
+            mk_mem_free(dr);
+            return NULL;
+        }
+    }
+
+    /* The inode tells this socket from a later one with the same number */
+    if (fstat(socket, &st) == 0) {
+        dr->socket_ino = st.st_ino;
+    }
+    else {
+        dr->socket_ino = 0;
+    }
+
+    dr->socket = socket;
+    memset(&dr->zerocopy, '\0', sizeof(struct duda_zerocopy));
+    pool->fds[socket] = dr;
+    pool->n_active++;
+
+    return dr;
+}
+
+/*
+ * Unregister a context from the socket table and put it back on the free
+ * list. The caller must have released the request resources before.
+ */
+void duda_request_release(duda_request_t *dr)
+{
+    struct duda_request_pool *pool = duda_request_pool;
+
+    if (pool && dr->socket >= 0 && dr->socket < pool->fd_size &&
+        pool->fds[dr->socket] == dr) {
+        pool->fds[dr->socket] = NULL;
+        pool->n_active--;
+    }
+
+    if (!pool || pool->n_free >= DUDA_REQUEST_POOL_MAX) {
+        request_destroy(dr);
+        return;
+    }
+
+    dr->socket  = -1;
+    dr->session = NULL;
+    dr->_st_active = MK_FALSE;
+    dr->_st_write_pending = MK_FALSE;
+    dr->request = NULL;
+    mk_list_add(&dr->_head_pool, &pool->free);
+    pool->n_free++;
+}
+
+/*
+ * Release the arena of the previous request on the connection. The memory
+ * of MSG_ZEROCOPY sends must be kept until the kernel reports them as
+ * completed: while some are in flight the reset is put off, for at most
+ * BODY_BUFFER_ZEROCOPY_DEFER requests. Then the kernel is waited for a
+ * bounded time, if it still holds the memory the connection is aborted and
+ * it returns -1: the request must not be served.
+ */
+int duda_request_gc_reset(duda_request_t *dr)
+{
+    struct duda_zerocopy *zc = &dr->zerocopy;
+
+    if (zc->sent != zc->done &&
+        duda_body_buffer_zerocopy_pending(dr->socket, zc) > 0) {
+        if (zc->deferred < BODY_BUFFER_ZEROCOPY_DEFER) {
+            zc->deferred++;
+            return 0;
+        }
+
+        if (duda_body_buffer_zerocopy_wait(dr->socket, zc,
+                                           BODY_BUFFER_ZEROCOPY_WAIT) > 0) {
+            duda_body_buffer_zerocopy_abort(dr->socket);
+            return -1;
+        }
+    }
+
+    zc->deferred = 0;
+    duda_gc_free_content(dr);
+    return 0;
+}
+
+/* The socket of the context was not closed or replaced by another one */
+static int request_socket_alive(duda_request_t *dr)
+{
+    struct stat st;
+
+    if (fstat(dr->socket, &st) == 0 && st.st_ino == dr->socket_ino) {
+        return MK_TRUE;
+    }
+
+    return MK_FALSE;
+}
+
+/*
+ * The connection of a socket is gone: end the request that was in progress,
+ * release what it holds and give the context back to the pool. The socket
+ * slot is cleared, so it's safe to call it more than once.
+ */
+void duda_request_close(int socket)
+{
+    duda_request_t *dr;
+
+    dr = duda_request_lookup(socket);
+    if (!dr) {
+        return;
+    }
+
+    if (dr->_st_service_end == MK_FALSE) {
+        dr->_st_service_end = MK_TRUE;
+        if (dr->end_callback) {
+            dr->end_callback(dr);
+        }
+    }
+
+    if (dr->_st_write_pending == MK_TRUE) {
+        duda_queue_event_unregister_write(dr);
+    }
+    duda_queue_free(&dr->queue_out);
+
+    /*
+     * Zero copy sends in flight: the kernel gets a bounded time to release
+     * the memory, after that the unsent data is discarded on close. Once
+     * the socket is closed nothing can be reaped anymore.
+     */
+    if (dr->zerocopy.sent != dr->zerocopy.done &&
+        request_socket_alive(dr) == MK_TRUE &&
+        duda_body_buffer_zerocopy_wait(dr->socket, &dr->zerocopy,
+                                       BODY_BUFFER_ZEROCOPY_WAIT) > 0) {
+        duda_body_buffer_zerocopy_abort(dr->socket);
+    }
+
+    duda_gc_free_content(dr);
+    duda_request_release(dr);
+}
+
+/*
+ * The library mode gets no notice when the server closes a connection: a
+ * worker timer checks the sockets of the active contexts and releases the
+ * ones that are gone, either closed or with the number taken by another
+ * socket. The timer stops once there are no active contexts.
+ */
+static void request_sweep(struct duda_timer *t, void *data)
+{
+    int i;
+    struct stat st;
+    duda_request_t *dr;
+    struct duda_request_pool *pool = data;
+
+    for (i = 0; i < pool->fd_size && pool->n_active > 0; i++) {
+        dr = pool->fds[i];
+        if (!dr) {
+            continue;
+        }
+
+        if (fstat(i, &st) == 0 && st.st_ino == dr->socket_ino) {
+            continue;
+        }
+        duda_request_close(i);
+    }
+
+    if (pool->n_active == 0) {
+        pool->sweep = NULL;
+        return;
+    }
+
+    duda_timer_reschedule(t, DUDA_REQUEST_SWEEP);
+}
+
+/*
+ * Creates a Duda request context for a request that matched a router
+ * path. The router URI segments were already collected by the router
+ * lookup, here we just take the used entries.
+ *
+ * The context comes from the worker pool, on keep-alive connections the
+ * same context of the previous request is reused.
+ */
+duda_request_t *duda_request_create(mk_request_t *request,
+                                    struct duda_service *ds,
+                                    struct duda_router_path *path,
+                                    struct duda_router_uri *ruri)
+{
+    duda_request_t *dr;
+
+    /*
+     * A context of another session in the socket slot belongs to a
+     * connection that was closed, the socket number was reused.
+     */
+    dr = duda_request_lookup(request->session->socket);
+    if (dr && dr->session != request->session) {
+        duda_request_close(request->session->socket);
+    }
+
+    dr = duda_request_acquire(request->session->socket);
+    if (!dr) {
+        return NULL;
+    }
+
+    if (!duda_request_pool->sweep) {
+        duda_request_pool->sweep = duda_timer_add(DUDA_REQUEST_SWEEP,
+                                                  request_sweep,
+                                                  duda_request_pool);
+    }
+
+    /* Release what a previous request on this connection left */
+    if (duda_request_gc_reset(dr) != 0) {
+        return NULL;
+    }
+
+    /* Monkey contexts */
+    dr->service = ds;
+    dr->session = request->session;
+    dr->request = request;
+
+    /* callbacks */
+    dr->end_callback = NULL;
+
+    /* data queues */
+    duda_queue_init(&dr->queue_out);
+    duda_response_reset(dr);
+
+    /* statuses */
+    dr->_st_http_content_length = -2;      /* not set */
+    dr->_st_http_headers_off  = MK_FALSE;
+    dr->_st_http_headers_sent = MK_FALSE;
+    dr->_st_body_writes = 0;
+    dr->_st_service_end = MK_FALSE;
+    dr->_st_active = MK_TRUE;
+    dr->_st_response_end = MK_FALSE;
+    dr->_st_write_pending = MK_FALSE;
+
+    /* Router */
+    dr->router_path = path;
+    dr->router_uri.len = ruri->len;
+    memcpy(dr->router_uri.fields, ruri->fields,
+           sizeof(struct duda_router_uri_field) * ruri->len);
+
+    /* Query string and cookies, parsed on demand */
+    duda_qs_reset(dr);
+    duda_cookie_reset(dr);
+
+    return dr;
+}
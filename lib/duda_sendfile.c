@@ -19,63 +19,73 @@
 
 #include <monkey/mk_api.h>
 
-#include <sys/types.h>
-#include <sys/stat.h>
-#include <fcntl.h>
-
 #include <duda/duda_sendfile.h>
 
-struct duda_sendfile *duda_sendfile_new(char *path, off_t offset,
-                                        size_t count)
+/*
+ * Creates a sendfile entry for a bytes range of a cached file, the entry
+ * takes its own reference to the file.
+ */
+struct duda_sendfile *duda_sendfile_entry(struct duda_fcache_entry *fe,
+                                          off_t offset, size_t count)
 {
-    int ret;
-    uint64_t fsize;
+    uint64_t fsize = fe->size;
     struct duda_sendfile *file;
 
-    if (offset < 0) {
+    if (offset < 0 ||
+        (unsigned) offset > fsize ||
+        count > fsize ||
+        ((unsigned) offset + count) > fsize) {
         return NULL;
     }
 
     file = mk_api->mem_alloc(sizeof(struct duda_sendfile));
-    file->fd = -1;
-
-    ret = mk_api->file_get_info(path, &file->info, MK_FILE_READ);
-    if (ret == -1) {
-        mk_api->mem_free(file);
+    if (!file) {
         return NULL;
     }
 
-    fsize = file->info.size;
-    if ((unsigned) offset > fsize ||
-        count > fsize ||
-        ((unsigned) offset + count) > fsize) {
-        mk_api->mem_free(file);
-        return NULL;
+    fe->refs++;
+    file->fc = fe;
+    file->fd = fe->fd;
+    file->offset = offset;
+    if (count == 0) {
+        file->pending_bytes = fsize - file->offset;
     }
+    else {
+        file->pending_bytes = count;
+    }
+
+    return file;
+}
 
-    if (file->info.read_access == MK_FALSE) {
-        mk_api->mem_free(file);
+/*
+ * The file is taken from the worker file cache, hot files are already open
+ * and their size is known, so no syscall is needed.
+ */
+struct duda_sendfile *duda_sendfile_new(char *path, off_t offset,
+                                        size_t count)
+{
+    struct duda_sendfile *file;
+    struct duda_fcache_entry *fe;
+
+    if (offset < 0) {
         return NULL;
     }
 
-    file->fd = open(path, O_RDONLY | O_NONBLOCK);
-    if (file->fd < 0) {
-        mk_warn("%s:%i %s", __FILE__, __LINE__, strerror(errno));
-        mk_api->mem_free(file);
+    fe = duda_fcache_get(path);
+    if (!fe) {
         return NULL;
     }
 
-    file->offset = offset;
-    if (count == 0) {
-        file->pending_bytes = file->info.size - file->offset;
-    }
-    else {
-        file->pending_bytes = count;
-    }
+    file = duda_sendfile_entry(fe, offset, count);
+    duda_fcache_put(fe);
 
     return file;
 }
 
+/*
+ * Send the pending range of the file. It returns the number of bytes still
+ * pending or -1 if the socket failed or the file is shorter than expected.
+ */
 int duda_sendfile_flush(int socket, struct duda_sendfile *sf)
 {
     int bytes;
@@ -87,9 +97,22 @@ int duda_sendfile_flush(int socket, struct duda_sendfile *sf)
         sf->pending_bytes -= bytes;
     }
     else if (bytes == -1) {
-        sf->pending_bytes = 0;
-        return 0;
+        /* The socket is full, try again on the next write event */
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return sf->pending_bytes;
+        }
+        return -1;
+    }
+    else if (sf->pending_bytes > 0) {
+        /* The file was truncated */
+        return -1;
     }
 
     return sf->pending_bytes;
 }
+
+void duda_sendfile_free(struct duda_sendfile *sf)
+{
+    duda_fcache_put(sf->fc);
+    mk_api->mem_free(sf);
+}
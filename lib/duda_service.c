@@ -203,6 +203,10 @@ int duda_service_destroy(struct duda_service *ds)
     mk_mem_free(ds->path_html);
     mk_mem_free(ds->path_service);
 
+    /* Release compiled routes */
+    duda_router_tree_free(ds->router_tree);
+    mk_mem_free(ds->static_headers.data);
+
     /* Close handle */
     dlclose(ds->dl_handle);
     mk_list_del(&ds->_head);
@@ -0,0 +1,392 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Duda I/O
+ *  --------
+ *  Copyright (C) 2012-2016, Eduardo Silva P. <eduardo@monkey.io>.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include <time.h>
+#include <unistd.h>
+#include <sys/timerfd.h>
+
+#include <monkey/mk_api.h>
+
+#include <duda/duda_event.h>
+#include <duda/duda_timer.h>
+
+/* Per worker timer wheel */
+static __thread struct duda_timer_wheel *wheel;
+
+/* Current time in ticks */
+static inline uint64_t timer_clock()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000) / DUDA_TIMER_TICK;
+}
+
+/* Slot index of the given level for the current tick */
+#define TIMER_INDEX(w, level) \
+    (((w)->now >> (DUDA_TIMER_BITS * (level))) & DUDA_TIMER_MASK)
+
+/* Move every node of 'from' to the empty list 'to' */
+static inline void timer_list_move(struct mk_list *from, struct mk_list *to)
+{
+    if (mk_list_is_empty(from) == 0) {
+        mk_list_init(to);
+        return;
+    }
+
+    to->next = from->next;
+    to->prev = from->prev;
+    to->next->prev = to;
+    to->prev->next = to;
+    mk_list_init(from);
+}
+
+/* Start or stop the periodic ticks of the timerfd */
+static void timer_arm(struct duda_timer_wheel *w, int on)
+{
+    struct itimerspec its;
+
+    memset(&its, '\0', sizeof(its));
+    if (on == MK_TRUE) {
+        its.it_value.tv_nsec    = DUDA_TIMER_TICK * 1000000;
+        its.it_interval.tv_nsec = DUDA_TIMER_TICK * 1000000;
+    }
+
+    if (timerfd_settime(w->fd, 0, &its, NULL) == 0) {
+        w->armed = on;
+    }
+}
+
+/* Link an active timer in the slot that matches its expiration */
+static void timer_insert(struct duda_timer_wheel *w, struct duda_timer *t)
+{
+    int level;
+    uint64_t delta;
+    uint64_t expire;
+
+    if (t->expire < w->now) {
+        t->expire = w->now;
+    }
+
+    expire = t->expire;
+    delta  = expire - w->now;
+
+    for (level = 0; level < DUDA_TIMER_LEVELS; level++) {
+        if (delta < (1ULL << (DUDA_TIMER_BITS * (level + 1)))) {
+            break;
+        }
+    }
+
+    /* Out of range: park it on the farthest slot, it moves down later */
+    if (level == DUDA_TIMER_LEVELS) {
+        level  = DUDA_TIMER_LEVELS - 1;
+        expire = w->now + (1ULL << (DUDA_TIMER_BITS * DUDA_TIMER_LEVELS)) - 1;
+    }
+
+    mk_list_add(&t->_head,
+                &w->slots[level][(expire >> (DUDA_TIMER_BITS * level)) &
+                                 DUDA_TIMER_MASK]);
+}
+
+/* Move the timers of an upper level slot to the lower levels */
+static int timer_cascade(struct duda_timer_wheel *w, int level, int index)
+{
+    struct mk_list list;
+    struct mk_list *head;
+    struct mk_list *tmp;
+    struct duda_timer *t;
+
+    timer_list_move(&w->slots[level][index], &list);
+    mk_list_foreach_safe(head, tmp, &list) {
+        t = mk_list_entry(head, struct duda_timer, _head);
+        mk_list_del(&t->_head);
+        timer_insert(w, t);
+    }
+
+    return index;
+}
+
+static void timer_release(struct duda_timer_wheel *w, struct duda_timer *t)
+{
+    t->state = DUDA_TIMER_IDLE;
+    t->cb    = NULL;
+    t->data  = NULL;
+
+    if (w->n_free >= DUDA_TIMER_FREE) {
+        mk_api->mem_free(t);
+        return;
+    }
+
+    mk_list_add(&t->_head, &w->free);
+    w->n_free++;
+}
+
+/* Run the timers expired until the tick 'target' */
+static void timer_advance(struct duda_timer_wheel *w, uint64_t target)
+{
+    int index;
+    struct mk_list list;
+    struct duda_timer *t;
+
+    while (w->now <= target) {
+        index = w->now & DUDA_TIMER_MASK;
+        if (index == 0 &&
+            timer_cascade(w, 1, TIMER_INDEX(w, 1)) == 0 &&
+            timer_cascade(w, 2, TIMER_INDEX(w, 2)) == 0) {
+            timer_cascade(w, 3, TIMER_INDEX(w, 3));
+        }
+        w->now++;
+
+        /*
+         * The slot is detached first: a callback can add or reschedule
+         * timers that land on this same slot in the next round.
+         */
+        timer_list_move(&w->slots[0][index], &list);
+        while (mk_list_is_empty(&list) != 0) {
+            t = mk_list_entry_first(&list, struct duda_timer, _head);
+            mk_list_del(&t->_head);
+            w->count--;
+
+            t->state = DUDA_TIMER_FIRING;
+            t->cb(t, t->data);
+
+            /* Not rescheduled by the callback */
+            if (t->state == DUDA_TIMER_FIRING) {
+                timer_release(w, t);
+            }
+        }
+    }
+}
+
+/* Read event on the timerfd: turn the wheel up to the current time */
+static int timer_read(int fd, void *data)
+{
+    uint64_t expirations;
+    struct duda_timer_wheel *w = data;
+
+    if (read(fd, &expirations, sizeof(expirations)) <= 0) {
+        return DUDA_EVENT_OWNED;
+    }
+
+    timer_advance(w, timer_clock());
+    if (w->count == 0 && w->armed == MK_TRUE) {
+        timer_arm(w, MK_FALSE);
+    }
+
+    return DUDA_EVENT_OWNED;
+}
+
+static struct duda_timer_wheel *timer_wheel_init()
+{
+    int i;
+    int j;
+    struct duda_timer_wheel *w;
+
+    w = mk_api->mem_alloc_z(sizeof(struct duda_timer_wheel));
+    if (!w) {
+        return NULL;
+    }
+
+    for (i = 0; i < DUDA_TIMER_LEVELS; i++) {
+        for (j = 0; j < DUDA_TIMER_SLOTS; j++) {
+            mk_list_init(&w->slots[i][j]);
+        }
+    }
+    mk_list_init(&w->free);
+    w->now = timer_clock();
+
+    w->fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (w->fd == -1) {
+        mk_api->mem_free(w);
+        return NULL;
+    }
+
+    if (duda_event_add(w->fd, DUDA_EVENT_READ, DUDA_EVENT_LEVEL_TRIGGERED,
+                       timer_read, NULL, NULL, NULL, NULL, w) != 0) {
+        close(w->fd);
+        mk_api->mem_free(w);
+        return NULL;
+    }
+
+    wheel = w;
+    return w;
+}
+
+/* Schedule an idle or firing timer 'ms' milliseconds from now */
+static void timer_schedule(struct duda_timer_wheel *w, struct duda_timer *t,
+                           int ms)
+{
+    uint64_t ticks;
+
+    /* The wheel stood still while it was empty */
+    if (w->count == 0) {
+        w->now = timer_clock();
+    }
+
+    ticks = (ms > 0) ? (ms + DUDA_TIMER_TICK - 1) / DUDA_TIMER_TICK : 0;
+    t->expire = w->now + ticks;
+    t->state  = DUDA_TIMER_ACTIVE;
+    timer_insert(w, t);
+    w->count++;
+
+    if (w->armed == MK_FALSE) {
+        timer_arm(w, MK_TRUE);
+    }
+}
+
+/*
+ * @METHOD_NAME: timer_add
+ * @METHOD_DESC: Register a one-shot timer on the worker timer wheel. The callback
+ * runs in the worker thread once the given number of milliseconds elapsed, the
+ * resolution is DUDA_TIMER_TICK milliseconds. After the callback returns the timer
+ * is released unless the callback rescheduled it, which is the way to implement
+ * periodic jobs. Adding or cancelling a timer have a constant cost, so it's fine
+ * to use one per request or connection.
+ * @METHOD_PROTO: struct duda_timer *timer_add(int ms, void (*cb) (struct duda_timer *, void *), void *data)
+ * @METHOD_PARAM: ms milliseconds from now
+ * @METHOD_PARAM: cb callback function, it receives the timer and the data reference
+ * @METHOD_PARAM: data custom reference passed to the callback
+ * @METHOD_RETURN: Upon successful completion it returns the timer reference, on
+ * error it returns NULL.
+ */
+struct duda_timer *duda_timer_add(int ms,
+                                  void (*cb) (struct duda_timer *, void *),
+                                  void *data)
+{
+    struct duda_timer *t;
+    struct duda_timer_wheel *w = wheel;
+
+    if (!cb || (!w && !(w = timer_wheel_init()))) {
+        return NULL;
+    }
+
+    if (w->n_free > 0) {
+        t = mk_list_entry_first(&w->free, struct duda_timer, _head);
+        mk_list_del(&t->_head);
+        w->n_free--;
+    }
+    else {
+        t = mk_api->mem_alloc(sizeof(struct duda_timer));
+        if (!t) {
+            return NULL;
+        }
+    }
+
+    t->cb   = cb;
+    t->data = data;
+    timer_schedule(w, t, ms);
+
+    return t;
+}
+
+/*
+ * @METHOD_NAME: timer_cancel
+ * @METHOD_DESC: Cancel an active timer, the callback is not invoked and the timer
+ * reference is not longer valid. It can be called from the timer callback too.
+ * @METHOD_PROTO: int timer_cancel(struct duda_timer *timer)
+ * @METHOD_PARAM: timer the timer reference returned by timer_add()
+ * @METHOD_RETURN: Upon successful completion it returns 0, on error it returns -1.
+ */
+int duda_timer_cancel(struct duda_timer *t)
+{
+    struct duda_timer_wheel *w = wheel;
+
+    if (!w || !t) {
+        return -1;
+    }
+
+    if (t->state == DUDA_TIMER_ACTIVE) {
+        mk_list_del(&t->_head);
+        w->count--;
+        timer_release(w, t);
+        return 0;
+    }
+    else if (t->state == DUDA_TIMER_FIRING) {
+        /* Inside its own callback, it's released once the callback returns */
+        return 0;
+    }
+
+    return -1;
+}
+
+/*
+ * @METHOD_NAME: timer_reschedule
+ * @METHOD_DESC: Change the expiration of an active timer to the given number of
+ * milliseconds from now. Called from the timer callback it schedule the timer
+ * again.
+ * @METHOD_PROTO: int timer_reschedule(struct duda_timer *timer, int ms)
+ * @METHOD_PARAM: timer the timer reference returned by timer_add()
+ * @METHOD_PARAM: ms milliseconds from now
+ * @METHOD_RETURN: Upon successful completion it returns 0, on error it returns -1.
+ */
+int duda_timer_reschedule(struct duda_timer *t, int ms)
+{
+    struct duda_timer_wheel *w = wheel;
+
+    if (!w || !t) {
+        return -1;
+    }
+
+    if (t->state == DUDA_TIMER_ACTIVE) {
+        mk_list_del(&t->_head);
+        w->count--;
+    }
+    else if (t->state != DUDA_TIMER_FIRING) {
+        return -1;
+    }
+
+    timer_schedule(w, t, ms);
+    return 0;
+}
+
+/* Release the worker timers, callbacks are not invoked */
+void duda_timer_worker_exit()
+{
+    int i;
+    int j;
+    struct mk_list *head;
+    struct mk_list *tmp;
+    struct duda_timer *t;
+    struct duda_timer_wheel *w = wheel;
+
+    if (!w) {
+        return;
+    }
+
+    for (i = 0; i < DUDA_TIMER_LEVELS; i++) {
+        for (j = 0; j < DUDA_TIMER_SLOTS; j++) {
+            mk_list_foreach_safe(head, tmp, &w->slots[i][j]) {
+                t = mk_list_entry(head, struct duda_timer, _head);
+                mk_list_del(&t->_head);
+                mk_api->mem_free(t);
+            }
+        }
+    }
+
+    mk_list_foreach_safe(head, tmp, &w->free) {
+        t = mk_list_entry(head, struct duda_timer, _head);
+        mk_list_del(&t->_head);
+        mk_api->mem_free(t);
+    }
+
+    duda_event_delete(w->fd);
+    close(w->fd);
+    mk_api->mem_free(w);
+    wheel = NULL;
+}
@@ -18,7 +18,11 @@
  */
 
 #include <ctype.h>
+#include <errno.h>
 #include <limits.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
 
 int duda_utils_strtol(const char *nptr, int len, long *result)
 {
@@ -107,3 +111,110 @@ int duda_utils_strtol(const char *nptr, int len, long *result)
 
 	return 0;
 }
+
+/*
+ * Convert 'len' bytes of 'nptr' to a signed 64 bit integer. The whole
+ * buffer must be a valid number, no NULL terminator is required.
+ */
+int duda_utils_strtoll(const char *nptr, int len, int64_t *result)
+{
+    int i = 0;
+    int neg = 0;
+    uint64_t acc = 0;
+    uint64_t cutoff;
+
+    if (len <= 0) {
+        return -1;
+    }
+
+    if (nptr[0] == '-' || nptr[0] == '+') {
+        neg = (nptr[0] == '-');
+        i++;
+    }
+
+    if (i == len) {
+        return -1;
+    }
+
+    cutoff = neg ? (uint64_t) INT64_MAX + 1 : (uint64_t) INT64_MAX;
+
+    for (; i < len; i++) {
+        if (!isdigit((unsigned char) nptr[i])) {
+            return -1;
+        }
+
+        if (acc > (cutoff - (nptr[i] - '0')) / 10) {
+            return -1;
+        }
+        acc = (acc * 10) + (nptr[i] - '0');
+    }
+
+    if (neg) {
+        *result = (int64_t) (0 - acc);
+    }
+    else {
+        *result = (int64_t) acc;
+    }
+
+    return 0;
+}
+
+/* Same as duda_utils_strtoll() but for unsigned 64 bit integers */
+int duda_utils_strtoull(const char *nptr, int len, uint64_t *result)
+{
+    int i = 0;
+    uint64_t acc = 0;
+
+    if (len <= 0) {
+        return -1;
+    }
+
+    if (nptr[0] == '+') {
+        i++;
+    }
+
+    if (i == len) {
+        return -1;
+    }
+
+    for (; i < len; i++) {
+        if (!isdigit((unsigned char) nptr[i])) {
+            return -1;
+        }
+
+        if (acc > (UINT64_MAX - (nptr[i] - '0')) / 10) {
+            return -1;
+        }
+        acc = (acc * 10) + (nptr[i] - '0');
+    }
+
+    *result = acc;
+    return 0;
+}
+
+/*
+ * Convert 'len' bytes of 'nptr' to a double. strtod(3) needs a NULL
+ * terminated string, the number is copied into a small stack buffer.
+ */
+int duda_utils_strtod(const char *nptr, int len, double *result)
+{
+    char *end;
+    char buf[64];
+    double val;
+
+    if (len <= 0 || len >= (int) sizeof(buf)) {
+        return -1;
+    }
+
+    memcpy(buf, nptr, len);
+    buf[len] = '\0';
+
+    errno = 0;
+    val = strtod(buf, &end);
+    if (errno != 0 || end != buf + len) {
+        return -1;
+    }
+
+    *result = val;
+    return 0;
+}
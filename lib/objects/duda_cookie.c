@@ -19,7 +19,9 @@
 
 
 #include <duda/duda.h>
+#include <duda/objects/duda_gc.h>
 #include <duda/objects/duda_cookie.h>
+#include <duda/objects/duda_response.h>
 
 /*
  * @OBJ_NAME: cookie
@@ -32,14 +34,141 @@ struct duda_api_cookie *duda_cookie_object()
     struct duda_api_cookie *c;
 
     c = mk_api->mem_alloc(sizeof(struct duda_api_cookie));
-    c->set     = duda_cookie_set;
-    c->get     = duda_cookie_get;
-    c->cmp     = duda_cookie_cmp;
-    c->destroy = duda_cookie_destroy;
+    c->set      = duda_cookie_set;
+    c->set_opts = duda_cookie_set_opts;
+    c->get      = duda_cookie_get;
+    c->cmp      = duda_cookie_cmp;
+    c->destroy  = duda_cookie_destroy;
 
     return c;
 }
 
+static inline char *cookie_append(char *p, const char *str, int len)
+{
+    memcpy(p, str, len);
+    return p + len;
+}
+
+#define cookie_append_str(p, str)  cookie_append(p, str, sizeof(str) - 1)
+
+/*
+ * @METHOD_NAME: set_opts
+ * @METHOD_DESC: It creates a new cookie with the attributes given in a
+ * duda_cookie_opts structure. The whole Set-Cookie header is composed in a
+ * single buffer that lives until the request ends.
+ * @METHOD_PARAM: dr the request context information hold by a duda_request_t type
+ * @METHOD_PARAM: key the cookie name
+ * @METHOD_PARAM: key_len the key string length
+ * @METHOD_PARAM: val the cookie value
+ * @METHOD_PARAM: val_len the value string length
+ * @METHOD_PARAM: opts the cookie attributes: expires, max_age, path, domain,
+ * http_only, secure and same_site. If NULL a session cookie is created.
+ * @METHOD_RETURN: Upon successful completion it returns 0, on error it returns -1
+ */
+int duda_cookie_set_opts(duda_request_t *dr, char *key, int key_len,
+                         char *val, int val_len,
+                         struct duda_cookie_opts *opts)
+{
+    int len;
+    int path_len = 0;
+    int domain_len = 0;
+    char *buf;
+    char *p;
+    char tmp[COOKIE_MAX_DATE_LEN];
+    struct tm gmt;
+
+    if (!key || key_len <= 0 || val_len < 0) {
+        return -1;
+    }
+
+    if (opts && opts->path) {
+        path_len = strlen(opts->path);
+    }
+    else {
+        path_len = dr->appname.len + 1;
+    }
+
+    if (opts && opts->domain) {
+        domain_len = strlen(opts->domain);
+    }
+
+    /* Room for the biggest set of attributes */
+    len = (sizeof(COOKIE_SET) - 1) + key_len + 1 + val_len +
+        (sizeof("; Path=") - 1) + path_len +
+        (sizeof("; Domain=") - 1) + domain_len +
+        (sizeof("; Expires=") - 1) + COOKIE_MAX_DATE_LEN +
+        (sizeof("; Max-Age=") - 1) + 24 +
+        (sizeof("; HttpOnly; Secure; SameSite=Strict") - 1) +
+        (sizeof(COOKIE_CRLF) - 1);
+
+    buf = duda_gc_alloc(dr, len);
+    if (!buf) {
+        return -1;
+    }
+
+    /* Set-Cookie: key=value */
+    p = cookie_append_str(buf, COOKIE_SET);
+    p = cookie_append(p, key, key_len);
+    *p++ = '=';
+    p = cookie_append(p, val, val_len);
+
+    /* ; Path= */
+    p = cookie_append_str(p, "; Path=");
+    if (opts && opts->path) {
+        p = cookie_append(p, opts->path, path_len);
+    }
+    else {
+        *p++ = '/';
+        p = cookie_append(p, dr->appname.data, dr->appname.len);
+    }
+
+    if (domain_len > 0) {
+        p = cookie_append_str(p, "; Domain=");
+        p = cookie_append(p, opts->domain, domain_len);
+    }
+
+    if (opts && opts->expires > 0 && gmtime_r(&opts->expires, &gmt)) {
+        p = cookie_append_str(p, "; Expires=");
+        p += strftime(p, COOKIE_MAX_DATE_LEN, "%a, %d %b %Y %H:%M:%S GMT", &gmt);
+    }
+
+    if (opts && opts->max_age >= 0) {
+        len = snprintf(tmp, sizeof(tmp), "%ld", opts->max_age);
+        p = cookie_append_str(p, "; Max-Age=");
+        p = cookie_append(p, tmp, len);
+    }
+
+    if (opts && opts->http_only == MK_TRUE) {
+        p = cookie_append_str(p, "; HttpOnly");
+    }
+
+    if (opts && opts->secure == MK_TRUE) {
+        p = cookie_append_str(p, "; Secure");
+    }
+
+    if (opts) {
+        switch (opts->same_site) {
+        case COOKIE_SAMESITE_LAX:
+            p = cookie_append_str(p, "; SameSite=Lax");
+            break;
+        case COOKIE_SAMESITE_STRICT:
+            p = cookie_append_str(p, "; SameSite=Strict");
+            break;
+        case COOKIE_SAMESITE_NONE:
+            p = cookie_append_str(p, "; SameSite=None");
+            break;
+        }
+    }
+
+    p = cookie_append_str(p, COOKIE_CRLF);
+
+    /* The cookie row is composed in the request arena, one iov entry */
+    if (duda_response_header_row(dr, buf, p - buf) < 0) {
+        return -1;
+    }
+    return 0;
+}
+
 /*
  * @METHOD_NAME: set
  * @METHOD_DESC: It creates a new cookie
@@ -55,82 +184,13 @@ struct duda_api_cookie *duda_cookie_object()
 int duda_cookie_set(duda_request_t *dr, char *key, int key_len,
                     char *val, int val_len, int expires)
 {
-    mk_ptr_t exp;
-
-    /*
-     * Ugly hack: every session_request.headers contains a _extra_rows mk_iov
-     * entry to add customized HTTP response headers. This is mostly used from
-     * the plugins, as well by Duda when sending a response->header(...).
-     *
-     * We are in a very specific case, where the developer would like to set
-     * some HTTP cookies, we want to avoid memory allocations if possible when
-     * working with strings, so mk_api->header_add(..) cannot be used here as a
-     * Cookie is composed by a few components like: key, value, expiration, etc.
-     *
-     * So here we will do a similar routine as mk_plugin_header_add(), if _extra_rows
-     * has not been allocated, we will do it by our selfs and add the required iov
-     * entries to compose the Cookie row.
-     */
-    if (!dr->request->headers._extra_rows) {
-        dr->request->headers._extra_rows = mk_api->iov_create(MK_PLUGIN_HEADER_EXTRA_ROWS * 2, 0);
-    }
-
-    /* Add 'Set-Cookie: ' */
-    mk_api->iov_add(dr->request->headers._extra_rows,
-                    COOKIE_SET, sizeof(COOKIE_SET) -1, MK_FALSE);
-
-    /* Append 'KEY=' */
-    mk_api->iov_add(dr->request->headers._extra_rows, key, key_len, MK_FALSE);
-    mk_api->iov_add(dr->request->headers._extra_rows,
-                    dd_cookie_equal.data, dd_cookie_equal.len, MK_FALSE);
-
-    /* Append 'VALUE; path=' */
-    mk_api->iov_add(dr->request->headers._extra_rows, val, val_len, MK_FALSE);
-    mk_api->iov_add(dr->request->headers._extra_rows,
-                    dd_cookie_path.data, dd_cookie_path.len, MK_FALSE);
-
-    /*
-     * Append 'PATH' and ending string depending of the expiration type
-     *
-     * Destroy a cookie
-     */
-    if (expires == COOKIE_EXPIRE_TIME) {
-        /* FIXME: COOKIE DISABLED
-        mk_api->iov_add(dr->request->headers._extra_rows,
-                        dr->appname.data, dr->appname.len, MK_FALSE);
-        mk_api->iov_add(dr->request->headers._extra_rows,
-                        dd_cookie_expire.data, dd_cookie_expire.len, MK_FALSE);
-        mk_api->iov_add(dr->request->headers._extra_rows,
-                        dd_cookie_expire_value.data,
-                        dd_cookie_expire_value.len,
-                        MK_FALSE);
-        */
-        return 0;
-    }
+    struct duda_cookie_opts opts;
 
-    /* If the expire time was set */
-    if (expires > 0) {
-        exp.data = mk_api->mem_alloc(COOKIE_MAX_DATE_LEN);
-        exp.len = mk_api->time_to_gmt(&exp.data, expires);
+    memset(&opts, '\0', sizeof(opts));
+    opts.expires = expires;
+    opts.max_age = -1;
 
-        /* FIXME
-        mk_api->iov_add(dr->request->headers._extra_rows, dr->appname.data,
-                        dr->appname.len, MK_FALSE);
-        mk_api->iov_add(dr->request->headers._extra_rows,
-                        dd_cookie_expire.data, dd_cookie_expire.len, MK_FALSE);
-        mk_api->iov_add(dr->request->headers._extra_rows,
-                        exp.data, exp.len, MK_FALSE);
-        */
-        return 0;
-    }
-
-    /* FIXME
-    mk_api->iov_add(dr->request->headers._extra_rows,
-                    dr->appname.data, dr->appname.len, MK_FALSE);
-    mk_api->iov_add(dr->request->headers._extra_rows,
-                    dd_cookie_crlf.data, dd_cookie_crlf.len, MK_FALSE);
-    */
-    return 0;
+    return duda_cookie_set_opts(dr, key, key_len, val, val_len, &opts);
 }
 
 /*
@@ -149,6 +209,144 @@ int duda_cookie_destroy(duda_request_t *dr, char *key, int key_len)
                            COOKIE_EXPIRE_TIME);
 }
 
+/* FNV-1a hash of a cookie name */
+static inline unsigned int cookie_hash(const char *key, int len)
+{
+    int i;
+    unsigned int hash = 2166136261u;
+
+    for (i = 0; i < len; i++) {
+        hash ^= (unsigned char) key[i];
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+static inline char *cookie_trim(char *start, char *end, char **out_end)
+{
+    while (start < end && (*start == ' ' || *start == '\t')) {
+        start++;
+    }
+    while (end > start && (end[-1] == ' ' || end[-1] == '\t')) {
+        end--;
+    }
+
+    *out_end = end;
+    return start;
+}
+
+/*
+ * Tokenize the Cookie header: 'name=value' pairs separated by ';'. If a
+ * name is repeated, the first one wins as the client sends the most
+ * specific cookie first.
+ */
+static int cookie_parse(duda_request_t *dr)
+{
+    int i;
+    int max = 1;
+    int size = 16;
+    int pos;
+    unsigned int h;
+    unsigned int mask;
+    char *start;
+    char *end;
+    char *eq;
+    char *name_end;
+    char *val;
+    char *val_end;
+    char *cookie;
+    int length;
+    struct duda_cookie_entry *entry;
+    struct duda_cookie_map *map = &dr->cookies;
+    struct mk_http_header *header;
+
+    map->parsed = MK_TRUE;
+    map->count  = 0;
+
+    header = mk_api->header_get(MK_HEADER_COOKIE, dr->request, NULL, 0);
+    if (!header || header->val.len == 0) {
+        return -1;
+    }
+
+    cookie = header->val.data;
+    length = header->val.len;
+
+    for (i = 0; i < length; i++) {
+        if (cookie[i] == ';') {
+            max++;
+        }
+    }
+    if (max > COOKIE_ENTRIES_MAX) {
+        max = COOKIE_ENTRIES_MAX;
+    }
+
+    while (size < max * 2) {
+        size <<= 1;
+    }
+
+    map->entries = duda_gc_alloc(dr, sizeof(struct duda_cookie_entry) * max);
+    map->index   = duda_gc_alloc(dr, sizeof(int) * size);
+    if (!map->entries || !map->index) {
+        return -1;
+    }
+    memset(map->index, '\0', sizeof(int) * size);
+    map->index_size = size;
+    mask = size - 1;
+
+    start = cookie;
+    while (start < cookie + length && map->count < max) {
+        end = memchr(start, ';', (cookie + length) - start);
+        if (!end) {
+            end = cookie + length;
+        }
+
+        eq = memchr(start, '=', end - start);
+        if (!eq) {
+            start = end + 1;
+            continue;
+        }
+
+        start = cookie_trim(start, eq, &name_end);
+        val = cookie_trim(eq + 1, end, &val_end);
+        if (name_end == start) {
+            start = end + 1;
+            continue;
+        }
+
+        /* Quoted values are returned without the quotes */
+        if (val_end - val >= 2 && *val == '"' && val_end[-1] == '"') {
+            val++;
+            val_end--;
+        }
+
+        /* Lookup the name slot */
+        h = cookie_hash(start, name_end - start) & mask;
+        while ((pos = map->index[h]) != 0) {
+            entry = &map->entries[pos - 1];
+            if ((int) entry->name.len == name_end - start &&
+                memcmp(entry->name.data, start, name_end - start) == 0) {
+                break;
+            }
+            h = (h + 1) & mask;
+        }
+
+        if (pos == 0) {
+            entry = &map->entries[map->count];
+            entry->name.data  = start;
+            entry->name.len   = name_end - start;
+            entry->value.data = val;
+            entry->value.len  = val_end - val;
+            map->count++;
+            map->index[h] = map->count;
+        }
+
+        start = end + 1;
+    }
+
+    return map->count;
+}
+
 /*
  * @METHOD_NAME: get
  * @METHOD_DESC: Retrieve a specific cookie value sent by the HTTP client.
@@ -160,62 +358,42 @@ int duda_cookie_destroy(duda_request_t *dr, char *key, int key_len)
  */
 int duda_cookie_get(duda_request_t *dr, char *key, char **val, int *val_len)
 {
-    int i, offset;
-    int pos_key, pos_val;
-    int length;
-    char *cookie;
-    struct mk_http_header *header;
+    int len;
+    int pos;
+    unsigned int h;
+    unsigned int mask;
+    struct duda_cookie_entry *entry;
+    struct duda_cookie_map *map = &dr->cookies;
 
-    header = mk_api->header_get(MK_HEADER_COOKIE, dr->request, NULL, 0);
-    if (!header) {
+    if (!key) {
         return -1;
     }
 
-    /* Look for 'cookie key' */
-
-    /* FIXME:
-     * we must handle the case where the user set two cookies with transversal name/values,
-     * like:
-     *
-     *   Set-Cookie: name=bob
-     *   Set-Cookie: bob=name
-     *
-     * That code will generate this in the browser:
-     *
-     *   Cookie: name=bob; bob=name;
-     *
-     * If someone try to lookup the key 'bob' it will not be found.
-     *
-     */
-    cookie = header->val.data;
-    length = header->val.len;
-    pos_key = mk_api->str_search(cookie, key, MK_STR_SENSITIVE);
-
-    if (pos_key == -1) {
-        return -1;
+    /* The Cookie header is tokenized on the first lookup */
+    if (map->parsed == MK_FALSE) {
+        cookie_parse(dr);
     }
 
-    /* Get value position */
-    pos_val = mk_api->str_search_n(cookie + pos_key, "=", MK_STR_SENSITIVE,
-                                   length - pos_key);
-    if (pos_val == -1) {
+    if (map->count == 0) {
         return -1;
     }
-    pos_val++;
 
-    /* Get the value ending position */
-    offset = pos_key + pos_val;
-    for (i = offset; i < length; i++) {
-        if (cookie[i] == ';') {
-            break;
+    len  = strlen(key);
+    mask = map->index_size - 1;
+    h = cookie_hash(key, len) & mask;
+
+    while ((pos = map->index[h]) != 0) {
+        entry = &map->entries[pos - 1];
+        if ((int) entry->name.len == len &&
+            memcmp(entry->name.data, key, len) == 0) {
+            *val     = entry->value.data;
+            *val_len = entry->value.len;
+            return 0;
         }
+        h = (h + 1) & mask;
     }
 
-    /* Set results */
-    *val     = (cookie + offset);
-    *val_len = (i - offset);
-
-    return 0;
+    return -1;
 }
 
 /*
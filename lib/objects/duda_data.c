@@ -97,13 +97,13 @@ char *duda_data_locate(duda_request_t *dr, const char *filename)
     /* compose the new buffer */
     flen = strlen(filename);
     len = ws->datadir.len + flen + 1;
-    path = mk_api->mem_alloc(len);
+    path = duda_gc_alloc(dr, len);
+    if (!path) {
+        return NULL;
+    }
     memcpy(path, ws->datadir.data, ws->datadir.len);
     memcpy(path + ws->datadir.len, filename, flen);
-    path[len] = '\0';
-
-    /* register in the garbage collector */
-    duda_gc_add(dr, path);
+    path[len - 1] = '\0';
 
     return path;
 }
@@ -18,6 +18,7 @@
  */
 
 #include <assert.h>
+#include <stdint.h>
 #include <string.h>
 
 #if defined (__linux__)
@@ -27,8 +28,13 @@
 #endif
 
 #include <limits.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
 #include <duda/duda.h>
 #include <duda/duda_api.h>
+#include <duda/duda_event.h>
+#include <duda/duda_timer.h>
 #include <duda/objects/duda_dthread.h>
 
 /*
@@ -49,13 +55,201 @@
 #include <valgrind/valgrind.h>
 #endif
 
-#define DTHREAD_STACK_SIZE (3 * (PTHREAD_STACK_MIN) / 2)
+/*
+ * Context switch: on x86_64 and aarch64 (ELF) a dthread switch only saves
+ * the callee-saved registers and swaps the stack pointer. swapcontext(3)
+ * also saves the signal mask, which costs a system call on every switch;
+ * dthreads never change it, so it's kept only as the fallback for other
+ * platforms or when built with DTHREAD_UCONTEXT.
+ */
+#if (defined(__x86_64__) || defined(__aarch64__)) && defined(__ELF__) && \
+    !defined(DTHREAD_UCONTEXT)
+#define DTHREAD_ASM_SWITCH
+#endif
+
+#ifdef DTHREAD_ASM_SWITCH
+
+typedef struct {
+    void *sp;
+} dthread_context_t;
+
+/* Save the registers on the current stack, store its top on *from and
+ * restore the registers saved on the stack 'to' */
+void duda_dthread_switch(void **from, void *to);
+
+/* First code of a new context: it calls fn(arg) from the saved registers */
+void duda_dthread_trampoline();
+
+#if defined(__x86_64__)
+__asm__ (
+    ".text\n"
+    ".globl duda_dthread_switch\n"
+    ".hidden duda_dthread_switch\n"
+    ".type duda_dthread_switch,@function\n"
+    "duda_dthread_switch:\n"
+    "    pushq %rbp\n"
+    "    pushq %rbx\n"
+    "    pushq %r12\n"
+    "    pushq %r13\n"
+    "    pushq %r14\n"
+    "    pushq %r15\n"
+    "    subq $8, %rsp\n"
+    "    stmxcsr (%rsp)\n"
+    "    fnstcw 4(%rsp)\n"
+    "    movq %rsp, (%rdi)\n"
+    "    movq %rsi, %rsp\n"
+    "    ldmxcsr (%rsp)\n"
+    "    fldcw 4(%rsp)\n"
+    "    addq $8, %rsp\n"
+    "    popq %r15\n"
+    "    popq %r14\n"
+    "    popq %r13\n"
+    "    popq %r12\n"
+    "    popq %rbx\n"
+    "    popq %rbp\n"
+    "    ret\n"
+    ".size duda_dthread_switch,.-duda_dthread_switch\n"
+    ".globl duda_dthread_trampoline\n"
+    ".hidden duda_dthread_trampoline\n"
+    ".type duda_dthread_trampoline,@function\n"
+    "duda_dthread_trampoline:\n"
+    "    movq %r12, %rdi\n"
+    "    callq *%r13\n"
+    "    ud2\n"
+    ".size duda_dthread_trampoline,.-duda_dthread_trampoline\n"
+);
+
+/* Registers frame: fp control words, r15, r14, r13, r12, rbx, rbp, ret */
+static void _dthread_context_make(dthread_context_t *ctx, char *stack, size_t size,
+                                  void (*fn)(void *), void *arg)
+{
+    uint64_t *sp;
+
+    /* 16 bytes aligned once the trampoline is entered */
+    sp = (uint64_t *) (((uintptr_t) (stack + size) & ~((uintptr_t) 15)) - 16);
+    *--sp = (uint64_t) (uintptr_t) duda_dthread_trampoline;
+    *--sp = 0;                                  /* rbp */
+    *--sp = 0;                                  /* rbx */
+    *--sp = (uint64_t) (uintptr_t) arg;         /* r12 */
+    *--sp = (uint64_t) (uintptr_t) fn;          /* r13 */
+    *--sp = 0;                                  /* r14 */
+    *--sp = 0;                                  /* r15 */
+    *--sp = 0x037F00001F80ULL;                  /* fpu control | mxcsr */
+
+    ctx->sp = sp;
+}
+
+#elif defined(__aarch64__)
+__asm__ (
+    ".text\n"
+    ".globl duda_dthread_switch\n"
+    ".hidden duda_dthread_switch\n"
+    ".type duda_dthread_switch,%function\n"
+    "duda_dthread_switch:\n"
+    "    sub sp, sp, #160\n"
+    "    stp x19, x20, [sp, #0]\n"
+    "    stp x21, x22, [sp, #16]\n"
+    "    stp x23, x24, [sp, #32]\n"
+    "    stp x25, x26, [sp, #48]\n"
+    "    stp x27, x28, [sp, #64]\n"
+    "    stp x29, x30, [sp, #80]\n"
+    "    stp d8, d9, [sp, #96]\n"
+    "    stp d10, d11, [sp, #112]\n"
+    "    stp d12, d13, [sp, #128]\n"
+    "    stp d14, d15, [sp, #144]\n"
+    "    mov x2, sp\n"
+    "    str x2, [x0]\n"
+    "    mov sp, x1\n"
+    "    ldp x19, x20, [sp, #0]\n"
+    "    ldp x21, x22, [sp, #16]\n"
+    "    ldp x23, x24, [sp, #32]\n"
+    "    ldp x25, x26, [sp, #48]\n"
+    "    ldp x27, x28, [sp, #64]\n"
+    "    ldp x29, x30, [sp, #80]\n"
+    "    ldp d8, d9, [sp, #96]\n"
+    "    ldp d10, d11, [sp, #112]\n"
+    "    ldp d12, d13, [sp, #128]\n"
+    "    ldp d14, d15, [sp, #144]\n"
+    "    add sp, sp, #160\n"
+    "    ret\n"
+    ".size duda_dthread_switch,.-duda_dthread_switch\n"
+    ".globl duda_dthread_trampoline\n"
+    ".hidden duda_dthread_trampoline\n"
+    ".type duda_dthread_trampoline,%function\n"
+    "duda_dthread_trampoline:\n"
+    "    mov x0, x20\n"
+    "    blr x19\n"
+    "    brk #0\n"
+    ".size duda_dthread_trampoline,.-duda_dthread_trampoline\n"
+);
+
+/* Registers frame: x19-x28, x29, x30 (return address), d8-d15 */
+static void _dthread_context_make(dthread_context_t *ctx, char *stack, size_t size,
+                                  void (*fn)(void *), void *arg)
+{
+    uint64_t *sp;
+
+    sp = (uint64_t *) (((uintptr_t) (stack + size) & ~((uintptr_t) 15)) - 160);
+    memset(sp, '\0', 160);
+    sp[0]  = (uint64_t) (uintptr_t) fn;         /* x19 */
+    sp[1]  = (uint64_t) (uintptr_t) arg;        /* x20 */
+    sp[11] = (uint64_t) (uintptr_t) duda_dthread_trampoline;   /* x30 */
+
+    ctx->sp = sp;
+}
+#endif
+
+static inline void _dthread_context_swap(dthread_context_t *from,
+                                         dthread_context_t *to)
+{
+    duda_dthread_switch(&from->sp, to->sp);
+}
+
+#else
+
+typedef ucontext_t dthread_context_t;
+
+static void _dthread_context_make(dthread_context_t *ctx, char *stack, size_t size,
+                                  void (*fn)(void *), void *arg)
+{
+    getcontext(ctx);
+    ctx->uc_stack.ss_sp = stack;
+    ctx->uc_stack.ss_size = size;
+    ctx->uc_link = NULL;
+    makecontext(ctx, (void (*)(void)) fn, 1, arg);
+}
+
+static inline void _dthread_context_swap(dthread_context_t *from,
+                                         dthread_context_t *to)
+{
+    swapcontext(from, to);
+}
+
+#endif
+
 #define DEFAULT_DTHREAD_NUM    16
 
+/*
+ * Stacks are mmap'd with a guard page below them, so an overflow faults
+ * instead of corrupting memory. Each worker keeps the stacks of finished
+ * dthreads in a free list, the descriptor lives at the top of the mapping.
+ */
+typedef struct duda_dthread_stack {
+    char *map;                  /* mapping, guard page included */
+    size_t map_size;
+    char *sp;                   /* usable stack                 */
+    size_t size;
+    struct mk_list _head;
+} duda_dthread_stack_t;
+
+/* Stack setup, shared by all workers */
+static size_t dthread_stack_size = DTHREAD_STACK_SIZE;
+static int dthread_stack_madv_free = MK_FALSE;
+
 typedef struct duda_dthread_t {
     duda_dthread_func func;
     void *data;
-    ucontext_t context;
+    dthread_context_t context;
     duda_dthread_scheduler_t *sch;
     int status;
     int parent_id;
@@ -63,21 +257,116 @@ typedef struct duda_dthread_t {
     unsigned int valgrind_stack_id;
 #endif
     struct mk_list chan_list;
-    char stack[DTHREAD_STACK_SIZE];
+    duda_dthread_stack_t *stack;
+
+    /* parked: waiting for a file descriptor or a timer */
+    int id;
+    int queued;
+    int wait_fd;
+    int wait_result;
+    struct duda_timer *wait_timer;
+    struct mk_list _head_ready;
 } duda_dthread_t;
 
 struct duda_dthread_scheduler_t {
-    ucontext_t main;
+    dthread_context_t main;
     int n_dthread;
     int cap;
     int running_id;
     duda_dthread_t **dt;
+
+    /* pool of free stacks */
+    int n_stacks;
+    struct mk_list stacks;
+
+    /*
+     * Ready queue: dthreads woken up by events or timers. An eventfd on the
+     * worker loop is kicked when the queue gets work, the queue is drained
+     * once per loop iteration from its handler.
+     */
+    int n_ready;
+    struct mk_list ready;
+    int kick_fd;
+    int kicked;
 };
 
+static duda_dthread_stack_t *_duda_dthread_stack_new()
+{
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t size;
+    char *map;
+    duda_dthread_stack_t *st;
+
+    size = (dthread_stack_size + sizeof(*st) + page - 1) & ~(page - 1);
+    map = mmap(NULL, size + page, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+    if (map == MAP_FAILED) {
+        return NULL;
+    }
+
+    /* guard page */
+    if (mprotect(map, page, PROT_NONE) != 0) {
+        munmap(map, size + page);
+        return NULL;
+    }
+
+    st = (duda_dthread_stack_t *) (map + page + size - sizeof(*st));
+    st->map = map;
+    st->map_size = size + page;
+    st->sp = map + page;
+    st->size = (size - sizeof(*st)) & ~((size_t) 15);
+
+    return st;
+}
+
+/* Take a stack from the worker pool or map a new one */
+static duda_dthread_stack_t *_duda_dthread_stack_get(duda_dthread_scheduler_t *sch)
+{
+    duda_dthread_stack_t *st;
+
+    while (sch->n_stacks > 0) {
+        st = mk_list_entry_first(&sch->stacks, duda_dthread_stack_t, _head);
+        mk_list_del(&st->_head);
+        sch->n_stacks--;
+
+        /* the stack size changed since it was mapped */
+        if (st->size < dthread_stack_size) {
+            munmap(st->map, st->map_size);
+            continue;
+        }
+        return st;
+    }
+
+    return _duda_dthread_stack_new();
+}
+
+/* Give back a stack that is not in use anymore */
+static void _duda_dthread_stack_put(duda_dthread_scheduler_t *sch,
+                                    duda_dthread_stack_t *st)
+{
+    if (sch->n_stacks >= DTHREAD_STACK_FREE) {
+        munmap(st->map, st->map_size);
+        return;
+    }
+
+#ifdef MADV_FREE
+    /* the kernel can take the pages back, the descriptor page is kept */
+    if (dthread_stack_madv_free == MK_TRUE) {
+        madvise(st->sp, ((char *) st - st->sp) & ~(sysconf(_SC_PAGESIZE) - 1),
+                MADV_FREE);
+    }
+#endif
+
+    mk_list_add(&st->_head, &sch->stacks);
+    sch->n_stacks++;
+}
+
 static void _duda_dthread_release(duda_dthread_t *dt);
+static int _duda_dthread_ready(duda_dthread_scheduler_t *sch, duda_dthread_t *dt);
 
-static void _duda_dthread_entry_point(duda_dthread_scheduler_t *sch)
+static void _duda_dthread_entry_point(void *data)
 {
+    duda_dthread_scheduler_t *sch = data;
     assert(sch);
     int id = sch->running_id;
     duda_dthread_t *dt = sch->dt[id];
@@ -88,9 +377,27 @@ static void _duda_dthread_entry_point(duda_dthread_scheduler_t *sch)
     mk_list_foreach(head, &dt->chan_list) {
         chan = mk_list_entry(head, duda_dthread_channel_t, _head);
         chan->receiver = -1;
+        /* a sender parked on a full channel gets the broken pipe */
+        if (chan->send_waiter != -1 && sch->dt[chan->send_waiter]) {
+            _duda_dthread_ready(sch, sch->dt[chan->send_waiter]);
+        }
+    }
+    if (dt->queued) {
+        mk_list_del(&dt->_head_ready);
+        dt->queued = MK_FALSE;
+        sch->n_ready--;
     }
     sch->n_dthread--;
     sch->running_id = dt->parent_id;
+
+    /* the context never returns: switch to the parent or the scheduler */
+    if (dt->parent_id != -1) {
+        sch->dt[dt->parent_id]->status = DTHREAD_RUNNING;
+        _dthread_context_swap(&dt->context, &sch->dt[dt->parent_id]->context);
+    }
+    else {
+        _dthread_context_swap(&dt->context, &sch->main);
+    }
 }
 
 duda_dthread_scheduler_t *duda_dthread_open()
@@ -101,6 +408,12 @@ duda_dthread_scheduler_t *duda_dthread_open()
     sch->cap = DEFAULT_DTHREAD_NUM;
     sch->running_id = -1;
     sch->dt = mk_api->mem_alloc_z(sizeof(duda_dthread_t *) * sch->cap);
+    sch->n_stacks = 0;
+    mk_list_init(&sch->stacks);
+    sch->n_ready = 0;
+    mk_list_init(&sch->ready);
+    sch->kick_fd = -1;
+    sch->kicked = MK_FALSE;
 
     return sch;
 }
@@ -109,12 +422,23 @@ void duda_dthread_close(duda_dthread_scheduler_t *sch)
 {
     assert(sch);
     int i;
+    struct mk_list *head, *tmp;
+    duda_dthread_stack_t *st;
     for (i = 0; i < sch->cap; ++i) {
         duda_dthread_t *dt = sch->dt[i];
         if (dt) {
             _duda_dthread_release(dt);
         }
     }
+    mk_list_foreach_safe(head, tmp, &sch->stacks) {
+        st = mk_list_entry(head, duda_dthread_stack_t, _head);
+        mk_list_del(&st->_head);
+        munmap(st->map, st->map_size);
+    }
+    if (sch->kick_fd != -1) {
+        duda_event_delete(sch->kick_fd);
+        close(sch->kick_fd);
+    }
     mk_api->mem_free(sch->dt);
     sch->dt = NULL;
     mk_api->mem_free(sch);
@@ -153,33 +477,63 @@ int duda_dthread_create(duda_dthread_func func, void *data)
             }
         }
     }
-    /* may use dthread pooling instead of release and realloc */
-    if (sch->dt[id] && sch->dt[id]->status == DTHREAD_DEAD) {
-        _duda_dthread_release(sch->dt[id]);
-        sch->dt[id] = NULL;
+    /* a dead dthread is reused in place */
+    duda_dthread_t *dt = sch->dt[id];
+    if (!dt) {
+        dt = mk_api->mem_alloc(sizeof(*dt));
+        if (!dt) {
+            return -1;
+        }
+        dt->stack = NULL;
+        sch->dt[id] = dt;
+    }
+    if (!dt->stack) {
+        dt->stack = _duda_dthread_stack_get(sch);
+        if (!dt->stack) {
+            dt->status = DTHREAD_DEAD;
+            return -1;
+        }
+#ifdef USE_VALGRIND
+        dt->valgrind_stack_id = VALGRIND_STACK_REGISTER(dt->stack->sp,
+                                                        dt->stack->sp + dt->stack->size);
+#endif
     }
-    duda_dthread_t *dt = mk_api->mem_alloc(sizeof(*dt));
-    assert(dt);
     dt->func = func;
     dt->data = data;
     dt->sch = sch;
     dt->status = DTHREAD_READY;
     dt->parent_id = -1;
-#ifdef USE_VALGRIND
-    dt->valgrind_stack_id = VALGRIND_STACK_REGISTER(dt->stack, dt->stack + DTHREAD_STACK_SIZE);
-#endif
+    dt->id = id;
+    dt->queued = MK_FALSE;
+    dt->wait_fd = -1;
+    dt->wait_timer = NULL;
     mk_list_init(&dt->chan_list);
-    sch->dt[id] = dt;
     sch->n_dthread++;
     return id;
 }
 
+/* Return the stack of a dead dthread to the pool, the dthread is kept */
+static void _duda_dthread_reclaim(duda_dthread_t *dt)
+{
+    if (dt->status != DTHREAD_DEAD || !dt->stack) {
+        return;
+    }
+#ifdef USE_VALGRIND
+    VALGRIND_STACK_DEREGISTER(dt->valgrind_stack_id);
+#endif
+    _duda_dthread_stack_put(dt->sch, dt->stack);
+    dt->stack = NULL;
+}
+
 static void _duda_dthread_release(duda_dthread_t *dt)
 {
     assert(dt);
+    if (dt->stack) {
 #ifdef USE_VALGRIND
-    VALGRIND_STACK_DEREGISTER(dt->valgrind_stack_id);
+        VALGRIND_STACK_DEREGISTER(dt->valgrind_stack_id);
 #endif
+        munmap(dt->stack->map, dt->stack->map_size);
+    }
     mk_api->mem_free(dt);
 }
 
@@ -216,7 +570,7 @@ void duda_dthread_yield()
     duda_dthread_t *dt = sch->dt[id];
     dt->status = DTHREAD_SUSPEND;
     sch->running_id = -1;
-    swapcontext(&dt->context, &sch->main);
+    _dthread_context_swap(&dt->context, &sch->main);
 }
 
 /*
@@ -237,25 +591,26 @@ void duda_dthread_resume(int id)
     }
     duda_dthread_t *dt = sch->dt[id];
     if (!dt) return;
+    /* resumed explicitly, a pending wake up is not needed anymore */
+    if (dt->queued) {
+        mk_list_del(&dt->_head_ready);
+        dt->queued = MK_FALSE;
+        sch->n_ready--;
+    }
     switch (dt->status) {
     case DTHREAD_READY:
-        getcontext(&dt->context);
-        dt->context.uc_stack.ss_sp = dt->stack;
-        dt->context.uc_stack.ss_size = DTHREAD_STACK_SIZE;
+        _dthread_context_make(&dt->context, dt->stack->sp, dt->stack->size,
+                              _duda_dthread_entry_point, sch);
         if (running_dt) {
-            dt->context.uc_link = &running_dt->context;
             dt->parent_id = sch->running_id;
             running_dt->status = DTHREAD_SUSPEND;
-        } else {
-            dt->context.uc_link = &sch->main;
         }
         sch->running_id = id;
         dt->status = DTHREAD_RUNNING;
-        makecontext(&dt->context, (void (*)(void))_duda_dthread_entry_point, 1, sch);
         if (running_dt) {
-            swapcontext(&running_dt->context, &dt->context);
+            _dthread_context_swap(&running_dt->context, &dt->context);
         } else {
-            swapcontext(&sch->main, &dt->context);
+            _dthread_context_swap(&sch->main, &dt->context);
         }
         break;
     case DTHREAD_SUSPEND:
@@ -263,14 +618,206 @@ void duda_dthread_resume(int id)
         dt->status = DTHREAD_RUNNING;
         if (running_dt) {
             running_dt->status = DTHREAD_SUSPEND;
-            swapcontext(&running_dt->context, &dt->context);
+            _dthread_context_swap(&running_dt->context, &dt->context);
         } else {
-            swapcontext(&sch->main, &dt->context);
+            _dthread_context_swap(&sch->main, &dt->context);
         }
         break;
     default:
         assert(0);
     }
+    /* back here, if it finished its stack is not in use anymore */
+    _duda_dthread_reclaim(dt);
+}
+
+/*
+ * @METHOD_NAME: stack_setup
+ * @METHOD_DESC: set the stack size of the dthreads created from now on and whether
+ * the memory of idle stacks kept in the worker pools can be returned to the system
+ * (MADV_FREE). It must be called from duda_main().
+ * @METHOD_PROTO: void stack_setup(size_t size, int release_idle)
+ * @METHOD_PARAM: size the stack size in bytes, it's rounded up to the page size.
+ * @METHOD_PARAM: release_idle MK_TRUE to let the system reclaim idle stacks.
+ * @METHOD_RETURN: this method do not return any value.
+ */
+void duda_dthread_stack_setup(size_t size, int release_idle)
+{
+    if (size < PTHREAD_STACK_MIN) {
+        size = PTHREAD_STACK_MIN;
+    }
+    dthread_stack_size = size;
+    dthread_stack_madv_free = release_idle;
+}
+
+/* Loop handler of the ready queue: resume the dthreads queued so far */
+static int _duda_dthread_drain(int fd, void *data)
+{
+    duda_dthread_scheduler_t *sch = data;
+    uint64_t val;
+    int n;
+    duda_dthread_t *dt;
+
+    if (read(fd, &val, sizeof(val)) <= 0) {
+        return DUDA_EVENT_OWNED;
+    }
+    sch->kicked = MK_FALSE;
+
+    /* the ones queued while draining wait for the next round */
+    n = sch->n_ready;
+    while (n-- > 0 && sch->n_ready > 0) {
+        dt = mk_list_entry_first(&sch->ready, duda_dthread_t, _head_ready);
+        mk_list_del(&dt->_head_ready);
+        dt->queued = MK_FALSE;
+        sch->n_ready--;
+
+        if (dt->status == DTHREAD_SUSPEND) {
+            duda_dthread_resume(dt->id);
+        }
+    }
+
+    return DUDA_EVENT_OWNED;
+}
+
+/* Queue a parked dthread to be resumed from the worker loop */
+static int _duda_dthread_ready(duda_dthread_scheduler_t *sch, duda_dthread_t *dt)
+{
+    uint64_t one = 1;
+
+    if (sch->kick_fd == -1) {
+        sch->kick_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (sch->kick_fd == -1) {
+            return -1;
+        }
+        if (duda_event_add(sch->kick_fd, DUDA_EVENT_READ,
+                           DUDA_EVENT_LEVEL_TRIGGERED,
+                           _duda_dthread_drain, NULL, NULL, NULL, NULL,
+                           sch) != 0) {
+            close(sch->kick_fd);
+            sch->kick_fd = -1;
+            return -1;
+        }
+    }
+
+    if (dt->queued) {
+        return 0;
+    }
+    mk_list_add(&dt->_head_ready, &sch->ready);
+    dt->queued = MK_TRUE;
+    sch->n_ready++;
+
+    if (sch->kicked == MK_FALSE) {
+        if (write(sch->kick_fd, &one, sizeof(one)) != sizeof(one)) {
+            return -1;
+        }
+        sch->kicked = MK_TRUE;
+    }
+
+    return 0;
+}
+
+/* Event callbacks of a dthread parked on a file descriptor */
+static int _duda_dthread_fd_wake(duda_dthread_t *dt, int fd, int result)
+{
+    if (dt->wait_fd != fd) {
+        return DUDA_EVENT_OWNED;
+    }
+
+    duda_event_delete(fd);
+    dt->wait_fd = -1;
+    dt->wait_result = result;
+    _duda_dthread_ready(dt->sch, dt);
+
+    return DUDA_EVENT_OWNED;
+}
+
+static int _duda_dthread_fd_ready(int fd, void *data)
+{
+    return _duda_dthread_fd_wake(data, fd, 0);
+}
+
+static int _duda_dthread_fd_error(int fd, void *data)
+{
+    return _duda_dthread_fd_wake(data, fd, -1);
+}
+
+static void _duda_dthread_timer_wake(struct duda_timer *t, void *data)
+{
+    duda_dthread_t *dt = data;
+    (void) t;
+
+    dt->wait_timer = NULL;
+    _duda_dthread_ready(dt->sch, dt);
+}
+
+/*
+ * @METHOD_NAME: wait_fd
+ * @METHOD_DESC: suspend the running dthread until the given file descriptor is ready
+ * for the requested operation, meanwhile the worker keeps serving other events. The
+ * file descriptor must be in non-blocking mode and must not be registered in the
+ * events interface.
+ * @METHOD_PROTO: int wait_fd(int fd, int mode)
+ * @METHOD_PARAM: fd the file descriptor to wait for.
+ * @METHOD_PARAM: mode DUDA_EVENT_READ or DUDA_EVENT_WRITE.
+ * @METHOD_RETURN: it returns 0 once the file descriptor is ready, or -1 on error or if
+ * the connection hung up.
+ */
+int duda_dthread_wait_fd(int fd, int mode)
+{
+    duda_dthread_scheduler_t *sch = pthread_getspecific(duda_dthread_scheduler);
+    if (!sch || sch->running_id == -1) {
+        return -1;
+    }
+    duda_dthread_t *dt = sch->dt[sch->running_id];
+
+    dt->wait_fd = fd;
+    dt->wait_result = -1;
+    if (duda_event_add(fd, mode, DUDA_EVENT_LEVEL_TRIGGERED,
+                       (mode & DUDA_EVENT_READ) ? _duda_dthread_fd_ready : NULL,
+                       (mode & DUDA_EVENT_WRITE) ? _duda_dthread_fd_ready : NULL,
+                       _duda_dthread_fd_error, NULL, NULL, dt) != 0) {
+        dt->wait_fd = -1;
+        return -1;
+    }
+
+    duda_dthread_yield();
+
+    /* resumed by someone else before the event */
+    if (dt->wait_fd != -1) {
+        duda_event_delete(fd);
+        dt->wait_fd = -1;
+    }
+    return dt->wait_result;
+}
+
+/*
+ * @METHOD_NAME: sleep
+ * @METHOD_DESC: suspend the running dthread for the given number of milliseconds,
+ * meanwhile the worker keeps serving other events.
+ * @METHOD_PROTO: int sleep(int ms)
+ * @METHOD_PARAM: ms milliseconds to sleep.
+ * @METHOD_RETURN: it returns 0 on success or -1 if it's not called from a dthread.
+ */
+int duda_dthread_sleep(int ms)
+{
+    duda_dthread_scheduler_t *sch = pthread_getspecific(duda_dthread_scheduler);
+    if (!sch || sch->running_id == -1) {
+        return -1;
+    }
+    duda_dthread_t *dt = sch->dt[sch->running_id];
+
+    dt->wait_timer = duda_timer_add(ms, _duda_dthread_timer_wake, dt);
+    if (!dt->wait_timer) {
+        return -1;
+    }
+
+    duda_dthread_yield();
+
+    /* resumed by someone else before the timer */
+    if (dt->wait_timer) {
+        duda_timer_cancel(dt->wait_timer);
+        dt->wait_timer = NULL;
+    }
+    return 0;
 }
 
 /*
@@ -286,6 +833,18 @@ int duda_dthread_running()
     return sch->running_id;
 }
 
+/* Queue a dthread parked on a channel to be resumed from the worker loop */
+void duda_dthread_wakeup(int id)
+{
+    duda_dthread_scheduler_t *sch = pthread_getspecific(duda_dthread_scheduler);
+    assert(sch);
+    assert(id >= 0 && id < sch->cap);
+    duda_dthread_t *dt = sch->dt[id];
+    if (dt && dt->status == DTHREAD_SUSPEND) {
+        _duda_dthread_ready(sch, dt);
+    }
+}
+
 void duda_dthread_add_channel(int id, duda_dthread_channel_t *chan)
 {
     assert(chan);
@@ -309,6 +868,9 @@ struct duda_api_dthread *duda_dthread_object()
     obj->yield  = duda_dthread_yield;
     obj->resume = duda_dthread_resume;
     obj->running = duda_dthread_running;
+    obj->stack_setup = duda_dthread_stack_setup;
+    obj->wait_fd = duda_dthread_wait_fd;
+    obj->sleep = duda_dthread_sleep;
     obj->chan_create = duda_dthread_channel_create;
     obj->chan_free = duda_dthread_channel_free;
     obj->chan_get_sender = duda_dthread_channel_get_sender;
@@ -319,6 +881,7 @@ struct duda_api_dthread *duda_dthread_object()
     obj->chan_end = duda_dthread_channel_end;
     obj->chan_send = duda_dthread_channel_send;
     obj->chan_recv = duda_dthread_channel_recv;
+    obj->chan_select = duda_dthread_channel_select;
 
     return obj;
 }
@@ -20,48 +20,66 @@
 #include <stdlib.h>
 #include <assert.h>
 #include <duda/duda_api.h>
+#include <duda/duda_timer.h>
 #include <duda/objects/duda_dthread.h>
 #include <duda/objects/duda_dthread_channel.h>
 
-struct duda_dthread_channel_elem_t {
-    void *data;
-    struct mk_list _head;
+/* Timeout of a dthread parked in chan_select() */
+struct duda_dthread_channel_timeout {
+    int id;
+    int expired;
+    struct duda_timer *timer;
 };
 
-duda_dthread_channel_elem_t *duda_dthread_channel_elem_create(void *data)
+static void duda_dthread_channel_timeout(struct duda_timer *t, void *data)
 {
-    duda_dthread_channel_elem_t *elem = mk_api->mem_alloc(sizeof(*elem));
-    assert(elem);
-    elem->data = data;
-    return elem;
+    struct duda_dthread_channel_timeout *to = data;
+    (void) t;
+
+    to->timer = NULL;
+    to->expired = 1;
+    duda_dthread_wakeup(to->id);
 }
 
-static void duda_dthread_channel_elem_free(duda_dthread_channel_elem_t *elem)
+/* Whether the dthread can run until the channel moves */
+static inline int duda_dthread_channel_runnable(int id)
 {
-    assert(elem);
-    mk_list_del(&elem->_head);
-    mk_api->mem_free(elem);
+    int status;
+
+    if (id == -1) {
+        return 0;
+    }
+    status = duda_dthread_status(id);
+    return (status == DTHREAD_READY || status == DTHREAD_SUSPEND);
 }
 
 /*
  * @METHOD_NAME: chan_create
- * @METHOD_DESC: create a channel(pipe) for dthread communication.
+ * @METHOD_DESC: create a channel(pipe) for dthread communication. The elements are
+ * kept in a fixed ring allocated with the channel, so sending and receiving never
+ * allocate memory.
  * @METHOD_PROTO: duda_dthread_channel_t *chan_create(int size)
  * @METHOD_PARAM: size the buffered size of the channel.
  * @METHOD_RETURN: returns a new channel.
  */
 duda_dthread_channel_t *duda_dthread_channel_create(int size)
 {
-    duda_dthread_channel_t *chan = mk_api->mem_alloc(sizeof(*chan));
+    duda_dthread_channel_t *chan;
+
+    assert(size >= 0);
+    chan = mk_api->mem_alloc(sizeof(*chan) + sizeof(void *) * (size + 1));
     assert(chan);
-	chan->size = size + 1;
+    chan->size = size + 1;
     chan->used = 0;
-    mk_list_init(&chan->bufs);
+    chan->head = 0;
+    chan->ring = (void **) (chan + 1);
     chan->sender = -1;
     chan->receiver = -1;
     chan->ended = 0;
     chan->done = 0;
-	return chan;
+    chan->recv_waiter = -1;
+    chan->send_waiter = -1;
+    return chan;
 }
 
 /*
@@ -82,51 +100,169 @@ void duda_dthread_channel_free(duda_dthread_channel_t *chan)
 
 /*
  * @METHOD_NAME: chan_send
- * @METHOD_DESC: add a new element to the given channel.
+ * @METHOD_DESC: add a new element to the given channel. If the channel is full the
+ * receiver is resumed, if it's still full the running dthread is suspended until
+ * the receiver takes an element.
  * @METHOD_PROTO: int chan_send(duda_dthread_channel_t *chan, void *data)
  * @METHOD_PARAM: chan the target channel to send.
  * @METHOD_PARAM: data the new element to be sent to channel.
  * @METHOD_RETURN: return DTHREAD_CHANNEL_BROKEN if the other side of the pipe
- * is closed, otherwise return DTHREAD_CHANNEL_OK.
+ * is closed, DTHREAD_CHANNEL_FULL if the channel is full and it's not called from
+ * a dthread, otherwise return DTHREAD_CHANNEL_OK.
  */
 int duda_dthread_channel_send(duda_dthread_channel_t *chan, void *data)
 {
+    int id;
+
     assert(chan);
     if (chan->receiver == -1) {
         return DTHREAD_CHANNEL_BROKEN;
     }
     if (chan->used == chan->size) {
         // channel is full
-        duda_dthread_resume(chan->receiver);
+        id = duda_dthread_running();
+        if (duda_dthread_channel_runnable(chan->receiver)) {
+            chan->send_waiter = id;
+            duda_dthread_resume(chan->receiver);
+        }
+        while (chan->used == chan->size) {
+            if (id == -1) {
+                return DTHREAD_CHANNEL_FULL;
+            }
+            if (chan->receiver == -1) {
+                chan->send_waiter = -1;
+                return DTHREAD_CHANNEL_BROKEN;
+            }
+            chan->send_waiter = id;
+            duda_dthread_yield();
+        }
+        chan->send_waiter = -1;
     }
-    duda_dthread_channel_elem_t *elem = duda_dthread_channel_elem_create(data);
-    mk_list_add(&elem->_head, &chan->bufs);
+
+    chan->ring[(chan->head + chan->used) % chan->size] = data;
     chan->used++;
+    if (chan->recv_waiter != -1) {
+        duda_dthread_wakeup(chan->recv_waiter);
+    }
     return DTHREAD_CHANNEL_OK;
 }
 
 /*
  * @METHOD_NAME: chan_recv
- * @METHOD_DESC: remove an element from a given channel.
+ * @METHOD_DESC: remove an element from a given channel. If the channel is empty the
+ * sender is resumed, if it's still empty the running dthread is suspended until an
+ * element arrives or the channel ends.
  * @METHOD_PROTO: void *chan_recv(duda_dthread_channel_t *chan)
  * @METHOD_PARAM: chan the target channel to receive.
- * @METHOD_RETURN: the front element of the channel.
+ * @METHOD_RETURN: the front element of the channel, or NULL if the channel ended
+ * without more elements.
  */
 void *duda_dthread_channel_recv(duda_dthread_channel_t *chan)
 {
+    void *data;
+
     assert(chan);
     assert(!chan->done);
-    if (chan->used == 0) {
+    if (chan->used == 0 && duda_dthread_channel_runnable(chan->sender)) {
         // channel is empty
+        chan->recv_waiter = duda_dthread_running();
         duda_dthread_resume(chan->sender);
+        chan->recv_waiter = -1;
     }
-    duda_dthread_channel_elem_t *elem = mk_list_entry_first(&chan->bufs,
-            duda_dthread_channel_elem_t, _head);
-    void *data = elem->data;
-    duda_dthread_channel_elem_free(elem);
+    if (chan->used == 0 &&
+        duda_dthread_channel_select(&chan, 1, -1) != 0) {
+        return NULL;
+    }
+
+    data = chan->ring[chan->head];
+    chan->head = (chan->head + 1) % chan->size;
     chan->used--;
     if (chan->used == 0 && chan->ended) {
         chan->done = 1;
     }
+    if (chan->send_waiter != -1) {
+        duda_dthread_wakeup(chan->send_waiter);
+    }
     return data;
 }
+
+/*
+ * @METHOD_NAME: chan_select
+ * @METHOD_DESC: wait until one of the given channels have an element to receive. The
+ * running dthread is suspended meanwhile, the worker keeps serving other events.
+ * Channels that ended without elements are marked as done and skipped.
+ * @METHOD_PROTO: int chan_select(duda_dthread_channel_t **chans, int n, int timeout_ms)
+ * @METHOD_PARAM: chans array of channels to wait for.
+ * @METHOD_PARAM: n number of channels in the array.
+ * @METHOD_PARAM: timeout_ms maximum milliseconds to wait, 0 to just check the
+ * channels or -1 to wait with no limit.
+ * @METHOD_RETURN: the index of a channel ready to receive, DTHREAD_CHANNEL_TIMEOUT if
+ * the timeout expired or DTHREAD_CHANNEL_BROKEN if all the channels are done.
+ */
+int duda_dthread_channel_select(duda_dthread_channel_t **chans, int n,
+                                int timeout_ms)
+{
+    int i;
+    int live;
+    int ret;
+    duda_dthread_channel_t *chan;
+    struct duda_dthread_channel_timeout to;
+
+    assert(chans);
+    to.id = duda_dthread_running();
+    to.expired = 0;
+    to.timer = NULL;
+
+    while (1) {
+        live = 0;
+        for (i = 0; i < n; i++) {
+            chan = chans[i];
+            if (chan->done) {
+                continue;
+            }
+            if (chan->used > 0) {
+                ret = i;
+                goto out;
+            }
+            if (chan->ended) {
+                chan->done = 1;
+                continue;
+            }
+            live++;
+        }
+
+        if (live == 0) {
+            ret = DTHREAD_CHANNEL_BROKEN;
+            goto out;
+        }
+        if (timeout_ms == 0 || to.expired || to.id == -1) {
+            ret = DTHREAD_CHANNEL_TIMEOUT;
+            goto out;
+        }
+        if (timeout_ms > 0 && !to.timer) {
+            to.timer = duda_timer_add(timeout_ms,
+                                      duda_dthread_channel_timeout, &to);
+            if (!to.timer) {
+                ret = DTHREAD_CHANNEL_TIMEOUT;
+                goto out;
+            }
+        }
+
+        /* park until a sender, the end of a channel or the timer wake us */
+        for (i = 0; i < n; i++) {
+            chans[i]->recv_waiter = to.id;
+        }
+        duda_dthread_yield();
+        for (i = 0; i < n; i++) {
+            if (chans[i]->recv_waiter == to.id) {
+                chans[i]->recv_waiter = -1;
+            }
+        }
+    }
+
+ out:
+    if (to.timer) {
+        duda_timer_cancel(to.timer);
+    }
+    return ret;
+}
@@ -32,6 +32,45 @@
  * memory leaks.
  */
 
+/* Per worker list of free arena chunks */
+static __thread struct duda_gc_chunk *gc_chunks_free;
+static __thread int gc_chunks_free_n;
+
+static struct duda_gc_chunk *gc_chunk_get(size_t size)
+{
+    struct duda_gc_chunk *chunk;
+
+    if (size == DUDA_GC_ARENA_SIZE && gc_chunks_free) {
+        chunk = gc_chunks_free;
+        gc_chunks_free = chunk->next;
+        gc_chunks_free_n--;
+    }
+    else {
+        chunk = mk_api->mem_alloc(sizeof(struct duda_gc_chunk) + size);
+        if (!chunk) {
+            return NULL;
+        }
+        chunk->size = size;
+    }
+
+    chunk->used = 0;
+    chunk->next = NULL;
+    return chunk;
+}
+
+static void gc_chunk_put(struct duda_gc_chunk *chunk)
+{
+    if (chunk->size != DUDA_GC_ARENA_SIZE ||
+        gc_chunks_free_n >= DUDA_GC_ARENA_FREE) {
+        mk_api->mem_free(chunk);
+        return;
+    }
+
+    chunk->next = gc_chunks_free;
+    gc_chunks_free = chunk;
+    gc_chunks_free_n++;
+}
+
 int duda_gc_init(duda_request_t *dr)
 {
     size_t size = (sizeof(struct duda_gc_entry) * DUDA_GC_ENTRIES);
@@ -39,6 +78,7 @@ int duda_gc_init(duda_request_t *dr)
     dr->gc.used = 0;
     dr->gc.size = DUDA_GC_ENTRIES;
     dr->gc.cells = mk_api->mem_alloc_z(size);
+    dr->gc.arena = NULL;
 
     if (!dr->gc.cells) {
         return -1;
@@ -58,75 +98,145 @@ int duda_gc_init(duda_request_t *dr)
 
 int duda_gc_add(duda_request_t *dr, void *p)
 {
-    int i;
     int new_size;
     struct duda_gc_entry *tmp;
 
     /* add more cells if we are running out of space */
     if (dr->gc.used >= dr->gc.size) {
-        new_size = (dr->gc.size * DUDA_GC_ENTRIES +
-                    (sizeof(struct duda_gc_entry) * DUDA_GC_CHUNK));
+        new_size = dr->gc.size + DUDA_GC_CHUNK;
 
-        tmp = mk_api->mem_realloc(dr->gc.cells, new_size);
+        tmp = mk_api->mem_realloc(dr->gc.cells,
+                                  sizeof(struct duda_gc_entry) * new_size);
         if (tmp) {
             dr->gc.cells = tmp;
-            dr->gc.size  = dr->gc.size + DUDA_GC_CHUNK;
+            dr->gc.size  = new_size;
         }
         else {
             return -1;
         }
     }
 
-    /* register new entry */
-    for (i = 0; i < dr->gc.size; i++) {
-        if (dr->gc.cells[i].status == 0) {
-            dr->gc.cells[i].p      = p;
-            dr->gc.cells[i].status = 1;
-            dr->gc.used++;
-            return 0;
+    /* cells are released all together, so the used ones are contiguous */
+    dr->gc.cells[dr->gc.used].p      = p;
+    dr->gc.cells[dr->gc.used].status = 1;
+    dr->gc.used++;
+
+    return 0;
+}
+
+/*
+ * @METHOD_NAME: alloc
+ * @METHOD_DESC: Allocate memory from the request arena, it's released
+ * automatically once the main request context ends. The memory must not be
+ * freed or reallocated by the caller.
+ * @METHOD_PARAM: dr the request context information hold by a duda_request_t type
+ * @METHOD_PARAM: size number of bytes required
+ * @METHOD_RETURN: On success it returns the memory address, on error NULL.
+ */
+void *duda_gc_alloc(duda_request_t *dr, const size_t size)
+{
+    size_t offset;
+    struct duda_gc_chunk *chunk = dr->gc.arena;
+    struct duda_gc_chunk *big;
+
+    /* Big requests get their own chunk, linked behind the current one */
+    if (size > DUDA_GC_ARENA_BIG) {
+        big = gc_chunk_get(size);
+        if (!big) {
+            return NULL;
+        }
+        big->used = size;
+
+        if (chunk) {
+            big->next = chunk->next;
+            chunk->next = big;
+        }
+        else {
+            dr->gc.arena = big;
+        }
+        return big->data;
+    }
+
+    if (chunk) {
+        offset = (chunk->used + (DUDA_GC_ARENA_ALIGN - 1)) &
+            ~((size_t) DUDA_GC_ARENA_ALIGN - 1);
+        if (offset + size <= chunk->size) {
+            chunk->used = offset + size;
+            return chunk->data + offset;
         }
     }
 
+    chunk = gc_chunk_get(DUDA_GC_ARENA_SIZE);
+    if (!chunk) {
+        return NULL;
+    }
+    chunk->next  = dr->gc.arena;
+    chunk->used  = size;
+    dr->gc.arena = chunk;
 
-    /* something went really wrong */
-    return -1;
+    return chunk->data;
 }
 
-void *duda_gc_alloc(duda_request_t *dr, const size_t size)
+/* Duplicate 'len' bytes of a string into the request arena */
+char *duda_gc_strndup(duda_request_t *dr, const char *s, size_t len)
 {
-    void *p = NULL;
-
+    char *buf;
 
-    p = mk_api->mem_alloc(size);
-    if (!p) {
+    buf = duda_gc_alloc(dr, len + 1);
+    if (!buf) {
         return NULL;
     }
 
-    duda_gc_add(dr, p);
-    return p;
+    memcpy(buf, s, len);
+    buf[len] = '\0';
+    return buf;
 }
 
+/*
+ * Release the request memory: registered pointers are freed and the arena
+ * is reset. One chunk is kept so the next request on this context do not
+ * need to touch the allocator.
+ */
 int duda_gc_free_content(duda_request_t *dr)
 {
     int i;
     int freed = 0;
+    struct duda_gc_chunk *chunk;
+    struct duda_gc_chunk *next;
+    struct duda_gc_chunk *keep = NULL;
 
     /* free all registered entries in the GC array */
-    for (i = 0; i < dr->gc.size && dr->gc.used > 0; i++) {
-        if (dr->gc.cells[i].status == 1) {
-            mk_api->mem_free(dr->gc.cells[i].p);
-            dr->gc.used--;
-            dr->gc.cells[i].p = NULL;
-            dr->gc.cells[i].status = 0;
-            freed++;
+    for (i = 0; i < dr->gc.used; i++) {
+        mk_api->mem_free(dr->gc.cells[i].p);
+        dr->gc.cells[i].p = NULL;
+        dr->gc.cells[i].status = 0;
+        freed++;
+    }
+    dr->gc.used = 0;
+
+    for (chunk = dr->gc.arena; chunk; chunk = next) {
+        next = chunk->next;
+        if (!keep && chunk->size == DUDA_GC_ARENA_SIZE) {
+            keep = chunk;
+            keep->used = 0;
+            keep->next = NULL;
+            continue;
         }
+        gc_chunk_put(chunk);
     }
+    dr->gc.arena = keep;
 
     return freed;
 }
 
 int duda_gc_free(duda_request_t *dr)
 {
+    duda_gc_free_content(dr);
+    if (dr->gc.arena) {
+        gc_chunk_put(dr->gc.arena);
+        dr->gc.arena = NULL;
+    }
+
     mk_api->mem_free(dr->gc.cells);
     return 0;
 }
@@ -136,7 +246,8 @@ struct duda_api_gc *duda_gc_object()
     struct duda_api_gc *obj;
 
     obj = mk_api->mem_alloc(sizeof(struct duda_api_gc));
-    obj->add = duda_gc_add;
+    obj->add   = duda_gc_add;
+    obj->alloc = duda_gc_alloc;
 
     return obj;
 }
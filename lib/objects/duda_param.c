@@ -17,6 +17,8 @@
  *  limitations under the License.
  */
 
+#include <limits.h>
+
 #include <duda/duda.h>
 #include <duda/objects/duda_router.h>
 #include <duda/objects/duda_param.h>
@@ -37,45 +39,61 @@ struct duda_api_param *duda_param_object()
     p = mk_api->mem_alloc(sizeof(struct duda_api_param));
     p->get        = duda_param_get;
     p->get_number = duda_param_get_number;
+    p->get_ptr    = duda_param_get_ptr;
+    p->get_int64  = duda_param_get_int64;
+    p->get_uint64 = duda_param_get_uint64;
+    p->get_double = duda_param_get_double;
 
     return p;
 };
 
-static inline int get_param_position(duda_request_t *dr, const char *key)
+/*
+ * Find the value of a given key. The variables of the matched path were
+ * resolved to URI positions when the path was mapped, so we just compare
+ * the names and reference the segment stored by the router lookup.
+ */
+static inline struct duda_router_uri_field *get_param_field(duda_request_t *dr,
+                                                            const char *key)
 {
-    int i = 0;
+    int i;
     int klen;
-    struct mk_list *head;
-    struct duda_router_field *path_field;
+    struct duda_router_path *path = dr->router_path;
+    struct duda_router_param *p;
 
-    if (!key) {
-        return -1;
+    if (!key || !path || path->n_params == 0) {
+        return NULL;
     }
 
     klen = strlen(key);
-
-    /*
-     * Determinate the expected position of the given key in the
-     * original Router.
-     */
-    mk_list_foreach(head, &dr->router_path->fields) {
-        path_field = mk_list_entry(head, struct duda_router_field, _head);
-        if (path_field->type != DUDA_ROUTER_DYNAMIC) {
-            goto next;
+    for (i = 0; i < path->n_params; i++) {
+        p = &path->params[i];
+        if (p->name_len != klen || memcmp(p->name, key, klen) != 0) {
+            continue;
         }
 
-        if (klen != (path_field->name_len - 1)) {
-            goto next;
+        if (p->slot >= dr->router_uri.len) {
+            return NULL;
         }
 
-        if (strncmp(path_field->name + 1, key, klen) == 0) {
-            return i;
-        }
-    next:
-        i++;
+        return &dr->router_uri.fields[p->slot];
     }
 
-    return -1;
+    return NULL;
+}
+
+static inline int get_param_value(duda_request_t *dr, const char *key,
+                                  mk_ptr_t *value)
+{
+    struct duda_router_uri_field *field;
+
+    field = get_param_field(dr, key);
+    if (!field) {
+        return -1;
+    }
+
+    value->data = field->name;
+    value->len  = field->name_len;
+    return 0;
 }
 
 /*
@@ -90,30 +108,15 @@ static inline int get_param_position(duda_request_t *dr, const char *key)
  */
 char *duda_param_get(duda_request_t *dr, const char *key)
 {
-    int match;
     char *value = NULL;
-    struct duda_router_uri_field *field;
-
-    if (!key) {
-        return NULL;
-    }
-
-    if (!dr->router_path) {
-        return NULL;
-    }
+    mk_ptr_t val;
 
     /*
      * If the key exists, perform a copy of the incoming data from the URL
-     * and register the new buffer with the garbage collector, do not trust
-     * the end user will do that.
+     * into the request arena, do not trust the end user will free it.
      */
-    match = get_param_position(dr, key);
-    if (match >= 0) {
-        field = &dr->router_uri.fields[match];
-        value = mk_api->str_copy_substr(field->name, 0, field->name_len);
-        if (value) {
-            duda_gc_add(dr, value);
-        }
+    if (get_param_value(dr, key, &val) == 0) {
+        value = duda_gc_strndup(dr, val.data, val.len);
         return value;
     }
 
@@ -121,6 +124,21 @@ char *duda_param_get(duda_request_t *dr, const char *key)
     return NULL;
 }
 
+/*
+ * @METHOD_NAME: get_ptr
+ * @METHOD_DESC: For a given key associated to a dynamic Router path, reference
+ * the value in the URL without copying it. The value is not NULL terminated.
+ * @METHOD_PARAM: dr the request context information hold by a duda_request_t type
+ * @METHOD_PARAM: key the identifier key set on the Router, e.g: 'name'.
+ * @METHOD_PARAM: value stores the reference and length of the value, valid
+ * while the request is alive.
+ * @METHOD_RETURN: Upon successful completion it returns 0, on error it returns -1.
+ */
+int duda_param_get_ptr(duda_request_t *dr, const char *key, mk_ptr_t *value)
+{
+    return get_param_value(dr, key, value);
+}
+
 /*
  * @METHOD_NAME: get_number
  * @METHOD_DESC: Get the numeric value of the given key. Use only when expecting a numeric value.
@@ -132,16 +150,20 @@ char *duda_param_get(duda_request_t *dr, const char *key)
 int duda_param_get_number(duda_request_t *dr, const char *key, long *res)
 {
     int ret;
-    int match;
     long number;
     struct duda_router_uri_field *field;
 
-    match = get_param_position(dr, key);
-    if (match == -1) {
+    field = get_param_field(dr, key);
+    if (!field) {
         return -1;
     }
 
-    field = &dr->router_uri.fields[match];
+    if (field->type == DUDA_ROUTER_TI64 &&
+        field->val.i64 >= LONG_MIN && field->val.i64 <= LONG_MAX) {
+        *res = (long) field->val.i64;
+        return 0;
+    }
+
     ret = duda_utils_strtol(field->name, field->name_len, &number);
     if (ret == -1) {
         return -1;
@@ -150,3 +172,83 @@ int duda_param_get_number(duda_request_t *dr, const char *key, long *res)
     *res = number;
     return 0;
 }
+
+/*
+ * @METHOD_NAME: get_int64
+ * @METHOD_DESC: Get the signed 64 bits integer value of the given key, it's
+ * parsed from the URL without copying it.
+ * @METHOD_PARAM: dr the request context information hold by a duda_request_t type
+ * @METHOD_PARAM: key the identifier key set on the Router, e.g: 'id'.
+ * @METHOD_PARAM: res stores the parameter value.
+ * @METHOD_RETURN: Upon successful completion it returns 0, on error it returns -1.
+ */
+int duda_param_get_int64(duda_request_t *dr, const char *key, int64_t *res)
+{
+    struct duda_router_uri_field *field;
+
+    field = get_param_field(dr, key);
+    if (!field) {
+        return -1;
+    }
+
+    /* Typed captures were converted by the router */
+    if (field->type == DUDA_ROUTER_TI64) {
+        *res = field->val.i64;
+        return 0;
+    }
+
+    return duda_utils_strtoll(field->name, field->name_len, res);
+}
+
+/*
+ * @METHOD_NAME: get_uint64
+ * @METHOD_DESC: Get the unsigned 64 bits integer value of the given key, it's
+ * parsed from the URL without copying it.
+ * @METHOD_PARAM: dr the request context information hold by a duda_request_t type
+ * @METHOD_PARAM: key the identifier key set on the Router, e.g: 'id'.
+ * @METHOD_PARAM: res stores the parameter value.
+ * @METHOD_RETURN: Upon successful completion it returns 0, on error it returns -1.
+ */
+int duda_param_get_uint64(duda_request_t *dr, const char *key, uint64_t *res)
+{
+    struct duda_router_uri_field *field;
+
+    field = get_param_field(dr, key);
+    if (!field) {
+        return -1;
+    }
+
+    /* Typed captures were converted by the router */
+    if (field->type == DUDA_ROUTER_TU64) {
+        *res = field->val.u64;
+        return 0;
+    }
+
+    return duda_utils_strtoull(field->name, field->name_len, res);
+}
+
+/*
+ * @METHOD_NAME: get_double
+ * @METHOD_DESC: Get the floating point value of the given key.
+ * @METHOD_PARAM: dr the request context information hold by a duda_request_t type
+ * @METHOD_PARAM: key the identifier key set on the Router, e.g: 'price'.
+ * @METHOD_PARAM: res stores the parameter value.
+ * @METHOD_RETURN: Upon successful completion it returns 0, on error it returns -1.
+ */
+int duda_param_get_double(duda_request_t *dr, const char *key, double *res)
+{
+    struct duda_router_uri_field *field;
+
+    field = get_param_field(dr, key);
+    if (!field) {
+        return -1;
+    }
+
+    /* Typed captures were converted by the router */
+    if (field->type == DUDA_ROUTER_TDOUBLE) {
+        *res = field->val.d;
+        return 0;
+    }
+
+    return duda_utils_strtod(field->name, field->name_len, res);
+}
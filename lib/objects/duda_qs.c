@@ -35,14 +35,148 @@ struct duda_api_qs *duda_qs_object()
     struct duda_api_qs *qs;
 
     qs = mk_api->mem_alloc(sizeof(struct duda_api_qs));
-    qs->count  = duda_qs_count;
-    qs->get    = duda_qs_get;
-    qs->get_id = duda_qs_get_id;
-    qs->cmp    = duda_qs_cmp;
+    qs->count   = duda_qs_count;
+    qs->get     = duda_qs_get;
+    qs->get_id  = duda_qs_get_id;
+    qs->get_ptr = duda_qs_get_ptr;
+    qs->next    = duda_qs_next;
+    qs->cmp     = duda_qs_cmp;
 
     return qs;
 };
 
+/* FNV-1a hash of a key */
+static inline unsigned int qs_hash(const char *key, int len)
+{
+    int i;
+    unsigned int hash = 2166136261u;
+
+    for (i = 0; i < len; i++) {
+        hash ^= (unsigned char) key[i];
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+static inline int qs_hex(char c)
+{
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    else if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+    else if (c >= 'A' && c <= 'F') {
+        return c - 'A' + 10;
+    }
+    return -1;
+}
+
+static inline int qs_is_encoded(const char *buf, int len)
+{
+    int i;
+
+    for (i = 0; i < len; i++) {
+        if (buf[i] == '%' || buf[i] == '+') {
+            return MK_TRUE;
+        }
+    }
+    return MK_FALSE;
+}
+
+/*
+ * Percent-decode 'src' into the request arena, '+' is converted to a space
+ * and invalid escape sequences are kept as they are.
+ */
+static int qs_decode(duda_request_t *dr, mk_ptr_t *src, mk_ptr_t *dst)
+{
+    int i;
+    int hi;
+    int lo;
+    int n = 0;
+    char *buf;
+
+    buf = duda_gc_alloc(dr, src->len + 1);
+    if (!buf) {
+        return -1;
+    }
+
+    for (i = 0; i < (int) src->len; i++) {
+        if (src->data[i] == '+') {
+            buf[n++] = ' ';
+            continue;
+        }
+
+        if (src->data[i] == '%' && i + 2 < (int) src->len &&
+            (hi = qs_hex(src->data[i + 1])) >= 0 &&
+            (lo = qs_hex(src->data[i + 2])) >= 0) {
+            buf[n++] = (hi << 4) | lo;
+            i += 2;
+            continue;
+        }
+        buf[n++] = src->data[i];
+    }
+    buf[n] = '\0';
+
+    dst->data = buf;
+    dst->len  = n;
+    return 0;
+}
+
+/* Parse the query string the first time is required */
+static inline int qs_ensure(duda_request_t *dr)
+{
+    if (dr->qs.parsed == MK_FALSE) {
+        duda_qs_parse(dr);
+    }
+    return dr->qs.count;
+}
+
+/* Returns the position of the first entry that matches 'key', or -1 */
+static int qs_lookup(struct duda_qs_map *qs, const char *key, int len)
+{
+    unsigned int mask;
+    unsigned int i;
+    int pos;
+    struct duda_qs_entry *entry;
+
+    if (qs->count == 0) {
+        return -1;
+    }
+
+    mask = qs->index_size - 1;
+    i = qs_hash(key, len) & mask;
+
+    while ((pos = qs->index[i]) != 0) {
+        entry = &qs->entries[pos - 1];
+        if ((int) entry->key.len == len &&
+            memcmp(entry->key.data, key, len) == 0) {
+            return pos - 1;
+        }
+        i = (i + 1) & mask;
+    }
+
+    return -1;
+}
+
+/* Get the decoded value of an entry, the decoding is done only once */
+static inline int qs_value(duda_request_t *dr, int pos, mk_ptr_t *value)
+{
+    struct duda_qs_entry *entry = &dr->qs.entries[pos];
+
+    if (entry->decoded == MK_FALSE) {
+        if (qs_is_encoded(entry->value.data, entry->value.len) == MK_TRUE) {
+            if (qs_decode(dr, &entry->value, &entry->value) != 0) {
+                return -1;
+            }
+        }
+        entry->decoded = MK_TRUE;
+    }
+
+    *value = entry->value;
+    return 0;
+}
 
 /*
  * @METHOD_NAME: count
@@ -53,14 +187,14 @@ struct duda_api_qs *duda_qs_object()
  */
 int duda_qs_count(duda_request_t *dr)
 {
-    return dr->qs.count;
+    return qs_ensure(dr);
 }
 
 /*
  * @METHOD_NAME: get
- * @METHOD_DESC: Return a new buffer with the value of the given key from the
- * query string. The new buffer is automatically freed once the service finish it
- * works.
+ * @METHOD_DESC: Return a new buffer with the decoded value of the given key
+ * from the query string. The new buffer is automatically freed once the service
+ * finish it works.
  * @METHOD_PROTO: char *get(duda_request_t *dr, const char *key);
  * @METHOD_PARAM: dr the request context information hold by a duda_request_t type
  * @METHOD_PARAM: key the name of the key
@@ -69,35 +203,22 @@ int duda_qs_count(duda_request_t *dr)
  */
 char *duda_qs_get(duda_request_t *dr, const char *key)
 {
-    int i;
-    unsigned int len;
-    char *value = NULL;
+    mk_ptr_t value;
 
-    if (dr->qs.count <= 0) {
+    if (duda_qs_get_ptr(dr, key, &value) != 0) {
         return NULL;
     }
 
-    len = strlen(key);
-    for (i=0 ; i < dr->qs.count; i++) {
-        if (dr->qs.entries[i].key.len == len &&
-            strncmp(dr->qs.entries[i].key.data, key, len) == 0) {
-            value = mk_api->str_copy_substr(dr->qs.entries[i].value.data, 0,
-                                            (int) dr->qs.entries[i].value.len);
-
-            /* Register the new memory buffer into the garbage collector */
-            duda_gc_add(dr, value);
-            return value;
-        }
-    }
-
-    return NULL;
+    /* The copy lives in the request arena */
+    return duda_gc_strndup(dr, value.data, value.len);
 }
 
 /*
  * @METHOD_NAME: get_id
  * @METHOD_DESC: Lookup a query string variable given it ID or numeric position
- * (starting from zero). It will return a new buffer with the value of the given
- * key. The new buffer is automatically freed once the service finish it works.
+ * (starting from zero). It will return a new buffer with the decoded value of
+ * the given key. The new buffer is automatically freed once the service finish
+ * it works.
  * @METHOD_PROTO: char *get_id(duda_request_t *dr, int idx);
  * @METHOD_PARAM: dr the request context information hold by a duda_request_t type
  * @METHOD_PARAM: idx the variable ID or numeric position.
@@ -106,22 +227,85 @@ char *duda_qs_get(duda_request_t *dr, const char *key)
  */
 char *duda_qs_get_id(duda_request_t *dr, int idx)
 {
-    char *value = NULL;
+    mk_ptr_t value;
 
-    if (idx < 0 || dr->qs.count <= 0) {
+    if (idx < 0 || idx >= qs_ensure(dr)) {
         return NULL;
     }
 
-    if (idx >= dr->qs.count) {
+    if (qs_value(dr, idx, &value) != 0) {
         return NULL;
     }
 
-    value = mk_api->str_copy_substr(dr->qs.entries[idx].value.data, 0,
-                                    (int) dr->qs.entries[idx].value.len);
+    /* The copy lives in the request arena */
+    return duda_gc_strndup(dr, value.data, value.len);
+}
+
+/*
+ * @METHOD_NAME: get_ptr
+ * @METHOD_DESC: Reference the decoded value of the given key without copying
+ * it. If the value was not encoded the reference points to the query string,
+ * otherwise it's decoded once into the request memory. The value may not be
+ * NULL terminated.
+ * @METHOD_PROTO: int get_ptr(duda_request_t *dr, const char *key, mk_ptr_t *value);
+ * @METHOD_PARAM: dr the request context information hold by a duda_request_t type
+ * @METHOD_PARAM: key the name of the key
+ * @METHOD_PARAM: value stores the reference and length of the value.
+ * @METHOD_RETURN: Upon successful completion it returns 0, on error -1.
+ */
+int duda_qs_get_ptr(duda_request_t *dr, const char *key, mk_ptr_t *value)
+{
+    int pos;
+
+    if (!key || qs_ensure(dr) <= 0) {
+        return -1;
+    }
+
+    pos = qs_lookup(&dr->qs, key, strlen(key));
+    if (pos == -1) {
+        return -1;
+    }
+
+    return qs_value(dr, pos, value);
+}
+
+/*
+ * @METHOD_NAME: next
+ * @METHOD_DESC: Iterate the values of a key that is set many times in the
+ * query string, e.g: 'tag=a&tag=b'. The values are returned in the order
+ * they arrived.
+ * @METHOD_PROTO: int next(duda_request_t *dr, const char *key, int *id, mk_ptr_t *value);
+ * @METHOD_PARAM: dr the request context information hold by a duda_request_t type
+ * @METHOD_PARAM: key the name of the key
+ * @METHOD_PARAM: id iterator position, it must be set to -1 before the first call.
+ * @METHOD_PARAM: value stores the reference and length of the decoded value.
+ * @METHOD_RETURN: It returns 0 while there are values, -1 once the key have
+ * no more values.
+ */
+int duda_qs_next(duda_request_t *dr, const char *key, int *id, mk_ptr_t *value)
+{
+    int pos;
+
+    if (!key || qs_ensure(dr) <= 0) {
+        return -1;
+    }
+
+    if (*id < 0) {
+        pos = qs_lookup(&dr->qs, key, strlen(key));
+    }
+    else if (*id < dr->qs.count) {
+        pos = dr->qs.entries[*id].next;
+    }
+    else {
+        return -1;
+    }
+
+    if (pos == -1) {
+        return -1;
+    }
 
-    /* Register the new memory buffer into the garbage collector */
-    duda_gc_add(dr, value);
-    return value;
+    *id = pos;
+    return qs_value(dr, pos, value);
 }
 
 /*
@@ -135,119 +319,145 @@ char *duda_qs_get_id(duda_request_t *dr, int idx)
  * on error it returns -1.
  */
 int duda_qs_cmp(duda_request_t *dr, const char *key, const char *value)
+{
+    int id = -1;
+    size_t len;
+    mk_ptr_t val;
+
+    len = strlen(value);
+    while (duda_qs_next(dr, key, &id, &val) == 0) {
+        if (val.len == len && memcmp(val.data, value, len) == 0) {
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+/* Link the entries into the key index */
+static int qs_index(duda_request_t *dr)
 {
     int i;
+    int pos;
+    int size = 16;
+    unsigned int mask;
+    unsigned int h;
+    struct duda_qs_entry *entry;
     struct duda_qs_map *qs = &dr->qs;
 
-    if (dr->qs.count <= 0) {
-        return -1;
+    while (size < qs->count * 2) {
+        size <<= 1;
     }
 
-    for (i=0 ; i < dr->qs.count; i++) {
-        if (strncmp(qs->entries[i].key.data, key,
-                    qs->entries[i].key.len) == 0) {
-
-            /* Compare the key value */
-            if (strncmp(qs->entries[i].value.data, value,
-                        qs->entries[i].value.len) == 0) {
-                return 0;
+    qs->index = duda_gc_alloc(dr, sizeof(int) * size);
+    if (!qs->index) {
+        return -1;
+    }
+    memset(qs->index, '\0', sizeof(int) * size);
+    qs->index_size = size;
+    mask = size - 1;
+
+    /*
+     * Insert from the last entry to the first one, each entry goes in front
+     * of the ones with the same key, so repeated keys keep the arrival order.
+     */
+    for (i = qs->count - 1; i >= 0; i--) {
+        entry = &qs->entries[i];
+        entry->next = -1;
+
+        h = qs_hash(entry->key.data, entry->key.len) & mask;
+        while ((pos = qs->index[h]) != 0) {
+            if (qs->entries[pos - 1].key.len == entry->key.len &&
+                memcmp(qs->entries[pos - 1].key.data, entry->key.data,
+                       entry->key.len) == 0) {
+                entry->next = pos - 1;
+                break;
             }
+            h = (h + 1) & mask;
         }
+        qs->index[h] = i + 1;
     }
 
-    return -1;
+    return 0;
 }
 
 /*
  * Query string parser, if the query string section exists, it will parse the
- * content and fill the entries mapping the keys and values.
+ * content and fill the entries mapping the keys and values. Keys are decoded
+ * here, values are decoded once they are requested.
  */
 int duda_qs_parse(duda_request_t *dr)
 {
     int i;
-    int len   = 0;
-    int qs_len;
+    int max = 1;
     int count = 0;
-    char *key = NULL;
-    char *val = NULL;
+    int qs_len;
+    char *qs_data;
+    char *key;
+    char *eq;
+    char *end;
+    struct duda_qs_entry *entry;
     struct duda_qs_map *qs = &dr->qs;
     struct mk_http_request *sr = dr->request;
 
+    qs->parsed = MK_TRUE;
+    qs->count  = 0;
+
     /* If we do not have a query string just return */
-    if (!sr->query_string.data) {
+    if (!sr->query_string.data || sr->query_string.len == 0) {
         return -1;
     }
 
-    qs_len = sr->query_string.len;
+    qs_data = sr->query_string.data;
+    qs_len  = sr->query_string.len;
 
-    /* Start parsing the query string */
-    for (i=0 ; i < qs_len; i++ ) {
-        switch (sr->query_string.data[i]) {
-        case '&':
-            if (key && val) {
-                len = (i - (val - sr->query_string.data));
-                qs->entries[count].value.data = val + 1;
-                qs->entries[count].value.len  = len - 1;
-                count++;
-            }
-
-            len = 0;
-            key = NULL;
-            val = NULL;
-            break;
-        case '=':
-            /* check if the key has finished */
-            if (key && !val) {
-                /* set the key */
-                len = (i - (key - sr->query_string.data));
-                qs->entries[count].key.data = key;
-                qs->entries[count].key.len  = len;
-
-                /* set the value start */
-                if (sr->query_string.data[i] != ' ') {
-                    val = sr->query_string.data + i;
-                }
-            }
-            break;
-        default:
-            /* A new key is starting */
-            if (!key) {
-                key = sr->query_string.data + i;
-            }
-        };
+    /* The number of separators is the upper limit of entries */
+    for (i = 0; i < qs_len; i++) {
+        if (qs_data[i] == '&') {
+            max++;
+        }
     }
-
-    if (key && val) {
-        len = (i - (val - sr->query_string.data));
-        qs->entries[count].value.data = val + 1;
-        qs->entries[count].value.len  = len - 1;
-        count++;
+    if (max > QS_ENTRIES_MAX) {
+        max = QS_ENTRIES_MAX;
     }
 
-    qs->count = count;
-
-    /* DEBUG
-    key = malloc(sr->query_string.len + 1);
-    strncpy(key, sr->query_string.data, sr->query_string.len);
-    key[sr->query_string.len] = '\0';
+    qs->entries = duda_gc_alloc(dr, sizeof(struct duda_qs_entry) * max);
+    if (!qs->entries) {
+        return -1;
+    }
 
-    printf("query string = '%s'\n", key);
-    free(key);
+    key = qs_data;
+    while (key < qs_data + qs_len && count < max) {
+        end = memchr(key, '&', (qs_data + qs_len) - key);
+        if (!end) {
+            end = qs_data + qs_len;
+        }
 
-    for (i=0; i < qs->count; i++) {
-        key = malloc(qs->entries[i].key.len + 1);
-        strncpy(key, qs->entries[i].key.data, qs->entries[i].key.len);
-        key[qs->entries[i].key.len] = '\0';
+        /* Only 'key=value' pairs with a non empty key are registered */
+        eq = memchr(key, '=', end - key);
+        if (eq && eq > key) {
+            entry = &qs->entries[count];
+            entry->key.data   = key;
+            entry->key.len    = eq - key;
+            entry->value.data = eq + 1;
+            entry->value.len  = end - (eq + 1);
+            entry->decoded    = MK_FALSE;
+            entry->next       = -1;
+
+            if (qs_is_encoded(entry->key.data, entry->key.len) == MK_TRUE) {
+                qs_decode(dr, &entry->key, &entry->key);
+            }
+            count++;
+        }
 
-        val = malloc(qs->entries[i].value.len + 1);
-        strncpy(val, qs->entries[i].value.data, qs->entries[i].value.len);
-        val[qs->entries[i].value.len] = '\0';
+        key = end + 1;
+    }
 
-        printf("key='%s' ; val='%s'\n", key, val);
-        free(key);
-        free(val);
+    qs->count = count;
+    if (count > 0 && qs_index(dr) != 0) {
+        qs->count = 0;
+        return -1;
     }
-    */
 
     return count;
 }
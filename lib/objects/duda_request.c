@@ -383,7 +383,7 @@ int duda_request_validate_socket(int socket)
 {
     duda_request_t *dr;
 
-    dr = duda_dr_list_get(socket);
+    dr = duda_request_lookup(socket);
     if (dr) {
         return MK_TRUE;
     }
@@ -402,7 +402,7 @@ int duda_request_validate_request(duda_request_t *dr)
 {
     duda_request_t *tmp;
 
-    tmp = duda_dr_list_get(dr->socket);
+    tmp = duda_request_lookup(dr->socket);
     if (!tmp) {
         return MK_FALSE;
     }
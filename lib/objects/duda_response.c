@@ -18,13 +18,17 @@
  */
 
 #include <stdarg.h>
+#include <sys/stat.h>
 
 #include <duda/duda.h>
 #include <duda/duda_api.h>
+#include <duda/duda_old.h>
 #include <duda/duda_queue.h>
 #include <duda/duda_event.h>
 #include <duda/duda_sendfile.h>
 #include <duda/duda_body_buffer.h>
+#include <duda/duda_compress.h>
+#include <duda/duda_utils.h>
 #include <duda/objects/duda_response.h>
 
 /*
@@ -49,6 +53,105 @@ int duda_response_headers_off(duda_request_t *dr)
     return 0;
 }
 
+static int header_row_printf(duda_request_t *dr, int size, const char *fmt, ...);
+
+/*
+ * Validators of a file that is the whole body. The compressed version is a
+ * different representation: it gets its own strong ETag with the encoding
+ * appended, e.g: "5f1c-2a0-gz", and ranges are only offered on the identity.
+ * A 304 has no body, its ETag is the one of the representation negotiated
+ * with the client. If the file can go compressed the response varies on
+ * Accept-Encoding, the Content-Encoding row already says so.
+ */
+static void response_file_validators(duda_request_t *dr)
+{
+    int status = dr->request->headers.status;
+    int encoding;
+    int compressible;
+    char *ext;
+    struct mk_http_header *header;
+    struct duda_output_map *out = &dr->out;
+
+    compressible = MK_FALSE;
+    if (duda_compress_type(&dr->request->headers.content_type) == MK_TRUE &&
+        duda_compress_file_size(out->etag_size) == MK_TRUE) {
+        compressible = MK_TRUE;
+    }
+
+    encoding = out->encoding;
+    if (status == 304 && compressible == MK_TRUE) {
+        header = mk_api->header_get(MK_HEADER_ACCEPT_ENCODING, dr->request,
+                                    NULL, 0);
+        if (header) {
+            encoding = duda_compress_negotiate(&header->val);
+        }
+    }
+
+    ext = duda_compress_ext(encoding);
+    if (ext) {
+        header_row_printf(dr, 64, "ETag: %.*s-%s\"\r\n",
+                          out->etag_len - 1, out->etag, ext);
+    }
+    else {
+        header_row_printf(dr, 64, "ETag: %.*s\r\n", out->etag_len, out->etag);
+    }
+
+    /* The body, if any, goes as is */
+    if (!duda_compress_ext(out->encoding)) {
+        if (status != 304) {
+            duda_response_header_row(dr, "Accept-Ranges: bytes\r\n", 22);
+        }
+        if (compressible == MK_TRUE) {
+            duda_response_header_row(dr, "Vary: Accept-Encoding\r\n", 23);
+        }
+    }
+    out->etag = NULL;
+}
+
+/*
+ * Complete the response headers before they are handed to the server: the
+ * headers registered by the service and how the body is delimited. In
+ * buffered mode the Content-Length is the size of the whole body pending,
+ * in streaming mode the body is sent with chunked encoding, HTTP/1.0
+ * clients don't support it so the connection is closed at the end.
+ */
+static void response_headers_prepare(duda_request_t *dr)
+{
+    struct response_headers *h = &dr->request->headers;
+
+    if (dr->_st_http_headers_off == MK_TRUE) {
+        return;
+    }
+
+    /* Headers registered by the service for every response */
+    if (dr->service && dr->service->static_headers.len > 0) {
+        duda_response_header_row(dr, dr->service->static_headers.data,
+                                 dr->service->static_headers.len);
+    }
+
+    if (dr->out.etag) {
+        response_file_validators(dr);
+    }
+
+    if (dr->_st_http_content_length != -2) {
+        h->content_length = dr->_st_http_content_length;
+        return;
+    }
+
+    if (dr->out.mode == DUDA_OUTPUT_BUFFERED) {
+        h->content_length = dr->out.bytes + duda_queue_length(&dr->queue_out);
+        return;
+    }
+
+    h->content_length = -1;
+    if (dr->request->protocol == MK_HTTP_PROTOCOL_11) {
+        h->transfer_encoding = MK_HEADER_TE_TYPE_CHUNKED;
+    }
+    else {
+        dr->request->keep_alive = MK_FALSE;
+    }
+}
+
 /*
  * @METHOD_NAME: send_headers
  * @METHOD_DESC: Send the HTTP response headers
@@ -58,256 +161,1468 @@ int duda_response_headers_off(duda_request_t *dr)
 int duda_response_send_headers(duda_request_t *dr)
 {
     int r;
-    size_t bytes = 0;
-    struct mk_list *head;
-    struct mk_stream *stream;
 
     if (dr->_st_http_headers_off == MK_TRUE) {
         dr->_st_http_headers_sent = MK_TRUE;
         return 0;
     }
 
-    if (dr->_st_http_headers_sent == MK_TRUE) {
+    if (dr->_st_http_headers_sent == MK_TRUE) {
+        return -1;
+    }
+
+    if (dr->_st_body_writes > 0) {
+        /* FIXME: Console error */
+        return -1;
+    }
+
+    /* The queued content is not compressed on this path */
+    if (dr->out.encoding == -1) {
+        dr->out.encoding = DUDA_COMPRESS_NONE;
+    }
+
+    /* Body length or chunked encoding */
+    response_headers_prepare(dr);
+
+    if (dr->request->headers.status <= 0) {
+        duda_api_exception(dr, "Callback did not set the HTTP response status");
+        abort();
+    }
+
+    r = mk_api->header_prepare(dr->session, dr->request);
+    if (r != 0) {
+        /* FIXME: Console error */
+        return -1;
+    }
+
+    /* Change flag status */
+    dr->_st_http_headers_sent = MK_TRUE;
+
+    /*
+     * Concatenate list, link temporal dr->channel nodes to parent channel
+     * streams list.
+     */
+
+    /* FIXME: dst-2 */
+    //mk_list_cat(&dr->channel.streams, &(dr->session->channel)->streams);
+
+    return 0;
+}
+
+/*
+ * @METHOD_NAME: http_status
+ * @METHOD_DESC: It set the HTTP response status code
+ * @METHOD_PARAM: dr the request context information hold by a duda_request_t type
+ * @METHOD_PARAM: status the HTTP code status
+ * @METHOD_RETURN: Upon successful completion it returns 0, on error returns -1.
+ */
+int duda_response_http_status(duda_request_t *dr, int status)
+{
+    mk_http_status(dr->request, status);
+    return 0;
+}
+
+/*
+ * @METHOD_NAME: http_header
+ * @METHOD_DESC: It adds a new HTTP header to the response
+ * @METHOD_PARAM: dr the request context information hold by a duda_request_t type
+ * @METHOD_PARAM: row fixed string containing the header details, it must not include CRLF
+ * or similar break line characters.
+ * @METHOD_RETURN: Upon successful completion it returns 0, on error returns -1.
+ */
+int duda_response_http_header(duda_request_t *dr, char *row)
+{
+    return mk_api->header_add(dr->request, row, strlen(row));
+}
+
+/*
+ * @METHOD_NAME: http_header_n
+ * @METHOD_DESC: It adds a new HTTP header to the response but specifying the number of bytes.
+ * @METHOD_PARAM: dr the request context information hold by a duda_request_t type
+ * @METHOD_PARAM: row fixed string containing the header details, it must not include CRLF
+ * or similar break line characters.
+ * @METHOD_PARAM: len specify the number of bytes of 'row' to set as header.
+ * @METHOD_RETURN: Upon successful completion it returns 0, on error returns -1.
+ */
+int duda_response_http_header_n(duda_request_t *dr, char *row, int len)
+{
+    return mk_api->header_add(dr->request, row, len);
+}
+
+/*
+ * @METHOD_NAME: http_content_length
+ * @METHOD_DESC: It sets a fixed content length header value. If you set the value -1 the Content-Length header will not be send.
+ * @METHOD_PARAM: dr the request context information hold by a duda_request_t type
+ * @METHOD_PARAM: length the body length.
+ * @METHOD_RETURN: This method always returns zero
+ */
+int duda_response_http_content_length(duda_request_t *dr, long length)
+{
+    dr->_st_http_content_length = length;
+    return 0;
+}
+
+/*
+ * @METHOD_NAME: stream
+ * @METHOD_DESC: It switch the response to streaming mode: the body is not buffered
+ * until the end, it's sent with chunked encoding every time flush() is invoked or
+ * when enough data is pending. By default responses are buffered and the
+ * Content-Length is calculated when the response ends. It must be invoked before
+ * the first flush and before any file is enqueued, files are not sent in chunks.
+ * @METHOD_PARAM: dr the request context information hold by a duda_request_t type
+ * @METHOD_RETURN: Upon successful completion it returns 0, on error returns -1.
+ */
+int duda_response_stream(duda_request_t *dr)
+{
+    if (dr->_st_body_writes > 0 ||
+        mk_list_is_empty(&dr->queue_out.items) != 0) {
+        return -1;
+    }
+
+    dr->out.mode = DUDA_OUTPUT_STREAM;
+    return 0;
+}
+
+/*
+ * Pre-rendered header rows, they are attached to the response by reference
+ * so hot paths do not format or copy anything.
+ */
+#define HEADER_ROW(str)  {str, sizeof(str) - 1}
+
+struct header_row {
+    char *data;
+    int len;
+};
+
+/* Content-Type of the most used extensions, others are taken from Monkey */
+static struct {
+    char *ext;
+    struct header_row row;
+} content_types[] = {
+    {"json", HEADER_ROW("Content-Type: application/json\r\n")},
+    {"html", HEADER_ROW("Content-Type: text/html\r\n")},
+    {"txt",  HEADER_ROW("Content-Type: text/plain\r\n")},
+    {"css",  HEADER_ROW("Content-Type: text/css\r\n")},
+    {"js",   HEADER_ROW("Content-Type: application/javascript\r\n")},
+    {"xml",  HEADER_ROW("Content-Type: application/xml\r\n")},
+    {NULL,   {NULL, 0}}
+};
+
+static struct header_row cache_control[] = {
+    [DUDA_CACHE_NO_CACHE]    = HEADER_ROW("Cache-Control: no-cache\r\n"),
+    [DUDA_CACHE_NO_STORE]    = HEADER_ROW("Cache-Control: no-store\r\n"),
+    [DUDA_CACHE_PRIVATE]     = HEADER_ROW("Cache-Control: private\r\n"),
+    [DUDA_CACHE_PUBLIC_HOUR] = HEADER_ROW("Cache-Control: public, max-age=3600\r\n"),
+    [DUDA_CACHE_PUBLIC_DAY]  = HEADER_ROW("Cache-Control: public, max-age=86400\r\n"),
+    [DUDA_CACHE_IMMUTABLE]   = HEADER_ROW("Cache-Control: public, max-age=31536000, immutable\r\n"),
+};
+
+/*
+ * Attach a complete header row, including the ending CRLF, to the response
+ * headers. The row is referenced, it must be valid until the response ends.
+ */
+int duda_response_header_row(duda_request_t *dr, char *row, int len)
+{
+    struct mk_iov *iov = dr->request->headers._extra_rows;
+
+    if (!iov) {
+        iov = mk_api->iov_create(MK_PLUGIN_HEADER_EXTRA_ROWS * 2, 0);
+        if (!iov) {
+            return -1;
+        }
+        dr->request->headers._extra_rows = iov;
+    }
+
+    return mk_api->iov_add(iov, row, len, MK_FALSE);
+}
+
+/*
+ * @METHOD_NAME: http_content_type
+ * @METHOD_DESC: Given a known mime extension, it lookup the mime type associated and
+ * set the HTTP Content-Type header. The header row is already composed, it's not
+ * formatted per request.
+ * @METHOD_PARAM: dr the request context information hold by a duda_request_t type
+ * @METHOD_PARAM: extension the mime extension. e.g: 'jpg'.
+ * @METHOD_RETURN: Upon successful completion it returns 0, on error returns -1.
+ */
+int duda_response_http_content_type(duda_request_t *dr, char *extension)
+{
+    int i;
+    struct mimetype *m;
+
+    for (i = 0; content_types[i].ext; i++) {
+        if (strcmp(content_types[i].ext, extension) == 0) {
+            dr->request->headers.content_type.data = content_types[i].row.data;
+            dr->request->headers.content_type.len  = content_types[i].row.len;
+            return 0;
+        }
+    }
+
+    /* Monkey keeps the composed row of each mime type */
+    m = mk_api->mimetype_lookup(extension);
+    if (!m) {
+        return -1;
+    }
+
+    dr->request->headers.content_type = m->header_type;
+    return 0;
+}
+
+/*
+ * @METHOD_NAME: http_cache_control
+ * @METHOD_DESC: It adds a Cache-Control header with one of the common policies.
+ * @METHOD_PARAM: dr the request context information hold by a duda_request_t type
+ * @METHOD_PARAM: type the policy: DUDA_CACHE_NO_CACHE, DUDA_CACHE_NO_STORE,
+ * DUDA_CACHE_PRIVATE, DUDA_CACHE_PUBLIC_HOUR, DUDA_CACHE_PUBLIC_DAY or
+ * DUDA_CACHE_IMMUTABLE.
+ * @METHOD_RETURN: Upon successful completion it returns 0, on error returns -1.
+ */
+int duda_response_http_cache_control(duda_request_t *dr, int type)
+{
+    if (type < DUDA_CACHE_NO_CACHE || type > DUDA_CACHE_IMMUTABLE) {
+        return -1;
+    }
+
+    return duda_response_header_row(dr, cache_control[type].data,
+                                    cache_control[type].len);
+}
+
+/*
+ * @METHOD_NAME: static_header
+ * @METHOD_DESC: It register a header that is added to every response of the
+ * service, e.g: 'X-Frame-Options: DENY'. All of them are composed once in a
+ * single block. It must be used only inside duda_main().
+ * @METHOD_PARAM: ds the service context given to duda_main()
+ * @METHOD_PARAM: row fixed string containing the header, it must not include CRLF
+ * or similar break line characters.
+ * @METHOD_RETURN: Upon successful completion it returns 0, on error returns -1.
+ */
+int duda_response_static_header(struct duda_service *ds, char *row)
+{
+    int len;
+    char *tmp;
+
+    if (!row) {
+        return -1;
+    }
+
+    len = strlen(row);
+    tmp = mk_mem_realloc(ds->static_headers.data,
+                         ds->static_headers.len + len + 2);
+    if (!tmp) {
+        return -1;
+    }
+
+    memcpy(tmp + ds->static_headers.len, row, len);
+    tmp[ds->static_headers.len + len]     = '\r';
+    tmp[ds->static_headers.len + len + 1] = '\n';
+
+    ds->static_headers.data = tmp;
+    ds->static_headers.len += len + 2;
+
+    return 0;
+}
+
+/* Get a new segment on the output buffer */
+static struct duda_output_seg *output_seg_new(duda_request_t *dr)
+{
+    int size;
+    struct duda_output_map *out = &dr->out;
+    struct duda_output_seg *segs;
+
+    /* The Content-Length already went out with the headers */
+    if (out->mode == DUDA_OUTPUT_BUFFERED && dr->_st_body_writes > 0 &&
+        dr->_st_http_content_length == -2) {
+        return NULL;
+    }
+
+    if (out->n_segs >= out->size_segs) {
+        size = out->size_segs + DUDA_OUTPUT_SEGS;
+        segs = duda_gc_alloc(dr, sizeof(struct duda_output_seg) * size);
+        if (!segs) {
+            return NULL;
+        }
+
+        if (out->n_segs > 0) {
+            memcpy(segs, out->segs, sizeof(struct duda_output_seg) * out->n_segs);
+        }
+        out->segs = segs;
+        out->size_segs = size;
+    }
+
+    return &out->segs[out->n_segs++];
+}
+
+static char *output_reserve(duda_request_t *dr, size_t size);
+
+/*
+ * Decide once per response if the body is compressed. Only responses
+ * without a fixed Content-Length and with a compressible Content-Type are
+ * candidates. A body made of a single file uses the cached compressed
+ * version of the file, otherwise the output buffer goes through a
+ * compressor context.
+ */
+static void response_encoding(duda_request_t *dr)
+{
+    int len;
+    int encoding;
+    char *row;
+    unsigned long pending;
+    struct mk_http_header *header;
+    struct duda_queue_item *item;
+    struct duda_sendfile *sf;
+    struct duda_output_map *out = &dr->out;
+
+    if (out->encoding != -1) {
+        return;
+    }
+    out->encoding = DUDA_COMPRESS_NONE;
+
+    if (dr->_st_http_headers_off == MK_TRUE ||
+        dr->_st_http_content_length != -2 ||
+        duda_compress_type(&dr->request->headers.content_type) == MK_FALSE) {
+        return;
+    }
+
+    header = mk_api->header_get(MK_HEADER_ACCEPT_ENCODING, dr->request, NULL, 0);
+    if (!header) {
+        return;
+    }
+
+    encoding = duda_compress_negotiate(&header->val);
+    if (encoding == DUDA_COMPRESS_NONE) {
+        return;
+    }
+
+    if (mk_list_is_empty(&dr->queue_out.items) != 0) {
+        item = mk_list_entry_first(&dr->queue_out.items, struct duda_queue_item, _head);
+        if (out->bytes > 0 || item->_head.next != &dr->queue_out.items ||
+            item->type != DUDA_QTYPE_SENDFILE) {
+            return;
+        }
+
+        sf = (struct duda_sendfile *) item->data;
+        pending = sf->pending_bytes;
+        if (duda_compress_file(sf, encoding) != 0) {
+            return;
+        }
+        dr->queue_out.bytes -= pending - sf->pending_bytes;
+    }
+    else {
+        if (out->mode == DUDA_OUTPUT_BUFFERED &&
+            out->bytes < DUDA_COMPRESS_MIN_SIZE) {
+            return;
+        }
+
+        out->compress = duda_compress_acquire(encoding);
+        if (!out->compress) {
+            return;
+        }
+    }
+
+    out->encoding = encoding;
+    len = duda_compress_header(encoding, &row);
+    duda_response_header_row(dr, row, len);
+}
+
+/*
+ * Replace the pending segments with their compressed content. The data is
+ * flushed from the compressor so it can be sent right away, if 'last' is
+ * set the compressed stream ends.
+ */
+static int output_compress(duda_request_t *dr, int last)
+{
+    int i;
+    int op;
+    int ret;
+    int n_segs;
+    size_t in_len;
+    size_t avail;
+    size_t produced;
+    const char *in;
+    char *p;
+    struct duda_output_seg *segs;
+    struct duda_output_seg *seg;
+    struct duda_output_map *out = &dr->out;
+
+    /* The old segments stay in the arena until the request ends */
+    segs   = out->segs;
+    n_segs = out->n_segs;
+
+    out->bytes     = 0;
+    out->n_segs    = 0;
+    out->size_segs = 0;
+    out->segs      = NULL;
+    out->tail      = NULL;
+    out->tail_size = 0;
+
+    for (i = 0; i <= n_segs; i++) {
+        if (i < n_segs) {
+            in     = segs[i].data;
+            in_len = segs[i].len;
+            op     = DUDA_COMPRESS_CONTINUE;
+        }
+        else {
+            in     = NULL;
+            in_len = 0;
+            op     = last ? DUDA_COMPRESS_END : DUDA_COMPRESS_FLUSH;
+        }
+
+        do {
+            p = output_reserve(dr, 1);
+            if (!p) {
+                return -1;
+            }
+            seg = &out->segs[out->n_segs - 1];
+            avail = out->tail_size - seg->len;
+
+            ret = duda_compress_run(out->compress, op, &in, &in_len, &p, &avail);
+            if (ret == -1) {
+                return -1;
+            }
+
+            produced = (out->tail_size - seg->len) - avail;
+            seg->len   += produced;
+            out->bytes += produced;
+        } while (ret == 1);
+    }
+
+    if (last == MK_TRUE) {
+        duda_compress_release(out->compress);
+        out->compress = NULL;
+    }
+
+    return 0;
+}
+
+/* Reset the output buffer once its segments were handed over */
+static inline void output_reset(struct duda_output_map *out)
+{
+    out->flushed += out->bytes;
+    out->bytes  = 0;
+    out->n_segs = 0;
+    out->tail   = NULL;
+    out->tail_size = 0;
+}
+
+/*
+ * Move the pending segments to the end of the output queue, so they are
+ * sent after the content enqueued before them. The segments are referenced,
+ * they live in the request arena.
+ */
+static int output_queue(duda_request_t *dr)
+{
+    int i;
+    struct duda_output_map *out = &dr->out;
+    struct duda_body_buffer *bb;
+    struct duda_queue_item *item;
+
+    if (out->n_segs == 0) {
+        return 0;
+    }
+
+    bb = duda_body_buffer_new();
+    if (!bb) {
+        return -1;
+    }
+
+    for (i = 0; i < out->n_segs; i++) {
+        if (duda_body_buffer_add(bb, out->segs[i].data, out->segs[i].len) < 0) {
+            mk_api->iov_free(bb->buf);
+            mk_api->mem_free(bb);
+            return -1;
+        }
+    }
+
+    item = duda_queue_item_new(DUDA_QTYPE_BODY_BUFFER);
+    if (!item) {
+        mk_api->iov_free(bb->buf);
+        mk_api->mem_free(bb);
+        return -1;
+    }
+    item->data = bb;
+    duda_queue_add(item, &dr->queue_out);
+
+    output_reset(out);
+    return 0;
+}
+
+/*
+ * The queue is written straight to the socket: content can be enqueued only
+ * while the body length is still open in buffered mode, it's never sent in
+ * chunks.
+ */
+static int response_queue_check(duda_request_t *dr)
+{
+    if (dr->out.mode == DUDA_OUTPUT_STREAM || dr->_st_body_writes > 0) {
+        return -1;
+    }
+    return 0;
+}
+
+/* Enqueue an item after the output pending so far */
+static int response_queue_add(duda_request_t *dr, struct duda_queue_item *item)
+{
+    if (output_queue(dr) == -1) {
+        return -1;
+    }
+    return duda_queue_add(item, &dr->queue_out);
+}
+
+/*
+ * Hand the headers to the server before the queue is written to the
+ * socket, the Content-Length covers the output and the queue.
+ */
+static int response_headers_flush(duda_request_t *dr)
+{
+    if (dr->_st_body_writes > 0 || dr->_st_http_headers_sent == MK_TRUE) {
+        return 0;
+    }
+
+    if (dr->out.encoding == -1) {
+        response_encoding(dr);
+    }
+    response_headers_prepare(dr);
+
+    if (mk_http_send(dr->request, NULL, 0, NULL) < 0) {
+        return -1;
+    }
+    dr->_st_body_writes++;
+    dr->_st_http_headers_sent = MK_TRUE;
+
+    return 0;
+}
+
+/*
+ * Hand the pending segments to the server, 'last' is set when the response
+ * ends. If there is enqueued content the segments go to the queue instead.
+ */
+static int output_flush(duda_request_t *dr, int last)
+{
+    int i;
+    int ret;
+    struct duda_output_map *out = &dr->out;
+
+    if (out->n_segs == 0 && last == MK_FALSE) {
+        return 0;
+    }
+
+    if (mk_list_is_empty(&dr->queue_out.items) != 0) {
+        return output_queue(dr);
+    }
+
+    /* First write, the headers go out with it */
+    if (dr->_st_body_writes == 0) {
+        response_encoding(dr);
+    }
+
+    if (out->compress && output_compress(dr, last) == -1) {
+        return -1;
+    }
+
+    if (dr->_st_body_writes == 0 && out->n_segs > 0) {
+        response_headers_prepare(dr);
+    }
+
+    for (i = 0; i < out->n_segs; i++) {
+        ret = mk_http_send(dr->request, out->segs[i].data, out->segs[i].len, NULL);
+        if (ret < 0) {
+            return -1;
+        }
+        dr->_st_body_writes++;
+    }
+
+    output_reset(out);
+    return 0;
+}
+
+/*
+ * Too much data pending: it's sent instead of growing the buffer. A buffered
+ * response without a fixed Content-Length continues in chunks. If content
+ * was enqueued the segments go to the queue after it, with a fixed
+ * Content-Length the headers can go out so the queue is written now.
+ */
+static int output_threshold(duda_request_t *dr)
+{
+    struct duda_output_map *out = &dr->out;
+
+    if (out->bytes < DUDA_OUTPUT_FLUSH) {
+        return 0;
+    }
+
+    if (out->mode == DUDA_OUTPUT_BUFFERED &&
+        mk_list_is_empty(&dr->queue_out.items) != 0) {
+        if (output_queue(dr) == -1 || response_headers_flush(dr) == -1) {
+            return -1;
+        }
+        return (duda_queue_flush(dr) == -1) ? -1 : 0;
+    }
+
+    if (out->mode == DUDA_OUTPUT_BUFFERED &&
+        dr->_st_http_content_length == -2) {
+        out->mode = DUDA_OUTPUT_STREAM;
+    }
+
+    return output_flush(dr, MK_FALSE);
+}
+
+/*
+ * Content was enqueued and the Content-Length is open: it's only known when
+ * the response ends, so nothing can be sent and the buffer is not allowed
+ * to grow over DUDA_OUTPUT_FLUSH bytes. It returns -1 if 'len' bytes more
+ * don't fit.
+ */
+static inline int output_room(duda_request_t *dr, size_t len)
+{
+    struct duda_output_map *out = &dr->out;
+
+    if (out->mode == DUDA_OUTPUT_BUFFERED &&
+        dr->_st_http_content_length == -2 &&
+        out->bytes + len >= DUDA_OUTPUT_FLUSH &&
+        mk_list_is_empty(&dr->queue_out.items) != 0) {
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Returns a pointer to at least 'size' free bytes at the end of the tail
+ * copy buffer, a new buffer is started if the current one is full. The
+ * bytes written must be confirmed with output_commit().
+ */
+static char *output_reserve(duda_request_t *dr, size_t size)
+{
+    size_t chunk;
+    struct duda_output_map *out = &dr->out;
+    struct duda_output_seg *seg;
+
+    if (out->tail) {
+        seg = &out->segs[out->n_segs - 1];
+        if (seg->len + size <= out->tail_size) {
+            return out->tail + seg->len;
+        }
+    }
+
+    chunk = (size > DUDA_OUTPUT_CHUNK) ? size : DUDA_OUTPUT_CHUNK;
+    seg = output_seg_new(dr);
+    if (!seg) {
+        return NULL;
+    }
+
+    seg->data = duda_gc_alloc(dr, chunk);
+    if (!seg->data) {
+        out->n_segs--;
+        return NULL;
+    }
+    seg->len = 0;
+    out->tail = seg->data;
+    out->tail_size = chunk;
+
+    return out->tail;
+}
+
+/* Confirm 'len' bytes written in the space returned by output_reserve() */
+static inline int output_commit(duda_request_t *dr, size_t len)
+{
+    struct duda_output_map *out = &dr->out;
+
+    if (output_room(dr, len) == -1) {
+        return -1;
+    }
+
+    out->segs[out->n_segs - 1].len += len;
+    out->bytes += len;
+
+    return output_threshold(dr);
+}
+
+/*
+ * Append data to the output buffer: small pieces are copied into the tail
+ * buffer, bigger ones are referenced if the caller guarantee the data will
+ * be there until the response ends.
+ */
+static int _print(duda_request_t *dr, char *raw, int len, int copy)
+{
+    char *p;
+    struct duda_output_map *out = &dr->out;
+    struct duda_output_seg *seg;
+
+    if (len <= 0) {
+        return len == 0 ? 0 : -1;
+    }
+
+    if (copy == MK_TRUE && len <= DUDA_OUTPUT_COPY_MAX) {
+        p = output_reserve(dr, len);
+        if (!p) {
+            return -1;
+        }
+        memcpy(p, raw, len);
+        return output_commit(dr, len);
+    }
+
+    if (output_room(dr, len) == -1) {
+        return -1;
+    }
+
+    seg = output_seg_new(dr);
+    if (!seg) {
+        return -1;
+    }
+    seg->data = raw;
+    seg->len  = len;
+    out->tail = NULL;
+    out->bytes += len;
+
+    return output_threshold(dr);
+}
+
+/*
+ * @METHOD_NAME: print
+ * @METHOD_DESC: It enqueue a buffer of data to be send to the HTTP client as response body.
+ * Small buffers are copied, buffers bigger than 1KB are referenced so they must stay
+ * valid until the response ends. After a sendfile() the body goes after the file: if
+ * the Content-Length was not set the response is buffered until it ends, so no more
+ * than 64KB can be added and a print() over that limit fails.
+ * @METHOD_PARAM: dr the request context information hold by a duda_request_t type
+ * @METHOD_PARAM: raw Fixed buffer of data to be send to the client
+ * @METHOD_PARAM: len Number of bytes of 'raw' to be send.
+ * @METHOD_RETURN: Upon successful completion it returns 0, on error returns -1.
+ */
+int duda_response_print(duda_request_t *dr, char *raw, int len)
+{
+    return _print(dr, raw, len, MK_TRUE);
+}
+
+
+/*
+ * @METHOD_NAME: printf
+ * @METHOD_DESC: It format and enqueue a buffer of data to be send to the HTTP client as response body.
+ * The content is formatted directly into the response buffer.
+ * @METHOD_PARAM: dr the request context information hold by a duda_request_t type
+ * @METHOD_PARAM: format Specifies the subsequent arguments to be formatted
+ * @METHOD_RETURN: Upon successful completion it returns 0, on error returns -1.
+ */
+int duda_response_printf(duda_request_t *dr, const char *format, ...)
+{
+    int n;
+    size_t avail = 0;
+    char *p = NULL;
+    va_list ap;
+    struct duda_output_map *out = &dr->out;
+
+    /* Try to format in the free space of the current buffer */
+    if (out->tail) {
+        p = out->tail + out->segs[out->n_segs - 1].len;
+        avail = out->tail_size - out->segs[out->n_segs - 1].len;
+    }
+
+    va_start(ap, format);
+    n = vsnprintf(p, avail, format, ap);
+    va_end(ap);
+
+    if (n < 0) {
+        return -1;
+    }
+
+    /* Not enough space, retry once with the exact size */
+    if ((size_t) n >= avail) {
+        p = output_reserve(dr, n + 1);
+        if (!p) {
+            return -1;
+        }
+
+        va_start(ap, format);
+        vsnprintf(p, n + 1, format, ap);
+        va_end(ap);
+    }
+
+    return output_commit(dr, n);
+}
+
+/*
+ * @METHOD_NAME: append_str_n
+ * @METHOD_DESC: It copies 'len' bytes of a string into the response body.
+ * @METHOD_PARAM: dr the request context information hold by a duda_request_t type
+ * @METHOD_PARAM: str the string to append
+ * @METHOD_PARAM: len number of bytes of 'str' to append.
+ * @METHOD_RETURN: Upon successful completion it returns 0, on error returns -1.
+ */
+int duda_response_append_str_n(duda_request_t *dr, const char *str, int len)
+{
+    char *p;
+
+    if (len <= 0) {
+        return len == 0 ? 0 : -1;
+    }
+
+    p = output_reserve(dr, len);
+    if (!p) {
+        return -1;
+    }
+    memcpy(p, str, len);
+
+    return output_commit(dr, len);
+}
+
+/* Write the decimal digits of 'val' at the end of 'buf' */
+static inline char *append_digits(char *end, uint64_t val)
+{
+    do {
+        *--end = '0' + (val % 10);
+        val /= 10;
+    } while (val > 0);
+
+    return end;
+}
+
+/*
+ * @METHOD_NAME: append_int
+ * @METHOD_DESC: It appends the decimal representation of a signed integer to
+ * the response body, no format string is parsed.
+ * @METHOD_PARAM: dr the request context information hold by a duda_request_t type
+ * @METHOD_PARAM: val the number to append
+ * @METHOD_RETURN: Upon successful completion it returns 0, on error returns -1.
+ */
+int duda_response_append_int(duda_request_t *dr, int64_t val)
+{
+    char buf[24];
+    char *end = buf + sizeof(buf);
+    char *p;
+    uint64_t u;
+
+    if (val < 0) {
+        u = (uint64_t) 0 - (uint64_t) val;
+        p = append_digits(end, u);
+        *--p = '-';
+    }
+    else {
+        p = append_digits(end, (uint64_t) val);
+    }
+
+    return duda_response_append_str_n(dr, p, end - p);
+}
+
+/*
+ * @METHOD_NAME: append_u64
+ * @METHOD_DESC: It appends the decimal representation of an unsigned 64 bits
+ * integer to the response body, no format string is parsed.
+ * @METHOD_PARAM: dr the request context information hold by a duda_request_t type
+ * @METHOD_PARAM: val the number to append
+ * @METHOD_RETURN: Upon successful completion it returns 0, on error returns -1.
+ */
+int duda_response_append_u64(duda_request_t *dr, uint64_t val)
+{
+    char buf[24];
+    char *end = buf + sizeof(buf);
+    char *p;
+
+    p = append_digits(end, val);
+    return duda_response_append_str_n(dr, p, end - p);
+}
+
+/*
+ * @METHOD_NAME: append_escaped_json
+ * @METHOD_DESC: It appends a string to the response body escaping it to be
+ * used as a JSON string value. The surrounding quotes are not added.
+ * @METHOD_PARAM: dr the request context information hold by a duda_request_t type
+ * @METHOD_PARAM: str the string to escape
+ * @METHOD_PARAM: len number of bytes of 'str'.
+ * @METHOD_RETURN: Upon successful completion it returns 0, on error returns -1.
+ */
+int duda_response_append_escaped_json(duda_request_t *dr, const char *str, int len)
+{
+    int i;
+    int n;
+    int run;
+    int ret;
+    unsigned char c;
+    char *p;
+    static const char hex[] = "0123456789abcdef";
+
+    while (len > 0) {
+        /* Each byte takes up to 6 bytes once escaped: \u00XX */
+        run = (len > 512) ? 512 : len;
+        p = output_reserve(dr, run * 6);
+        if (!p) {
+            return -1;
+        }
+
+        n = 0;
+        for (i = 0; i < run; i++) {
+            c = str[i];
+            switch (c) {
+            case '"':  p[n++] = '\\'; p[n++] = '"';  break;
+            case '\\': p[n++] = '\\'; p[n++] = '\\'; break;
+            case '\b': p[n++] = '\\'; p[n++] = 'b';  break;
+            case '\f': p[n++] = '\\'; p[n++] = 'f';  break;
+            case '\n': p[n++] = '\\'; p[n++] = 'n';  break;
+            case '\r': p[n++] = '\\'; p[n++] = 'r';  break;
+            case '\t': p[n++] = '\\'; p[n++] = 't';  break;
+            default:
+                if (c < 0x20) {
+                    p[n++] = '\\';
+                    p[n++] = 'u';
+                    p[n++] = '0';
+                    p[n++] = '0';
+                    p[n++] = hex[c >> 4];
+                    p[n++] = hex[c & 0xf];
+                }
+                else {
+                    p[n++] = c;
+                }
+            }
+        }
+
+        ret = output_commit(dr, n);
+        if (ret != 0) {
+            return ret;
+        }
+
+        str += run;
+        len -= run;
+    }
+
+    return 0;
+}
+
+/* More ranges in a single request are ignored and the whole file is sent */
+#define SENDFILE_RANGES_MAX  16
+
+struct sendfile_range {
+    off_t start;
+    off_t end;                   /* inclusive */
+};
+
+/* Compose a header row in the request arena and attach it to the response */
+static int header_row_printf(duda_request_t *dr, int size, const char *fmt, ...)
+{
+    int n;
+    char *row;
+    va_list ap;
+
+    row = duda_gc_alloc(dr, size);
+    if (!row) {
         return -1;
     }
 
-    if (dr->_st_body_writes > 0) {
-        /* FIXME: Console error */
+    va_start(ap, fmt);
+    n = vsnprintf(row, size, fmt, ap);
+    va_end(ap);
+
+    if (n < 0 || n >= size) {
         return -1;
     }
 
-    /* Calculate body length */
-    if (dr->_st_http_content_length == -2) {
-        /* FIXME
-        mk_list_foreach(head, &dr->channel.streams) {
-            stream = mk_list_entry(head, struct mk_stream, _head);
-            bytes += stream->bytes_total;
+    return duda_response_header_row(dr, row, n);
+}
+
+static inline struct mk_http_header *header_other(duda_request_t *dr,
+                                                  const char *key, int len)
+{
+    return mk_api->header_get(MK_HEADER_OTHER, dr->request, key, len);
+}
+
+static int date_num(const char *s, int n)
+{
+    int i;
+    int val = 0;
+
+    for (i = 0; i < n; i++) {
+        if (s[i] < '0' || s[i] > '9') {
+            return -1;
         }
-        dr->request->headers.content_length = bytes;
-        */
-    }
-    else if (dr->_st_http_content_length >= 0) {
-        dr->request->headers.content_length = dr->_st_http_content_length;
+        val = (val * 10) + (s[i] - '0');
     }
 
-    if (dr->request->headers.status <= 0) {
-        duda_api_exception(dr, "Callback did not set the HTTP response status");
-        abort();
-    }
+    return val;
+}
 
-    r = mk_api->header_prepare(dr->session, dr->request);
-    if (r != 0) {
-        /* FIXME: Console error */
+/* Parse an HTTP date (IMF-fixdate): Sun, 06 Nov 1994 08:49:37 GMT */
+static time_t http_date_parse(const char *s, int len)
+{
+    int i;
+    struct tm tm;
+    static const char months[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+
+    if (len < 29 || s[3] != ',' || s[4] != ' ') {
         return -1;
     }
 
-    /* Change flag status */
-    dr->_st_http_headers_sent = MK_TRUE;
+    for (i = 0; i < 12; i++) {
+        if (strncmp(s + 8, months + (i * 3), 3) == 0) {
+            break;
+        }
+    }
+    if (i == 12) {
+        return -1;
+    }
 
-    /*
-     * Concatenate list, link temporal dr->channel nodes to parent channel
-     * streams list.
-     */
+    memset(&tm, '\0', sizeof(tm));
+    tm.tm_mon  = i;
+    tm.tm_mday = date_num(s + 5, 2);
+    tm.tm_year = date_num(s + 12, 4) - 1900;
+    tm.tm_hour = date_num(s + 17, 2);
+    tm.tm_min  = date_num(s + 20, 2);
+    tm.tm_sec  = date_num(s + 23, 2);
 
-    /* FIXME: dst-2 */
-    //mk_list_cat(&dr->channel.streams, &(dr->session->channel)->streams);
+    if (tm.tm_mday < 0 || tm.tm_year < 0 || tm.tm_hour < 0 ||
+        tm.tm_min < 0 || tm.tm_sec < 0) {
+        return -1;
+    }
 
-    return 0;
+    return timegm(&tm);
 }
 
 /*
- * @METHOD_NAME: http_status
- * @METHOD_DESC: It set the HTTP response status code
- * @METHOD_PARAM: dr the request context information hold by a duda_request_t type
- * @METHOD_PARAM: status the HTTP code status
- * @METHOD_RETURN: Upon successful completion it returns 0, on error returns -1.
+ * Check an ETag against a If-None-Match list, weak comparison. The ETag of
+ * a compressed version of the file matches too.
  */
-int duda_response_http_status(duda_request_t *dr, int status)
+static int etag_match(mk_ptr_t *list, char *etag, int len)
 {
-    mk_http_status(dr->request, status);
-    return 0;
-}
+    int n;
+    int encoding;
+    char *ext;
+    char *p = list->data;
+    char *end = p + list->len;
+
+    while (p < end) {
+        while (p < end && (*p == ' ' || *p == ',')) {
+            p++;
+        }
 
-/*
- * @METHOD_NAME: http_header
- * @METHOD_DESC: It adds a new HTTP header to the response
- * @METHOD_PARAM: dr the request context information hold by a duda_request_t type
- * @METHOD_PARAM: row fixed string containing the header details, it must not include CRLF
- * or similar break line characters.
- * @METHOD_RETURN: Upon successful completion it returns 0, on error returns -1.
- */
-int duda_response_http_header(duda_request_t *dr, char *row)
-{
-    return mk_api->header_add(dr->request, row, strlen(row));
+        if (p < end && *p == '*') {
+            return MK_TRUE;
+        }
+
+        if (end - p > 2 && p[0] == 'W' && p[1] == '/') {
+            p += 2;
+        }
+
+        n = 0;
+        while (p + n < end && p[n] != ',' && p[n] != ' ') {
+            n++;
+        }
+
+        if (n == len && memcmp(p, etag, len) == 0) {
+            return MK_TRUE;
+        }
+
+        /* "<etag>-<ext>" */
+        if (n > len + 1 && memcmp(p, etag, len - 1) == 0 &&
+            p[len - 1] == '-' && p[n - 1] == '"') {
+            for (encoding = DUDA_COMPRESS_GZIP;
+                 encoding <= DUDA_COMPRESS_ZSTD; encoding++) {
+                ext = duda_compress_ext(encoding);
+                if ((int) strlen(ext) == n - len - 1 &&
+                    memcmp(p + len, ext, n - len - 1) == 0) {
+                    return MK_TRUE;
+                }
+            }
+        }
+        p += n;
+    }
+
+    return MK_FALSE;
 }
 
-/*
- * @METHOD_NAME: http_header_n
- * @METHOD_DESC: It adds a new HTTP header to the response but specifying the number of bytes.
- * @METHOD_PARAM: dr the request context information hold by a duda_request_t type
- * @METHOD_PARAM: row fixed string containing the header details, it must not include CRLF
- * or similar break line characters.
- * @METHOD_PARAM: len specify the number of bytes of 'row' to set as header.
- * @METHOD_RETURN: Upon successful completion it returns 0, on error returns -1.
- */
-int duda_response_http_header_n(duda_request_t *dr, char *row, int len)
+/* Returns MK_TRUE if the validators of the client match the file */
+static int sendfile_not_modified(duda_request_t *dr, char *etag, int etag_len,
+                                 time_t mtime)
 {
-    return mk_api->header_add(dr->request, row, len);
+    time_t since;
+    struct mk_http_header *header;
+
+    header = header_other(dr, "if-none-match", 13);
+    if (header) {
+        return etag_match(&header->val, etag, etag_len);
+    }
+
+    header = mk_api->header_get(MK_HEADER_IF_MODIFIED_SINCE, dr->request,
+                                NULL, 0);
+    if (header) {
+        since = http_date_parse(header->val.data, header->val.len);
+        if (since != -1 && mtime <= since) {
+            return MK_TRUE;
+        }
+    }
+
+    return MK_FALSE;
 }
 
-/*
- * @METHOD_NAME: http_content_length
- * @METHOD_DESC: It sets a fixed content length header value. If you set the value -1 the Content-Length header will not be send.
- * @METHOD_PARAM: dr the request context information hold by a duda_request_t type
- * @METHOD_PARAM: length the body length.
- * @METHOD_RETURN: This method always returns zero
- */
-int duda_response_http_content_length(duda_request_t *dr, long length)
+/* If-Range: the ranges apply only if the file is the one the client has */
+static int sendfile_if_range(duda_request_t *dr, struct duda_fcache_entry *fe)
 {
-    dr->_st_http_content_length = length;
-    return 0;
+    struct mk_http_header *header;
+
+    header = header_other(dr, "if-range", 8);
+    if (!header) {
+        return MK_TRUE;
+    }
+
+    if (header->val.len > 0 && header->val.data[0] == '"') {
+        return (header->val.len == (unsigned) fe->etag_len &&
+                memcmp(header->val.data, fe->etag, fe->etag_len) == 0);
+    }
+
+    return http_date_parse(header->val.data, header->val.len) == fe->mtime;
 }
 
 /*
- * @METHOD_NAME: http_content_type
- * @METHOD_DESC: Given a known mime extension, it lookup the mime type associated and
- * compose the HTTP Content-Type header.
- * @METHOD_PARAM: dr the request context information hold by a duda_request_t type
- * @METHOD_PARAM: extension the mime extension. e.g: 'jpg'.
- * @METHOD_RETURN: Upon successful completion it returns 0, on error returns -1.
+ * Parse a Range header. It returns the number of satisfiable ranges, zero
+ * if none of them can be satisfied or -1 if the header must be ignored.
  */
-int duda_response_http_content_type(duda_request_t *dr, char *extension)
+static int sendfile_range_parse(mk_ptr_t *h, off_t size,
+                                struct sendfile_range *ranges)
 {
+    int n = 0;
     int len;
-    char *header;
-    struct mimetype *m;
+    int dash;
+    uint64_t a;
+    uint64_t b;
+    char *p;
+    char *end;
 
-    m = mk_api->mimetype_lookup(extension);
-    if (!m) {
+    if (h->len < 6 || strncasecmp(h->data, "bytes=", 6) != 0) {
         return -1;
     }
 
-    /* FIXME
-    header = mk_api->mem_alloc(32);
-    len = snprintf(header, 32, "Content-Type: %s", m->type.data);
-    duda_response_http_header_n(dr, header, len - 2);
-    duda_gc_add(dr, header);
-    */
+    p = h->data + 6;
+    end = h->data + h->len;
 
-    return 0;
+    while (p < end) {
+        while (p < end && (*p == ' ' || *p == ',')) {
+            p++;
+        }
+        if (p == end) {
+            break;
+        }
+
+        len = 0;
+        dash = -1;
+        while (p + len < end && p[len] != ',' && p[len] != ' ') {
+            if (p[len] == '-' && dash == -1) {
+                dash = len;
+            }
+            len++;
+        }
+        if (dash == -1) {
+            return -1;
+        }
+
+        if (dash == 0) {
+            /* suffix: the last 'b' bytes */
+            if (duda_utils_strtoull(p + 1, len - 1, &b) != 0) {
+                return -1;
+            }
+            if (b > 0 && size > 0) {
+                if (n == SENDFILE_RANGES_MAX) {
+                    return -1;
+                }
+                ranges[n].start = ((off_t) b >= size) ? 0 : size - b;
+                ranges[n].end   = size - 1;
+                n++;
+            }
+        }
+        else {
+            if (duda_utils_strtoull(p, dash, &a) != 0) {
+                return -1;
+            }
+            if (dash + 1 == len) {
+                b = size - 1;
+            }
+            else if (duda_utils_strtoull(p + dash + 1, len - dash - 1, &b) != 0 ||
+                     b < a) {
+                return -1;
+            }
+
+            if ((off_t) a < size) {
+                if (n == SENDFILE_RANGES_MAX) {
+                    return -1;
+                }
+                ranges[n].start = a;
+                ranges[n].end   = ((off_t) b >= size) ? size - 1 : (off_t) b;
+                n++;
+            }
+        }
+        p += len;
+    }
+
+    return n;
 }
 
-/* Compose the body_buffer */
-static int _print(duda_request_t *dr, char *raw, int len, int free)
+static int queue_sendfile(duda_request_t *dr, struct duda_fcache_entry *fe,
+                          off_t offset, size_t count)
 {
-    struct duda_body_buffer *body_buffer;
-
-    /* FIXME
-    mk_api->stream_set(NULL,
-                       MK_STREAM_COPYBUF,
-                       &dr->channel,
-                       raw,
-                       len,
-                       NULL,
-                       NULL, NULL, NULL);
-    */
-    mk_http_send(dr->request, raw, len, NULL);
-    return 0;
+    struct duda_sendfile *sf;
+    struct duda_queue_item *item;
 
-    /* FIXME! Link data */
-    if (free == MK_TRUE) {
-        mk_api->iov_add(body_buffer->buf, raw, len, MK_FALSE);
+    sf = duda_sendfile_entry(fe, offset, count);
+    if (!sf) {
+        return -1;
     }
-    else {
-        mk_api->iov_add(body_buffer->buf, raw, len, MK_FALSE);
+
+    item = duda_queue_item_new(DUDA_QTYPE_SENDFILE);
+    if (!item) {
+        duda_sendfile_free(sf);
+        return -1;
     }
+    item->data = sf;
 
-    return 0;
+    return response_queue_add(dr, item);
 }
 
-/*
- * @METHOD_NAME: print
- * @METHOD_DESC: It enqueue a buffer of data to be send to the HTTP client as response body.
- * @METHOD_PARAM: dr the request context information hold by a duda_request_t type
- * @METHOD_PARAM: raw Fixed buffer of data to be send to the client
- * @METHOD_PARAM: len Number of bytes of 'raw' to be send.
- * @METHOD_RETURN: Upon successful completion it returns 0, on error returns -1.
- */
-int duda_response_print(duda_request_t *dr, char *raw, int len)
+/* Enqueue a piece of text, it must be valid until the request ends */
+static int queue_text(duda_request_t *dr, char *data, int len)
 {
-    return _print(dr, raw, len, MK_FALSE);
+    struct duda_body_buffer *bb;
+    struct duda_queue_item *item;
+
+    bb = duda_body_buffer_new();
+    if (!bb) {
+        return -1;
+    }
+    duda_body_buffer_add(bb, data, len);
+
+    item = duda_queue_item_new(DUDA_QTYPE_BODY_BUFFER);
+    if (!item) {
+        mk_api->iov_free(bb->buf);
+        mk_api->mem_free(bb);
+        return -1;
+    }
+    item->data = bb;
+
+    return response_queue_add(dr, item);
 }
 
+/* 206 with several ranges: a multipart/byteranges body */
+static int sendfile_multipart(duda_request_t *dr, struct duda_fcache_entry *fe,
+                              struct sendfile_range *ranges, int n)
+{
+    int i;
+    int len;
+    int size;
+    char *part;
+    char boundary[40];
+    mk_ptr_t *type = &dr->request->headers.content_type;
+
+    snprintf(boundary, sizeof(boundary), "%lx%08lx",
+             (unsigned long) (fe->ino ^ fe->mtime), (unsigned long) random());
+
+    for (i = 0; i < n; i++) {
+        size = 128 + type->len;
+        part = duda_gc_alloc(dr, size);
+        if (!part) {
+            return -1;
+        }
+
+        len = snprintf(part, size,
+                       "%s--%s\r\n%.*sContent-Range: bytes %lu-%lu/%lu\r\n\r\n",
+                       (i == 0) ? "" : "\r\n", boundary,
+                       (int) type->len, type->data ? type->data : "",
+                       (unsigned long) ranges[i].start,
+                       (unsigned long) ranges[i].end,
+                       (unsigned long) fe->size);
+        if (len >= size) {
+            return -1;
+        }
+
+        if (queue_text(dr, part, len) != 0 ||
+            queue_sendfile(dr, fe, ranges[i].start,
+                           ranges[i].end - ranges[i].start + 1) != 0) {
+            return -1;
+        }
+    }
+
+    part = duda_gc_alloc(dr, 64);
+    if (!part) {
+        return -1;
+    }
+    len = snprintf(part, 64, "\r\n--%s--\r\n", boundary);
+    if (queue_text(dr, part, len) != 0) {
+        return -1;
+    }
+
+    /* The row is in the arena too, Content-Type holds the whole row */
+    part = duda_gc_alloc(dr, 80);
+    if (!part) {
+        return -1;
+    }
+    type->data = part;
+    type->len  = snprintf(part, 80,
+                          "Content-Type: multipart/byteranges; boundary=%s\r\n",
+                          boundary);
+
+    return 0;
+}
 
 /*
- * @METHOD_NAME: printf
- * @METHOD_DESC: It format and enqueue a buffer of data to be send to the HTTP client as response body.
- * The buffer allocated is freed internally when the data is flushed completely.
- * @METHOD_PARAM: dr the request context information hold by a duda_request_t type
- * @METHOD_PARAM: format Specifies the subsequent arguments to be formatted
- * @METHOD_RETURN: Upon successful completion it returns 0, on error returns -1.
+ * Send a file that is the whole response body: conditional requests are
+ * answered with 304 without opening the file, Range requests with 206 and
+ * one or more parts of the file.
  */
-int duda_response_printf(duda_request_t *dr, const char *format, ...)
+static int sendfile_http(duda_request_t *dr, char *path)
 {
-    int ret;
-    int n, size = 128;
-    char *p, *np;
-    va_list ap;
+    int n = -1;
+    int ret = 0;
+    int etag_len;
+    char etag[40];
+    char date[32];
+    off_t size;
+    time_t mtime;
+    struct tm tm;
+    struct stat st;
+    struct mk_http_header *header;
+    struct duda_fcache_entry *fe;
+    struct sendfile_range ranges[SENDFILE_RANGES_MAX];
+
+    fe = duda_fcache_find(path);
+    if (fe) {
+        size = fe->size;
+        mtime = fe->mtime;
+        etag_len = fe->etag_len;
+        memcpy(etag, fe->etag, etag_len);
+    }
+    else {
+        if (stat(path, &st) != 0 || !S_ISREG(st.st_mode)) {
+            return -1;
+        }
+        size = st.st_size;
+        mtime = st.st_mtime;
+        etag_len = duda_fcache_etag(etag, sizeof(etag), st.st_mtime, st.st_size);
+    }
 
-    if ((p = mk_mem_alloc(size)) == NULL) {
-        return -1;
+    if (sendfile_not_modified(dr, etag, etag_len, mtime) == MK_TRUE) {
+        if (fe) {
+            duda_fcache_put(fe);
+        }
+        duda_response_http_status(dr, 304);
+        dr->_st_http_content_length = -1;
     }
+    else {
+        if (!fe) {
+            fe = duda_fcache_get(path);
+            if (!fe) {
+                return -1;
+            }
+            size = fe->size;
+            mtime = fe->mtime;
+            etag_len = fe->etag_len;
+            memcpy(etag, fe->etag, etag_len);
+        }
 
-    /* Try to print in the allocated space. */
-    while (1) {
-        va_start(ap, format);
-        n = vsnprintf(p, size, format, ap);
+        if (dr->request->method == MK_METHOD_GET &&
+            sendfile_if_range(dr, fe) == MK_TRUE) {
+            header = mk_api->header_get(MK_HEADER_RANGE, dr->request, NULL, 0);
+            if (header) {
+                n = sendfile_range_parse(&header->val, fe->size, ranges);
+            }
+        }
 
-        /* If that worked, return the string. */
-        if (n > -1 && n < size)
-            break;
+        /* Parts of the file are never compressed */
+        if (n >= 0) {
+            dr->out.encoding = DUDA_COMPRESS_NONE;
+        }
+
+        if (n == 0) {
+            duda_response_http_status(dr, 416);
+            dr->_st_http_content_length = 0;
+            ret = header_row_printf(dr, 64, "Content-Range: bytes */%lu\r\n",
+                                    (unsigned long) fe->size);
+        }
+        else if (n == 1) {
+            duda_response_http_status(dr, 206);
+            ret = header_row_printf(dr, 80, "Content-Range: bytes %lu-%lu/%lu\r\n",
+                                    (unsigned long) ranges[0].start,
+                                    (unsigned long) ranges[0].end,
+                                    (unsigned long) fe->size);
+            if (ret == 0) {
+                ret = queue_sendfile(dr, fe, ranges[0].start,
+                                     ranges[0].end - ranges[0].start + 1);
+            }
+        }
+        else if (n > 1) {
+            duda_response_http_status(dr, 206);
+            ret = sendfile_multipart(dr, fe, ranges, n);
+        }
+        else {
+            ret = queue_sendfile(dr, fe, 0, 0);
+        }
+        duda_fcache_put(fe);
 
-        size *= 2;  /* twice the old size */
-        if ((np = mk_mem_realloc(p, size)) == NULL) {
-            mk_mem_free(p);
-            return - 1;
-        } else {
-            p = np;
+        if (ret != 0) {
+            return -1;
         }
     }
-    va_end(ap);
 
-    ret = _print(dr, p, n, MK_TRUE);
-    if (ret == -1) {
-        mk_mem_free(p);
+    /*
+     * The whole file, or a 304 for it, depends on the encoding that is
+     * decided with the headers: its ETag is set at that point.
+     */
+    if (n == -1) {
+        dr->out.etag = duda_gc_alloc(dr, etag_len);
+        if (!dr->out.etag) {
+            return -1;
+        }
+        memcpy(dr->out.etag, etag, etag_len);
+        dr->out.etag_len = etag_len;
+        dr->out.etag_size = size;
+    }
+    else {
+        header_row_printf(dr, 64, "ETag: %.*s\r\n", etag_len, etag);
+        duda_response_header_row(dr, "Accept-Ranges: bytes\r\n", 22);
     }
 
-    return ret;
+    /* Validators */
+    gmtime_r(&mtime, &tm);
+    strftime(date, sizeof(date), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+    header_row_printf(dr, 64, "Last-Modified: %s\r\n", date);
+
+    return 0;
 }
 
 /*
  * @METHOD_NAME: sendfile
  * @METHOD_DESC: It enqueue a filesystem file to be send to the HTTP client as response body. Multiple
- * files can be enqueued, all of them are send in order.
+ * files can be enqueued, all of them are send in order. If the file is the whole response body
+ * of a GET or HEAD request, the ETag and Last-Modified validators are sent and the conditional
+ * and Range request headers are handled: the response status is changed to 304, 206 or 416 if
+ * required. In that case the HTTP status must be set before invoking this method.
  * @METHOD_PARAM: dr the request context information hold by a duda_request_t type
  * @METHOD_PARAM: path the absolute path of the file to be send.
  * @METHOD_RETURN: Upon successful completion it returns 0, on error returns -1.
  */
 int duda_response_sendfile(duda_request_t *dr, char *path)
 {
+    int status = dr->request->headers.status;
+    int method = dr->request->method;
     struct duda_sendfile *sf;
     struct duda_queue_item *item;
 
+    if (response_queue_check(dr) == -1) {
+        return -1;
+    }
+
+    if (dr->_st_http_headers_off == MK_FALSE && dr->_st_body_writes == 0 &&
+        dr->out.bytes == 0 && mk_list_is_empty(&dr->queue_out.items) == 0 &&
+        (status == 0 || status == 200) &&
+        (method == MK_METHOD_GET || method == MK_METHOD_HEAD)) {
+        return sendfile_http(dr, path);
+    }
+
     sf = duda_sendfile_new(path, 0, 0);
     if (!sf) {
         return -1;
     }
 
     item = duda_queue_item_new(DUDA_QTYPE_SENDFILE);
+    if (!item) {
+        duda_sendfile_free(sf);
+        return -1;
+    }
     item->data = sf;
-    duda_queue_add(item, &dr->queue_out);
 
-    return 0;
+    return response_queue_add(dr, item);
 }
 
 
@@ -330,16 +1645,23 @@ int duda_response_sendfile_range(duda_request_t *dr, char *path,
     struct duda_sendfile *sf;
     struct duda_queue_item *item;
 
+    if (response_queue_check(dr) == -1) {
+        return -1;
+    }
+
     sf = duda_sendfile_new(path, offset, count);
     if (!sf) {
         return -1;
     }
 
     item = duda_queue_item_new(DUDA_QTYPE_SENDFILE);
+    if (!item) {
+        duda_sendfile_free(sf);
+        return -1;
+    }
     item->data = sf;
-    duda_queue_add(item, &dr->queue_out);
 
-    return 0;
+    return response_queue_add(dr, item);
 }
 
 
@@ -402,14 +1724,42 @@ int duda_response_end(duda_request_t *dr, void (*end_cb) (duda_request_t *))
     }
 
     dr->end_callback = end_cb;
+    dr->_st_response_end = MK_TRUE;
+
+    ret = output_flush(dr, MK_TRUE);
+    if (ret == -1) {
+        return -1;
+    }
+
+    /* A response without body, or with enqueued content, needs its headers */
+    if (response_headers_flush(dr) == -1) {
+        return -1;
+    }
 
-    ret = duda_response_send_headers(dr);
+    /*
+     * Write the enqueued content, if the socket can't take all of it the
+     * write events continue and complete the response.
+     */
+    ret = duda_queue_flush(dr);
     if (ret == -1) {
         return -1;
     }
+    else if (ret > 0) {
+        return 0;
+    }
 
-    /* flush some enqueued content */
-    //ret = duda_queue_flush(dr);
+    duda_response_complete(dr);
+    return 0;
+}
+
+/*
+ * The whole response body was handed over: let the server finish the
+ * request and release the service resources.
+ */
+int duda_response_complete(duda_request_t *dr)
+{
+    mk_http_done(dr->request);
+    dr->_st_http_headers_sent = MK_TRUE;
 
     /*
      * The lesson of the day Feb 2, 2013: I must NEVER forget that when sending the
@@ -421,11 +1771,7 @@ int duda_response_end(duda_request_t *dr, void (*end_cb) (duda_request_t *))
      */
     mk_api->socket_cork_flag(dr->session->socket, TCP_CORK_OFF);
 
-    if (ret == 0) {
-        //duda_service_end(dr);
-    }
-
-    return 0;
+    return duda_service_end(dr);
 }
 
 /*
@@ -450,7 +1796,10 @@ int duda_response_finalize(duda_request_t *dr, void (*end_cb) (duda_request_t *)
 /*
  * @METHOD_NAME: flush
  * @METHOD_DESC: It flush the enqueued body content, this cover any data enqueued through
- * print(), printf() or sendfile() methods. This method should not be used inside the middle
+ * print(), printf() or sendfile() methods. A buffered response without a fixed
+ * Content-Length is switched to streaming mode, unless files were enqueued: in that
+ * case the headers go out with the length of the content enqueued so far and no more
+ * content can be added. This method should not be used inside the middle
  * of a callback routine, it's expected to be used at the end of a callback as the content
  * is flushed in asynchronous mode.
  * @METHOD_PARAM: dr the request context information hold by a duda_request_t type
@@ -458,6 +1807,22 @@ int duda_response_finalize(duda_request_t *dr, void (*end_cb) (duda_request_t *)
  */
 int duda_response_flush(duda_request_t *dr)
 {
+    if (dr->_st_body_writes == 0 && dr->_st_http_content_length == -2 &&
+        mk_list_is_empty(&dr->queue_out.items) == 0) {
+        dr->out.mode = DUDA_OUTPUT_STREAM;
+    }
+
+    if (output_flush(dr, MK_FALSE) == -1) {
+        return -1;
+    }
+
+    if (mk_list_is_empty(&dr->queue_out.items) == 0) {
+        return 0;
+    }
+
+    if (response_headers_flush(dr) == -1) {
+        return -1;
+    }
     return duda_queue_flush(dr);
 }
 
@@ -473,8 +1838,15 @@ struct duda_api_response *duda_response_object()
     obj->http_header_n       = duda_response_http_header_n;
     obj->http_content_length = duda_response_http_content_length;
     obj->http_content_type   = duda_response_http_content_type;
+    obj->http_cache_control  = duda_response_http_cache_control;
+    obj->stream              = duda_response_stream;
+    obj->static_header       = duda_response_static_header;
     obj->print               = duda_response_print;
     obj->printf              = duda_response_printf;
+    obj->append_str_n        = duda_response_append_str_n;
+    obj->append_int          = duda_response_append_int;
+    obj->append_u64          = duda_response_append_u64;
+    obj->append_escaped_json = duda_response_append_escaped_json;
     obj->sendfile            = duda_response_sendfile;
     obj->sendfile_range      = duda_response_sendfile_range;
     obj->wait                = duda_response_wait;
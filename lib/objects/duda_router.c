@@ -17,11 +17,29 @@
  *  limitations under the License.
  */
 
+#include <limits.h>
+
 #include <duda/duda.h>
+#include <duda/duda_utils.h>
 #include <duda/objects/duda_router.h>
 
 #define ROUTER_REDIR_SIZE 64
 
+/* Capture types that can be set on a ':name<type>' pattern segment */
+struct router_var_type {
+    char *name;
+    int name_len;
+    int type;
+};
+
+static struct router_var_type router_var_types[] = {
+    {"u64",    3, DUDA_ROUTER_TU64   },
+    {"i64",    3, DUDA_ROUTER_TI64   },
+    {"double", 6, DUDA_ROUTER_TDOUBLE},
+    {"slug",   4, DUDA_ROUTER_TSLUG  },
+    {NULL,     0, 0}
+};
+
 /* Router Internals */
 
 /*
@@ -36,11 +54,21 @@ struct duda_router_path *router_new_path(char *pattern,
 {
     struct duda_router_path *path;
 
-    path                = mk_mem_alloc(sizeof(struct duda_router_path));
-    path->pattern       = mk_string_dup(pattern);
+    path = mk_mem_alloc(sizeof(struct duda_router_path));
+    if (!path) {
+        return NULL;
+    }
+
+    path->pattern = mk_string_dup(pattern);
+    if (!path->pattern) {
+        mk_mem_free(path);
+        return NULL;
+    }
     path->pattern_len   = strlen(pattern);
     path->callback      = callback;
     path->callback_name = callback_name;
+    path->n_params      = 0;
+    path->params        = NULL;
     mk_list_init(&path->fields);
 
     /* Redirect flags, for details please read comments on duda_router.h */
@@ -55,18 +83,382 @@ struct duda_router_path *router_new_path(char *pattern,
     return path;
 }
 
+/* Unlink a path that could not be registered and release it */
+static void router_path_free(struct duda_router_path *path)
+{
+    struct mk_list *head;
+    struct mk_list *tmp;
+    struct duda_router_field *field;
+
+    mk_list_foreach_safe(head, tmp, &path->fields) {
+        field = mk_list_entry(head, struct duda_router_field, _head);
+        mk_list_del(&field->_head);
+        mk_mem_free(field->name);
+        mk_mem_free(field);
+    }
+
+    mk_list_del(&path->_head);
+    mk_mem_free(path->params);
+    mk_mem_free(path->pattern);
+    mk_mem_free(path);
+}
+
+/*
+ * For a ':var' pattern segment, return its capture type and set in
+ * 'name_len' the length of the segment without the '<type>' suffix. If
+ * the type is unknown it returns -1.
+ */
+static int router_var_type(char *segment, int len, int *name_len)
+{
+    int i;
+    int tlen;
+    char *type;
+    char *end;
+
+    end = memchr(segment, '<', len);
+    if (!end) {
+        *name_len = len;
+        return DUDA_ROUTER_TANY;
+    }
+
+    *name_len = end - segment;
+    if (*name_len <= 1 || segment[len - 1] != '>') {
+        return -1;
+    }
+
+    type = end + 1;
+    tlen = (segment + len - 1) - type;
+
+    for (i = 0; router_var_types[i].name; i++) {
+        if (router_var_types[i].name_len == tlen &&
+            memcmp(router_var_types[i].name, type, tlen) == 0) {
+            return router_var_types[i].type;
+        }
+    }
+
+    return -1;
+}
+
+/*
+ * Validate an URI segment against a capture type, numeric values are
+ * converted and stored on the URI field so they are parsed only once.
+ */
+static inline int router_var_check(int type, char *segment, int len,
+                                   struct duda_router_uri_field *field)
+{
+    int i;
+    int c;
+
+    switch (type) {
+    case DUDA_ROUTER_TANY:
+        break;
+    case DUDA_ROUTER_TU64:
+        if (duda_utils_strtoull(segment, len, &field->val.u64) != 0) {
+            return -1;
+        }
+        break;
+    case DUDA_ROUTER_TI64:
+        if (duda_utils_strtoll(segment, len, &field->val.i64) != 0) {
+            return -1;
+        }
+        break;
+    case DUDA_ROUTER_TDOUBLE:
+        if (duda_utils_strtod(segment, len, &field->val.d) != 0) {
+            return -1;
+        }
+        break;
+    case DUDA_ROUTER_TSLUG:
+        for (i = 0; i < len; i++) {
+            c = segment[i];
+            if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+                (c >= '0' && c <= '9') || c == '-' || c == '_') {
+                continue;
+            }
+            return -1;
+        }
+        break;
+    default:
+        return -1;
+    }
+
+    field->type = type;
+    return 0;
+}
+
+/* Typed captures are tried first, DUDA_ROUTER_TANY is always the last */
+static inline int router_var_order(int type)
+{
+    if (type == DUDA_ROUTER_TANY) {
+        return INT_MAX;
+    }
+    return type;
+}
+
+/* Get or create the ':var' child node of a given capture type */
+static struct duda_router_node *router_node_add_var(struct duda_router_node *node,
+                                                    int type)
+{
+    int i;
+    struct duda_router_node *var;
+    struct duda_router_node **tmp;
+
+    for (i = 0; i < node->n_vars; i++) {
+        if (node->vars[i]->var_type == type) {
+            return node->vars[i];
+        }
+        if (router_var_order(node->vars[i]->var_type) > router_var_order(type)) {
+            break;
+        }
+    }
+
+    tmp = mk_mem_realloc(node->vars,
+                         sizeof(struct duda_router_node *) * (node->n_vars + 1));
+    if (!tmp) {
+        return NULL;
+    }
+    node->vars = tmp;
+
+    var = mk_mem_alloc_z(sizeof(struct duda_router_node));
+    if (!var) {
+        return NULL;
+    }
+    var->var_type = type;
+
+    memmove(node->vars + i + 1, node->vars + i,
+            sizeof(struct duda_router_node *) * (node->n_vars - i));
+    node->vars[i] = var;
+    node->n_vars++;
+
+    return var;
+}
+
+/* Binary search of a static child node given a segment */
+struct duda_router_node *duda_router_node_child(struct duda_router_node *node,
+                                                char *key, int len, int *pos)
+{
+    int ret;
+    int low = 0;
+    int mid;
+    int high = node->n_children - 1;
+    struct duda_router_node *child;
+
+    while (low <= high) {
+        mid = (low + high) / 2;
+        child = node->children[mid];
+
+        if (child->key_len != len) {
+            ret = child->key_len - len;
+        }
+        else {
+            ret = memcmp(child->key, key, len);
+        }
+
+        if (ret == 0) {
+            return child;
+        }
+        else if (ret < 0) {
+            low = mid + 1;
+        }
+        else {
+            high = mid - 1;
+        }
+    }
+
+    if (pos) {
+        *pos = low;
+    }
+    return NULL;
+}
+
+static struct duda_router_node *router_node_add_child(struct duda_router_node *node,
+                                                      char *key, int len)
+{
+    int pos = 0;
+    struct duda_router_node *child;
+    struct duda_router_node **tmp;
+
+    child = duda_router_node_child(node, key, len, &pos);
+    if (child) {
+        return child;
+    }
+
+    tmp = mk_mem_realloc(node->children,
+                         sizeof(struct duda_router_node *) * (node->n_children + 1));
+    if (!tmp) {
+        return NULL;
+    }
+    node->children = tmp;
+
+    child = mk_mem_alloc_z(sizeof(struct duda_router_node));
+    if (!child) {
+        return NULL;
+    }
+    child->key = mk_string_copy_substr(key, 0, len);
+    child->key_len = len;
+
+    /* Keep the children sorted */
+    memmove(node->children + pos + 1, node->children + pos,
+            sizeof(struct duda_router_node *) * (node->n_children - pos));
+    node->children[pos] = child;
+    node->n_children++;
+
+    return child;
+}
+
+/* Compile a router path into the service tree */
+static int router_tree_add(struct duda_service *ds, struct duda_router_path *path)
+{
+    int len;
+    int type;
+    int name_len;
+    int offset = 0;
+    char *segment;
+    struct duda_router_node *node;
+
+    if (!ds->router_tree) {
+        ds->router_tree = mk_mem_alloc_z(sizeof(struct duda_router_node));
+        if (!ds->router_tree) {
+            return -1;
+        }
+    }
+
+    node = ds->router_tree;
+    while ((len = duda_router_next_segment(path->pattern, path->pattern_len,
+                                           &offset, &segment)) > 0) {
+        if (segment[0] == ':') {
+            type = router_var_type(segment, len, &name_len);
+            if (type == -1) {
+                return -1;
+            }
+            node = router_node_add_var(node, type);
+            if (!node) {
+                return -1;
+            }
+        }
+        else {
+            node = router_node_add_child(node, segment, len);
+            if (!node) {
+                return -1;
+            }
+        }
+    }
+
+    if (node->path) {
+        mk_warn("Duda: router path '%s' already mapped by '%s'",
+                path->pattern, node->path->pattern);
+        return -1;
+    }
+
+    node->path = path;
+    return 0;
+}
+
+void duda_router_tree_free(struct duda_router_node *node)
+{
+    int i;
+
+    if (!node) {
+        return;
+    }
+
+    for (i = 0; i < node->n_children; i++) {
+        duda_router_tree_free(node->children[i]);
+    }
+    for (i = 0; i < node->n_vars; i++) {
+        duda_router_tree_free(node->vars[i]);
+    }
+
+    mk_mem_free(node->children);
+    mk_mem_free(node->vars);
+    mk_mem_free(node->key);
+    mk_mem_free(node);
+}
+
+/*
+ * Walk the tree for the URI segments starting at 'offset'. Static children
+ * are preferred over variables and typed variables over untyped ones, a
+ * segment is only taken by a variable if it pass the type check. If a
+ * branch do not match we backtrack. When
+ * no deeper route is found, the route ending at the current node (if any)
+ * matches as a prefix, the same behavior of the old list based lookup.
+ *
+ * Each segment found is stored on 'ruri' while walking, so once the lookup
+ * finish the parameters are ready to be consumed by the param object.
+ */
+static struct duda_router_path *router_tree_match(struct duda_router_node *node,
+                                                  char *uri, int uri_len,
+                                                  int offset, int depth,
+                                                  struct duda_router_uri *ruri,
+                                                  int *exact)
+{
+    int i;
+    int len;
+    char *segment = NULL;
+    struct duda_router_node *child;
+    struct duda_router_node *var;
+    struct duda_router_uri_field *field;
+    struct duda_router_path *p;
+
+    len = duda_router_next_segment(uri, uri_len, &offset, &segment);
+    if (len == 0) {
+        *exact = MK_TRUE;
+        return node->path;
+    }
+
+    if (depth < DUDA_ROUTER_URI_MAX) {
+        field = &ruri->fields[depth];
+        field->type = DUDA_ROUTER_TANY;
+        field->name = segment;
+        field->name_len = len;
+        if (ruri->len <= depth) {
+            ruri->len = depth + 1;
+        }
+
+        child = duda_router_node_child(node, segment, len, NULL);
+        if (child) {
+            p = router_tree_match(child, uri, uri_len, offset, depth + 1,
+                                  ruri, exact);
+            if (p) {
+                return p;
+            }
+        }
+
+        for (i = 0; i < node->n_vars; i++) {
+            var = node->vars[i];
+            if (router_var_check(var->var_type, segment, len, field) != 0) {
+                continue;
+            }
+
+            p = router_tree_match(var, uri, uri_len, offset, depth + 1,
+                                  ruri, exact);
+            if (p) {
+                return p;
+            }
+        }
+        field->type = DUDA_ROUTER_TANY;
+    }
+
+    *exact = MK_FALSE;
+    return node->path;
+}
+
 static int router_add_static(char *pattern,
                              void (*callback)(duda_request_t *),
-                             struct mk_list *list)
+                             struct duda_service *ds)
 {
     struct duda_router_path *path;
 
-    path = router_new_path(pattern, callback, "", list);
+    path = router_new_path(pattern, callback, "", &ds->router_list);
     if (!path) {
         return -1;
     }
     path->type = DUDA_ROUTER_STATIC;
 
+    if (router_tree_add(ds, path) != 0) {
+        router_path_free(path);
+        return -1;
+    }
+
     return 0;
 }
 
@@ -83,6 +475,9 @@ static struct mk_list *router_split_pattern(char *pattern)
     struct mk_string_line *new;
 
     list = mk_mem_alloc(sizeof(struct mk_list));
+    if (!list) {
+        return NULL;
+    }
     mk_list_init(list);
 
     len = strlen(pattern);
@@ -110,6 +505,12 @@ static struct mk_list *router_split_pattern(char *pattern)
 
         /* Alloc node */
         new = mk_mem_alloc(sizeof(struct mk_string_line));
+        if (!val || !new) {
+            mk_mem_free(val);
+            mk_mem_free(new);
+            mk_string_split_free(list);
+            return NULL;
+        }
         new->val = val;
         new->len = val_len;
 
@@ -122,8 +523,10 @@ static struct mk_list *router_split_pattern(char *pattern)
 
 static int router_add_dynamic(char *pattern,
                               void (*callback)(duda_request_t *),
-                              struct mk_list *list)
+                              struct duda_service *ds)
 {
+    int slot = 0;
+    int name_len;
     struct mk_list *head;
     struct mk_list *plist;
     struct mk_string_line *entry;
@@ -143,8 +546,9 @@ static int router_add_dynamic(char *pattern,
         return -1;
     }
 
-    path = router_new_path(pattern, callback, "", list);
+    path = router_new_path(pattern, callback, "", &ds->router_list);
     if (!path) {
+        mk_string_split_free(plist);
         return -1;
     }
     path->type = DUDA_ROUTER_DYNAMIC;
@@ -154,19 +558,79 @@ static int router_add_dynamic(char *pattern,
 
         /* allocate memory for the field, lookup the type and register */
         field = mk_mem_alloc(sizeof(struct duda_router_field));
+        if (!field) {
+            goto error;
+        }
+
         if (entry->val[0] == ':') {
             field->type = DUDA_ROUTER_FVAR;
+            field->var_type = router_var_type(entry->val, entry->len,
+                                              &name_len);
+            if (field->var_type == -1) {
+                mk_err("Duda: invalid variable type '%s' on router path '%s'",
+                       entry->val, pattern);
+                mk_mem_free(field);
+                goto error;
+            }
         }
         else {
             field->type = DUDA_ROUTER_FKEY;
+            field->var_type = DUDA_ROUTER_TANY;
+            name_len = entry->len;
+        }
+        field->name = mk_string_copy_substr(entry->val, 0, name_len);
+        if (!field->name) {
+            mk_mem_free(field);
+            goto error;
         }
-        field->name = mk_string_dup(entry->val);
-        field->name_len = entry->len;
+        field->name_len = name_len;
 
         mk_list_add(&field->_head, &path->fields);
+
+        if (field->type == DUDA_ROUTER_FVAR) {
+            path->n_params++;
+        }
     }
     mk_string_split_free(plist);
+    plist = NULL;
+
+    /*
+     * Resolve each variable to the position of its segment in the URI, so
+     * the param object can reach the value without walking the fields.
+     */
+    if (path->n_params > 0) {
+        path->params = mk_mem_alloc(sizeof(struct duda_router_param) *
+                                    path->n_params);
+        if (!path->params) {
+            goto error;
+        }
+    }
+
+    path->n_params = 0;
+    mk_list_foreach(head, &path->fields) {
+        field = mk_list_entry(head, struct duda_router_field, _head);
+        if (field->type == DUDA_ROUTER_FVAR) {
+            path->params[path->n_params].name     = field->name + 1;
+            path->params[path->n_params].name_len = field->name_len - 1;
+            path->params[path->n_params].type     = field->var_type;
+            path->params[path->n_params].slot     = slot;
+            path->n_params++;
+        }
+        slot++;
+    }
+
+    if (router_tree_add(ds, path) != 0) {
+        goto error;
+    }
+
     return 0;
+
+ error:
+    if (plist) {
+        mk_string_split_free(plist);
+    }
+    router_path_free(path);
+    return -1;
 }
 
 /*
@@ -176,7 +640,7 @@ static int router_add_dynamic(char *pattern,
 int duda_router_redirect(duda_request_t *dr)
 {
     int len;
-    int port_redirect;
+    int port_redirect = 0;
     int redirect_size;
     char *buf;
     char *host;
@@ -195,8 +659,7 @@ int duda_router_redirect(duda_request_t *dr)
                      dr->request->uri_processed.len + 2);
 
     buf = duda_gc_alloc(dr, redirect_size);
-    host = mk_api->pointer_to_buf(dr->request->host);
-    duda_gc_add(dr, host);
+    host = duda_gc_strndup(dr, dr->request->host.data, dr->request->host.len);
 
     /*
      * Add ending slash to the location string
@@ -230,91 +693,50 @@ int duda_router_redirect(duda_request_t *dr)
 
 
 /*
- * Given a specific duda request context, it lookup a router path,
- * if it find a match, the 'path' variable will be set and the
- * function will return zero. If no path is found it will return -1.
+ * Given a service and an incoming request, it lookup a router path on the
+ * service tree. If it find a match, the 'path' variable will be set and the
+ * function will return DUDA_ROUTER_MATCH, the URI segments are stored on
+ * 'ruri' on the same pass. If no path is found it returns DUDA_ROUTER_NOTFOUND.
  *
- * There is a specific exception where 'path' can be NULL and the return
- * value zero, just when the path_lookup instructed a HTTP redirection.
+ * If the path was defined with an ending slash and the request URI do not
+ * contain it, 'path' is set and DUDA_ROUTER_REDIRECT is returned, the caller
+ * is in charge to perform the HTTP redirection.
  */
 int duda_router_path_lookup(struct duda_service *ds,
                             mk_request_t *sr,
-                            struct duda_router_path **path)
+                            struct duda_router_path **path,
+                            struct duda_router_uri *ruri)
 {
-    int offset = 0;
+    int exact = MK_FALSE;
     int uri_len;
     char *uri_data;
-    struct mk_list *head;
     struct duda_router_path *p;
-    duda_request_t *dr = NULL; /* FIXME */
+
     *path = NULL;
+    ruri->len = 0;
+
+    if (!ds->router_tree) {
+        return DUDA_ROUTER_NOTFOUND;
+    }
 
     uri_data = sr->uri_processed.data;
     uri_len  = sr->uri_processed.len;
 
-    /* Go around each router rule */
-    mk_list_foreach(head, &ds->router_list) {
-        p = mk_list_entry(head, struct duda_router_path, _head);
+    p = router_tree_match(ds->router_tree, uri_data, uri_len, 0, 0,
+                          ruri, &exact);
+    if (!p) {
+        return DUDA_ROUTER_NOTFOUND;
+    }
 
-        /* Static processing */
-        if (p->type == DUDA_ROUTER_STATIC) {
-            if (strncmp(uri_data, p->pattern, p->pattern_len) == 0) {
-                *path = p;
-                return DUDA_ROUTER_MATCH;
-            }
-            else if (p->redirect == MK_TRUE) {
-                /* Check if we need to send back a redirection */
-                if (strncmp(uri_data, p->pattern, p->pattern_len - 1) == 0 &&
-                    uri_len <= p->pattern_len) {
-                    duda_router_redirect(dr);
-                    return DUDA_ROUTER_REDIRECT;
-                }
-            }
-        }
-        else if (p->type == DUDA_ROUTER_DYNAMIC) {
-            /* This is a very lazy lookup */
-            int i = 0;
-            int match = MK_FALSE;
-            struct mk_list *dhead;
-            struct duda_router_field *field;
-
-            mk_list_foreach(dhead, &p->fields) {
-                if (i == dr->router_uri.len) {
-                    match = MK_FALSE;
-                    break;
-                }
-
-                field = mk_list_entry(dhead, struct duda_router_field, _head);
-                if (field->type == DUDA_ROUTER_FKEY) {
-                    if (strncmp(field->name,
-                                dr->router_uri.fields[i].name,
-                                field->name_len) == 0 &&
-                        field->name_len == dr->router_uri.fields[i].name_len) {
-                        match = MK_TRUE;
-                    }
-                    else {
-                        match = MK_FALSE;
-                        break;
-                    }
-                }
-                else if (field->type == DUDA_ROUTER_FVAR) {
-                    i++;
-                    continue;
-                }
-                if (match == MK_FALSE) {
-                    break;
-                }
-                i++;
-            }
+    *path = p;
 
-            if (match == MK_TRUE) {
-                *path = p;
-                return DUDA_ROUTER_MATCH;
-            }
-        }
+    /* Check if we need to send back a redirection */
+    if (exact == MK_TRUE && p->redirect == MK_TRUE &&
+        uri_len > 0 && uri_data[uri_len - 1] != '/') {
+        return DUDA_ROUTER_REDIRECT;
     }
 
-    return DUDA_ROUTER_NOTFOUND;
+    return DUDA_ROUTER_MATCH;
 }
 
 /* Given a Duda request, determinate if it belongs to a 'root request' */
@@ -456,7 +878,10 @@ int duda_router_uri_parse(duda_request_t *dr)
  * @METHOD_DESC: It register a Router interface and pattern associating it
  * to a service callback.
  * @METHOD_PROTO: int map(char *pattern, void (*callback)(duda_request_t *))
- * @METHOD_PARAM: pattern the string pattern representing the URL format.
+ * @METHOD_PARAM: pattern the string pattern representing the URL format. A
+ * variable can restrict the values it accepts with a type, e.g: '/user/:id<u64>',
+ * available types are u64, i64, double and slug. If a segment do not match the
+ * type, the next route is tried.
  * @METHOD_PARAM: callback the callback function invoked once the pattern matches.
  * @METHOD_RETURN: Upon successful completion it returns 0, on error returns -1.
  */
@@ -474,10 +899,10 @@ int duda_router_map(struct duda_service *ds,
 
     tmp = strstr(pattern, ":");
     if (!tmp) {
-        ret = router_add_static(pattern, callback, &ds->router_list);
+        ret = router_add_static(pattern, callback, ds);
     }
     else {
-        ret = router_add_dynamic(pattern, callback, &ds->router_list);
+        ret = router_add_dynamic(pattern, callback, ds);
     }
 
     return ret;
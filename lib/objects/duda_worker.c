@@ -39,7 +39,7 @@ static void *duda_worker_step(void *arg)
     void *ret;
     struct duda_worker *wk = (struct duda_worker *) arg;
 
-    /* initialize same data as done for server workers */
+    /* initialize the thread context, the event loop bound data is left out */
     duda_worker_init();
 
     /* call the target function */
@@ -0,0 +1,201 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Duda I/O
+ *  --------
+ *  Copyright (C) 2012-2016, Eduardo Silva P. <eduardo@monkey.io>.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+/*
+ * The output queue of a request holds a body buffer and a file, both much
+ * bigger than the socket send buffer. The first flush leaves most of it
+ * pending, the rest must go out through the write events of the worker
+ * loop while a slow reader takes it from the other end. The test checks
+ * every byte and that the write interest is dropped once the queue is
+ * empty.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+
+#include <monkey/mk_api.h>
+#include <duda/duda.h>
+#include <duda/duda_event.h>
+#include <duda/duda_queue.h>
+#include <duda/duda_sendfile.h>
+#include <duda/duda_body_buffer.h>
+
+#define TEST_SNDBUF      8192
+#define TEST_BODY_SIZE   (1 << 20)
+#define TEST_FILE_SIZE   (2 << 20)
+#define TEST_TOTAL       (TEST_BODY_SIZE + TEST_FILE_SIZE)
+#define TEST_TIMEOUT     30
+
+static struct plugin_api api;
+static struct mk_event_loop *loop;
+
+static char *expected;
+static char *received;
+static size_t received_len;
+
+static struct mk_event_loop *test_sched_loop()
+{
+    return loop;
+}
+
+static int test_send_file(int socket, int fd, off_t *offset, size_t count)
+{
+    return sendfile(socket, fd, offset, count);
+}
+
+static void *reader(void *data)
+{
+    int fd = *(int *) data;
+    ssize_t bytes;
+
+    while (received_len < TEST_TOTAL) {
+        bytes = read(fd, received + received_len, 4096);
+        if (bytes <= 0) {
+            break;
+        }
+        received_len += bytes;
+        usleep(50);
+    }
+
+    return NULL;
+}
+
+static int fail(const char *msg)
+{
+    fprintf(stderr, "queue_drain: %s\n", msg);
+    return EXIT_FAILURE;
+}
+
+int main()
+{
+    int i;
+    int fd;
+    int ret;
+    int size = TEST_SNDBUF;
+    int sv[2];
+    int rounds = 0;
+    char path[] = "/tmp/duda-queue-drain.XXXXXX";
+    pthread_t tid;
+    duda_request_t dr;
+    struct mk_http_session session;
+    struct mk_event *event;
+    struct duda_sendfile *sf;
+    struct duda_body_buffer *bb;
+    struct duda_queue_item *item;
+
+    api.mem_alloc        = mk_mem_alloc;
+    api.mem_alloc_z      = mk_mem_alloc_z;
+    api.mem_realloc      = mk_mem_realloc;
+    api.mem_free         = mk_mem_free;
+    api.iov_create       = mk_iov_create;
+    api.iov_realloc      = mk_iov_realloc;
+    api.iov_add          = mk_iov_add;
+    api.iov_free         = mk_iov_free;
+    api.socket_send_file = test_send_file;
+    api.sched_loop       = test_sched_loop;
+    api.ev_add           = mk_event_add;
+    api.ev_del           = mk_event_del;
+    mk_api = &api;
+
+    alarm(TEST_TIMEOUT);
+
+    loop = mk_event_loop_create(16);
+    if (!loop) {
+        return fail("could not create the event loop");
+    }
+
+    expected = malloc(TEST_TOTAL);
+    received = malloc(TEST_TOTAL);
+    if (!expected || !received) {
+        return fail("out of memory");
+    }
+    for (i = 0; i < TEST_TOTAL; i++) {
+        expected[i] = 'a' + (i * 7) % 26;
+    }
+
+    fd = mkstemp(path);
+    if (fd == -1 ||
+        write(fd, expected + TEST_BODY_SIZE, TEST_FILE_SIZE) != TEST_FILE_SIZE) {
+        return fail("could not create the test file");
+    }
+    close(fd);
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0) {
+        return fail("socketpair");
+    }
+    setsockopt(sv[0], SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+    setsockopt(sv[1], SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+    fcntl(sv[0], F_SETFL, fcntl(sv[0], F_GETFL) | O_NONBLOCK);
+
+    memset(&session, '\0', sizeof(session));
+    session.socket = sv[0];
+
+    memset(&dr, '\0', sizeof(dr));
+    dr.socket  = sv[0];
+    dr.session = &session;
+    duda_queue_init(&dr.queue_out);
+
+    /* body buffer followed by the file */
+    bb = duda_body_buffer_new();
+    duda_body_buffer_add(bb, expected, TEST_BODY_SIZE);
+    item = duda_queue_item_new(DUDA_QTYPE_BODY_BUFFER);
+    item->data = bb;
+    duda_queue_add(item, &dr.queue_out);
+
+    sf = duda_sendfile_new(path, 0, 0);
+    if (!sf) {
+        return fail("could not open the test file");
+    }
+    item = duda_queue_item_new(DUDA_QTYPE_SENDFILE);
+    item->data = sf;
+    duda_queue_add(item, &dr.queue_out);
+
+    ret = duda_queue_flush(&dr);
+    if (ret <= 0 || dr._st_write_pending != MK_TRUE) {
+        return fail("the first flush must leave data pending");
+    }
+
+    pthread_create(&tid, NULL, reader, &sv[1]);
+
+    while (dr._st_write_pending == MK_TRUE) {
+        mk_event_wait(loop);
+        mk_event_foreach(event, loop) {
+            event->handler(event);
+        }
+        rounds++;
+    }
+
+    pthread_join(tid, NULL);
+    unlink(path);
+
+    if (duda_queue_length(&dr.queue_out) != 0) {
+        return fail("the queue was not drained");
+    }
+    if (received_len != TEST_TOTAL ||
+        memcmp(expected, received, TEST_TOTAL) != 0) {
+        return fail("the received data does not match");
+    }
+
+    printf("queue_drain: %d bytes in %d write events\n", TEST_TOTAL, rounds);
+    return 0;
+}